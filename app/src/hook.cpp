@@ -3,14 +3,23 @@
 #include <bitmanip.h>
 
 #include <iostream>
+#include <fstream>
+#include <iterator>
 #include <iomanip>
 #include <sstream>
 #include <cstring>
 #include <vector>
 #include <string>
 #include <algorithm>
+#include <set>
+#include <unordered_map>
+#include <utility>
 #include <limits.h>
 #include <bitset>
+#include <chrono>
+#include <thread>
+#include <csignal>
+#include <stdexcept>
 
 using int_t = uintptr_t;
 using ptr_t = void*;
@@ -41,6 +50,63 @@ struct flip_data {
     ~flip_data() = default;
 };
 
+struct split_op {
+    int_t method = 0;
+    int_t args[3] = {0, 0, 0};
+    int_t status = 0;
+};
+
+struct flip_event {
+    uint64_t seq = 0;
+    uint64_t rip = 0;
+    uint64_t gva = 0;
+    uint64_t orig_gva = 0;
+    uint64_t gpa = 0;
+    uint64_t cr3 = 0;
+    uint64_t tsc = 0;
+    uint32_t bits = 0;
+    uint32_t vcpuid = 0;
+};
+
+constexpr const uint64_t flip_wire_version = 1;
+constexpr const uint64_t flip_wire_same_page = 1ULL << 3;
+constexpr const uint64_t flip_wire_gpa_in_page = 1ULL << 4;
+constexpr const uint64_t flip_wire_same_cr3 = 1ULL << 5;
+
+constexpr const size_t num_exit_kinds = 8;
+constexpr const size_t exit_stats_buckets = 32;
+constexpr const uint64_t exit_stats_version = 1;
+
+const char *const exit_kind_names[num_exit_kinds] = {
+    "read",
+    "read (emulated)",
+    "write",
+    "exec",
+    "foreign cr3",
+    "unexpected",
+    "thrash",
+    "monitor trap"
+};
+
+struct exit_latency {
+    uint64_t count = 0;
+    uint64_t total = 0;
+    uint64_t max = 0;
+    uint64_t buckets[exit_stats_buckets] = {};
+};
+
+struct vcpu_exit_stats {
+    uint64_t vcpuid = 0;
+    exit_latency kinds[num_exit_kinds];
+};
+
+struct exit_stats_header {
+    uint64_t version = 0;
+    uint64_t num_kinds = 0;
+    uint64_t num_buckets = 0;
+    uint64_t num_vcpus = 0;
+};
+
 namespace access_t
 {
     constexpr const auto read = 0;
@@ -100,6 +166,588 @@ transl(T addr, const int_t base)
     return addr - base + ida_base;
 }
 
+// Set by SIGINT, so that we can unregister the flip ring before exiting.
+volatile std::sig_atomic_t g_stop = 0;
+
+void
+stop_handler(int)
+{ g_stop = 1; }
+
+/// Flip ring in the VMM
+///
+/// The VMM allocates the ring when it's registered, and we drain it with
+/// VMCALLs into our own buffer, so nothing of ours has to stay mapped.
+///
+class flip_ring_reader
+{
+public:
+
+    flip_ring_reader(ioctl &ctl, size_t capacity)
+        : m_ctl(ctl)
+        , m_events(4096)
+    {
+        // VMCALL: Register flip ring.
+        vmcall_registers_t regs;
+        regs.r00 = VMCALL_REGISTERS;
+        regs.r01 = VMCALL_MAGIC_NUMBER;
+        regs.r02 = 12;
+        regs.r03 = capacity;
+        m_ctl.call_ioctl_vmcall(&regs, 0);
+
+        if (regs.r02 == 0)
+            throw std::runtime_error("failed to register the flip ring");
+    }
+
+    ~flip_ring_reader()
+    {
+        // VMCALL: Unregister flip ring.
+        vmcall_registers_t regs;
+        regs.r00 = VMCALL_REGISTERS;
+        regs.r01 = VMCALL_MAGIC_NUMBER;
+        regs.r02 = 13;
+        m_ctl.call_ioctl_vmcall(&regs, 0);
+    }
+
+    /// Calls f(event) for every event the VMM has published since the
+    /// last call.
+    ///
+    /// @return the number of consumed events
+    ///
+    template<typename F>
+    size_t
+    consume(F f)
+    {
+        size_t consumed = 0;
+
+        while (true)
+        {
+            // VMCALL: Read flip ring.
+            vmcall_registers_t regs;
+            regs.r00 = VMCALL_REGISTERS;
+            regs.r01 = VMCALL_MAGIC_NUMBER;
+            regs.r02 = 21;
+            regs.r03 = reinterpret_cast<int_t>(m_events.data());
+            regs.r04 = m_events.size() * sizeof(flip_event);
+            m_ctl.call_ioctl_vmcall(&regs, 0);
+
+            const auto num_read = static_cast<size_t>(regs.r02);
+            m_dropped = regs.r03;
+
+            for (size_t i = 0; i < num_read; i++)
+                f(m_events[i]);
+
+            consumed += num_read;
+            if (num_read < m_events.size())
+                return consumed;
+        }
+    }
+
+    /// Returns the number of events the VMM had to drop so far (as of
+    /// the last call to consume()).
+    ///
+    uint64_t
+    dropped() const
+    { return m_dropped; }
+
+private:
+
+    ioctl &m_ctl;
+    std::vector<flip_event> m_events;
+    uint64_t m_dropped = 0;
+};
+
+/// Prints a single flip.
+///
+void
+print_flip(int_t bits, int_t rip, int_t gva, int_t orig_gva, int_t cr3, const int_t module_base)
+{
+    std::cout
+      << "["
+      << (is_bit_set(bits, access_t::read)     ? "R" : "-")
+      << (is_bit_set(bits, access_t::write)    ? "W" : "-")
+      << (is_bit_set(bits, access_t::exec)     ? "X" : "-")
+      << "]:"
+      << " rip: " << hex_out_s(transl(rip, module_base))
+      << " gva: " << hex_out_s(transl(gva, module_base))
+      << " orig_gva: " << hex_out_s(transl(orig_gva, module_base))
+      << " cr3: " << hex_out_s(cr3, 8);
+}
+
+/// Streams flip events from the VMM until interrupted (Ctrl+C).
+///
+void
+stream_flips(ioctl &ctl, const int_t module_base)
+{
+    std::signal(SIGINT, stop_handler);
+
+    // 1 MB worth of events.
+    flip_ring_reader ring(ctl, 1024 * 1024 / sizeof(flip_event));
+    std::cout << "streaming flips (Ctrl+C to stop)" << std::endl;
+
+    while (g_stop == 0)
+    {
+        auto &&consumed = ring.consume([&](const flip_event &event)
+        {
+            // Filter out execute only flips.
+            if (is_bit_set(event.bits, access_t::exec))
+                return;
+
+            print_flip(event.bits, event.rip, event.gva, event.orig_gva, event.cr3, module_base);
+            std::cout << " vcpu: " << event.vcpuid << std::endl;
+        });
+
+        if (consumed == 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    std::cout << "dropped events: " << ring.dropped() << std::endl;
+}
+
+/// Flip sites aggregated by (rip, bits), plus an index ordered by counter
+///
+/// Only the sites that changed since the last refresh are re-sorted, so a
+/// refresh costs O(changes * log(sites)) and printing the top N costs
+/// O(N), no matter how many sites there are.
+///
+class flip_top
+{
+public:
+
+    /// Adds <count> flips to the site of <flip>
+    ///
+    void
+    add(const flip_data &flip, int_t count)
+    {
+        auto &&site = m_sites[key(flip.rip, flip.bits)];
+        if (site.counter == 0)
+            site = flip;
+        else
+        {
+            site.gva = flip.gva;
+            site.cr3 = flip.cr3;
+        }
+
+        if (!site.dirty)
+        {
+            site.dirty = true;
+            site.sorted_counter = site.counter;
+            m_dirty.push_back(key(flip.rip, flip.bits));
+        }
+
+        site.counter += count;
+    }
+
+    /// Re-sorts the sites that changed since the last call
+    ///
+    /// @return the number of changed sites
+    ///
+    size_t
+    update()
+    {
+        for (const auto &k : m_dirty)
+        {
+            auto &&site = m_sites[k];
+
+            m_order.erase(std::make_pair(site.sorted_counter, k));
+            m_order.emplace(site.counter, k);
+            site.dirty = false;
+        }
+
+        auto &&changed = m_dirty.size();
+        m_dirty.clear();
+
+        return changed;
+    }
+
+    /// Calls f(site) for the <n> busiest sites
+    ///
+    template<typename F>
+    void
+    for_each_top(size_t n, F f) const
+    {
+        for (auto it = m_order.rbegin(); it != m_order.rend() && n > 0; ++it, --n)
+            f(m_sites.at(it->second));
+    }
+
+    size_t
+    size() const
+    { return m_sites.size(); }
+
+private:
+
+    struct site_type : flip_data {
+        int_t sorted_counter = 0;
+        bool dirty = false;
+
+        site_type &
+        operator=(const flip_data &flip)
+        {
+            flip_data::operator=(flip);
+            counter = 0;
+            return *this;
+        }
+    };
+
+    static std::pair<int_t, int_t>
+    key(int_t rip, int_t bits)
+    { return std::make_pair(rip, bits); }
+
+    struct key_hash {
+        size_t operator()(const std::pair<int_t, int_t> &k) const
+        { return std::hash<int_t>()(k.first * 8 + k.second); }
+    };
+
+    std::unordered_map<std::pair<int_t, int_t>, site_type, key_hash> m_sites;
+    std::set<std::pair<int_t, std::pair<int_t, int_t>>> m_order;
+    std::vector<std::pair<int_t, int_t>> m_dirty;
+};
+
+/// Decodes the flip records packed by the VMM (see flip_wire.h)
+///
+/// @return false if the format isn't supported or the buffer is cut short
+///
+bool
+unpack_flips(const std::vector<uint8_t> &buffer, std::vector<flip_data> &flips, uint64_t &error_bound)
+{
+    size_t pos = 0;
+    auto ok = true;
+
+    auto &&get = [&]() -> uint64_t
+    {
+        uint64_t value = 0;
+        for (auto shift = 0; shift < 64 && pos < buffer.size(); shift += 7)
+        {
+            const auto byte = buffer[pos++];
+            value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+
+            if ((byte & 0x80) == 0)
+                return value;
+        }
+
+        ok = false;
+        return 0;
+    };
+
+    auto &&get_signed = [&](const uint64_t prev) -> uint64_t
+    {
+        const auto &&zigzag = get();
+        return prev + ((zigzag >> 1) ^ (0 - (zigzag & 1)));
+    };
+
+    flips.clear();
+    if (get() != flip_wire_version)
+        return false;
+
+    const auto &&num = get();
+    error_bound = get();
+
+    flip_data prev;
+    for (uint64_t i = 0; ok && i < num; i++)
+    {
+        flip_data flip;
+
+        flip.rip = prev.rip + get();
+        const auto &&flags = get();
+        flip.bits = flags & 0x7;
+        flip.orig_gva = get_signed(prev.orig_gva);
+
+        flip.gva = get();
+        if ((flags & flip_wire_same_page) != 0)
+            flip.gva += flip.orig_gva & ~0xFFFULL;
+
+        if ((flags & flip_wire_gpa_in_page) != 0)
+        {
+            flip.d_pa = get_signed(prev.d_pa >> 12) << 12;
+            flip.gpa = flip.d_pa + (flip.gva & 0xFFF);
+        }
+        else
+        {
+            flip.gpa = get();
+            flip.d_pa = get();
+        }
+
+        flip.cr3 = (flags & flip_wire_same_cr3) != 0 ? prev.cr3 : get();
+        flip.counter = get();
+
+        flips.push_back(flip);
+        prev = flip;
+    }
+
+    return ok;
+}
+
+/// Reads a snapshot of the flip log
+///
+/// @param ring_head if not null, set to the <seq> of the latest flip ring
+///     event the snapshot already contains
+///
+/// @return by how much the counters may overestimate (0 if they're exact)
+///
+uint64_t
+read_flips(ioctl &ctl, std::vector<flip_data> &flips, uint64_t *ring_head = nullptr)
+{
+    vmcall_registers_t regs;
+    flips.clear();
+
+    // VMCALL: Get data num (takes the snapshot).
+    regs.r00 = VMCALL_REGISTERS;
+    regs.r01 = VMCALL_MAGIC_NUMBER;
+    regs.r02 = 7;
+    ctl.call_ioctl_vmcall(&regs, 0);
+
+    if (ring_head != nullptr)
+        *ring_head = regs.r03;
+
+    if (regs.r02 == 0)
+        return 0;
+
+    // Records usually pack into less than 16 bytes. If they don't fit,
+    // the VMM keeps the snapshot and tells us how much it needs.
+    std::vector<uint8_t> buffer(regs.r02 * 16);
+    while (true)
+    {
+        // VMCALL: Get packed flip data.
+        regs.r00 = VMCALL_REGISTERS;
+        regs.r01 = VMCALL_MAGIC_NUMBER;
+        regs.r02 = 16;
+        regs.r03 = reinterpret_cast<int_t>(buffer.data());
+        regs.r04 = buffer.size();
+        ctl.call_ioctl_vmcall(&regs, 0);
+
+        const auto &&fits = regs.r02 <= buffer.size();
+        buffer.resize(regs.r02);
+
+        if (fits)
+            break;
+    }
+
+    uint64_t error_bound = 0;
+    if (!unpack_flips(buffer, flips, error_bound))
+        throw std::runtime_error("unsupported flip data format");
+
+    return error_bound;
+}
+
+/// Follows the flips live and redraws the <top_n> busiest flip sites
+/// every <interval> milliseconds (until interrupted with Ctrl+C).
+///
+/// Starts from one snapshot of the flip log, and from then on only reads
+/// the flip ring, i.e. the flips that happened since the last refresh.
+/// Ring events the snapshot already contains are skipped. Flips that
+/// other vCPUs make while the snapshot is taken may still be counted
+/// twice.
+///
+void
+follow_flips(ioctl &ctl, const int_t module_base, const unsigned interval, const size_t top_n)
+{
+    std::signal(SIGINT, stop_handler);
+
+    // Register the ring before the snapshot, so that nothing gets lost
+    // between the snapshot and the first refresh.
+    flip_ring_reader ring(ctl, 1024 * 1024 / sizeof(flip_event));
+
+    std::vector<flip_data> snapshot;
+    uint64_t snapshot_head = 0;
+    read_flips(ctl, snapshot, &snapshot_head);
+
+    flip_top top;
+    for (const auto &flip : snapshot)
+    {
+        // Filter out execute only flips.
+        if (!is_bit_set(flip.bits, access_t::exec))
+            top.add(flip, flip.counter);
+    }
+
+    while (g_stop == 0)
+    {
+        ring.consume([&](const flip_event &event)
+        {
+            // Skip the flips the snapshot has counted already.
+            if (event.seq <= snapshot_head)
+                return;
+
+            // Filter out execute only flips.
+            if (is_bit_set(event.bits, access_t::exec))
+                return;
+
+            top.add(flip_data(event.rip, event.gva, event.orig_gva, event.gpa, 0, event.cr3, event.bits, 0), 1);
+        });
+
+        auto &&changed = top.update();
+
+        std::cout << std::endl
+            << "top " << top_n << " of " << top.size() << " flip sites"
+            << " (" << changed << " changed, " << ring.dropped() << " dropped)"
+            << std::endl;
+
+        top.for_each_top(top_n, [&](const flip_data &flip)
+        {
+            print_flip(flip.bits, flip.rip, flip.gva, flip.orig_gva, flip.cr3, module_base);
+            std::cout << " counter: " << flip.counter << std::endl;
+        });
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(interval));
+    }
+}
+
+/// Prints the exit counters and latency histograms of all vCPUs.
+///
+void
+print_exit_stats(ioctl &ctl)
+{
+    vmcall_registers_t regs;
+
+    // Retry with a bigger buffer if there are more vCPUs than we guessed.
+    size_t num_vcpus = 64;
+    std::vector<uint8_t> buffer;
+
+    while (true)
+    {
+        buffer.assign(sizeof(exit_stats_header) + num_vcpus * sizeof(vcpu_exit_stats), 0);
+
+        // VMCALL: Get exit stats.
+        regs.r00 = VMCALL_REGISTERS;
+        regs.r01 = VMCALL_MAGIC_NUMBER;
+        regs.r02 = 14;
+        regs.r03 = reinterpret_cast<int_t>(buffer.data());
+        regs.r04 = buffer.size();
+        ctl.call_ioctl_vmcall(&regs, 0);
+
+        if (regs.r02 <= num_vcpus)
+            break;
+
+        num_vcpus = regs.r02;
+    }
+
+    auto &&header = reinterpret_cast<const exit_stats_header *>(buffer.data());
+    if (header->version != exit_stats_version || header->num_kinds != num_exit_kinds || header->num_buckets != exit_stats_buckets)
+    {
+        std::cout << "unsupported exit stats (version " << header->version << ")" << std::endl;
+        return;
+    }
+
+    auto &&records = reinterpret_cast<const vcpu_exit_stats *>(buffer.data() + sizeof(exit_stats_header));
+    for (size_t i = 0; i < header->num_vcpus; i++)
+    {
+        std::cout << "vcpu " << records[i].vcpuid << std::endl;
+
+        for (size_t kind = 0; kind < num_exit_kinds; kind++)
+        {
+            const auto &latency = records[i].kinds[kind];
+            if (latency.count == 0)
+                continue;
+
+            std::cout << "  " << std::left << std::setw(16) << exit_kind_names[kind] << std::right
+                << " count: " << latency.count
+                << " avg: " << latency.total / latency.count
+                << " max: " << latency.max << " ticks" << std::endl;
+
+            // Buckets are powers of two (in TSC ticks).
+            std::cout << "  " << std::setw(16) << "";
+            for (size_t b = 0; b < exit_stats_buckets; b++)
+            {
+                if (latency.buckets[b] != 0)
+                    std::cout << " 2^" << b << ": " << latency.buckets[b];
+            }
+            std::cout << std::endl;
+        }
+    }
+}
+
+/// Prints the debug events of the VMM as they are recorded, until
+/// interrupted (Ctrl+C).
+///
+void
+follow_events(ioctl &ctl)
+{
+    std::signal(SIGINT, stop_handler);
+
+    vmcall_registers_t regs;
+    std::vector<char> buffer(64 * 1024);
+
+    while (g_stop == 0)
+    {
+        // VMCALL: Read event log.
+        regs.r00 = VMCALL_REGISTERS;
+        regs.r01 = VMCALL_MAGIC_NUMBER;
+        regs.r02 = 15;
+        regs.r03 = reinterpret_cast<int_t>(buffer.data());
+        regs.r04 = buffer.size();
+        ctl.call_ioctl_vmcall(&regs, 0);
+
+        if (regs.r02 == 0)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            continue;
+        }
+
+        std::cout.write(buffer.data(), static_cast<std::streamsize>(std::min<size_t>(regs.r02, buffer.size())));
+        std::cout.flush();
+    }
+}
+
+/// Saves the splits of the VMM (with their code pages) to <path>
+///
+/// The snapshot is opaque to us, it's only handed back by load_splits().
+///
+void
+save_splits(ioctl &ctl, const std::string &path)
+{
+    vmcall_registers_t regs;
+
+    // If the snapshot doesn't fit, the VMM tells us how much it needs.
+    std::vector<uint8_t> buffer(64 * 1024);
+    while (true)
+    {
+        // VMCALL: Export splits.
+        regs.r00 = VMCALL_REGISTERS;
+        regs.r01 = VMCALL_MAGIC_NUMBER;
+        regs.r02 = 19;
+        regs.r03 = reinterpret_cast<int_t>(buffer.data());
+        regs.r04 = buffer.size();
+        ctl.call_ioctl_vmcall(&regs, 0);
+
+        const auto &&fits = regs.r02 <= buffer.size();
+        buffer.resize(regs.r02);
+
+        if (fits)
+            break;
+    }
+
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char *>(buffer.data()), static_cast<std::streamsize>(buffer.size()));
+
+    if (!file)
+        throw std::runtime_error("unable to write " + path);
+
+    std::cout << "saved splits to " << path << " (" << buffer.size() << " bytes)" << std::endl;
+}
+
+/// Re-installs the splits saved by save_splits() from <path>
+///
+void
+load_splits(ioctl &ctl, const std::string &path)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+        throw std::runtime_error("unable to open " + path);
+
+    std::vector<uint8_t> buffer((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    if (buffer.empty())
+        throw std::runtime_error(path + " is empty");
+
+    // VMCALL: Import splits.
+    vmcall_registers_t regs;
+    regs.r00 = VMCALL_REGISTERS;
+    regs.r01 = VMCALL_MAGIC_NUMBER;
+    regs.r02 = 20;
+    regs.r03 = reinterpret_cast<int_t>(buffer.data());
+    regs.r04 = buffer.size();
+    ctl.call_ioctl_vmcall(&regs, 0);
+
+    std::cout << "loaded " << regs.r02 << " splits from " << path << std::endl;
+}
+
 int
 main(int argc, const char *argv[])
 {
@@ -127,11 +775,24 @@ main(int argc, const char *argv[])
         /// 8 = get_flip_data(int_t out_addr, int_t out_size)
         /// 9 = clear_flip_data()
         /// 10 = remove_flip_entry(int_t rip)
+        /// 11 = batch_split_ops(int_t ops_addr, size_t num_ops)
+        /// 12 = register_flip_ring(size_t capacity)
+        /// 13 = unregister_flip_ring()
+        /// 14 = get_exit_stats(int_t out_addr, int_t out_size)
+        /// 15 = read_event_log(int_t out_addr, int_t out_size)
+        /// 16 = get_flip_data_packed(int_t out_addr, int_t out_size)
+        /// 17 = create_split_range(int_t gva, size_t size)
+        /// 18 = apply_patches(int_t patches_addr, size_t patches_size)
+        /// 19 = export_splits(int_t out_addr, int_t out_size)
+        /// 20 = import_splits(int_t in_addr, size_t in_size)
+        /// 21 = read_flip_ring(int_t out_addr, int_t out_size)
         ///
         /// <r03+> for args
         ///
 
         int_t module_base = ida_base;
+        const unsigned follow_interval = 1000;
+        const size_t follow_top_n = 20;
         if (argc == 2)
         {
             std::string cmd{ argv[1] };
@@ -153,6 +814,12 @@ main(int argc, const char *argv[])
                     << "  --clear, -c: Clear flip data log" << std::endl
                     << "  --remove, -r <addr>: Remove all entries with give address from flip data log" << std::endl
                     << "  --deall, -a: Deatcivate all splits " << std::endl
+                    << "  --stream, -s [<addr>]: Stream flips as they happen (Ctrl+C to stop)" << std::endl
+                    << "  --follow, -f [<ms>]: Show the busiest flip sites every <ms> milliseconds (Ctrl+C to stop)" << std::endl
+                    << "  --stats, -t: Show the exit counters and latencies (TSC ticks) of each vCPU" << std::endl
+                    << "  --events, -e: Print the debug events of the VMM as they are recorded (Ctrl+C to stop)" << std::endl
+                    << "  --save, -S <file>: Save the splits (and their code pages) to <file>" << std::endl
+                    << "  --load, -L <file>: Re-install the splits saved in <file> (e.g. after restarting the VMM)" << std::endl
                     << "  <addr>: Given address will be used as module base to normalize the data" << std::endl
                     << std::endl
                     ;
@@ -168,6 +835,26 @@ main(int argc, const char *argv[])
                 std::cout << "all splits deactivated" << std::endl;
                 exit(0);
             }
+            else if (cmd == "--stream" || cmd == "-s")
+            {
+                stream_flips(ctl, module_base);
+                exit(0);
+            }
+            else if (cmd == "--follow" || cmd == "-f")
+            {
+                follow_flips(ctl, module_base, follow_interval, follow_top_n);
+                exit(0);
+            }
+            else if (cmd == "--stats" || cmd == "-t")
+            {
+                print_exit_stats(ctl);
+                exit(0);
+            }
+            else if (cmd == "--events" || cmd == "-e")
+            {
+                follow_events(ctl);
+                exit(0);
+            }
             else
             {
                 module_base = std::stoull(cmd, 0, 16);
@@ -191,6 +878,27 @@ main(int argc, const char *argv[])
                 std::cout << "removed " << hex_out_s(addr) << " from flip data log" << std::endl;
                 exit(0);
             }
+            else if (cmd == "--stream" || cmd == "-s")
+            {
+                module_base = std::stoull(val, 0, 16);
+                stream_flips(ctl, module_base);
+                exit(0);
+            }
+            else if (cmd == "--follow" || cmd == "-f")
+            {
+                follow_flips(ctl, module_base, static_cast<unsigned>(std::stoul(val)), follow_top_n);
+                exit(0);
+            }
+            else if (cmd == "--save" || cmd == "-S")
+            {
+                save_splits(ctl, val);
+                exit(0);
+            }
+            else if (cmd == "--load" || cmd == "-L")
+            {
+                load_splits(ctl, val);
+                exit(0);
+            }
             else
             {
                 std::cout << "unknown command" << std::endl;
@@ -217,32 +925,21 @@ main(int argc, const char *argv[])
         std::cout << "before create_split_context: ";
         hello_world();
 
-        // VMCALL: Create new split.
-        regs.r00 = VMCALL_REGISTERS;
-        regs.r01 = VMCALL_MAGIC_NUMBER;
-        regs.r02 = 1;
-        regs.r03 = reinterpret_cast<uintptr_t>(hello_world);
-        ctl.call_ioctl_vmcall(&regs, 0);
-        std::cout << "create_split_context: " << (regs.r02 == 1 ? "success" : "failure") << std::endl;
+        // VMCALL: Create and activate new split (in one exit).
+        split_op ops[2];
+        ops[0].method = 1;
+        ops[0].args[0] = reinterpret_cast<uintptr_t>(hello_world);
+        ops[1].method = 2;
+        ops[1].args[0] = reinterpret_cast<uintptr_t>(hello_world);
 
-        std::cout << "after create_split_context: ";
-        hello_world();
-
-        // VMCALL: Check if page is split.
         regs.r00 = VMCALL_REGISTERS;
         regs.r01 = VMCALL_MAGIC_NUMBER;
-        regs.r02 = 5;
-        regs.r03 = reinterpret_cast<uintptr_t>(hello_world);
-        ctl.call_ioctl_vmcall(&regs, 0);
-        std::cout << "is_split: " << (regs.r02 == 1 ? "yes" : "no") << std::endl;
-
-        // VMCALL: Activate split.
-        regs.r00 = VMCALL_REGISTERS;
-        regs.r01 = VMCALL_MAGIC_NUMBER;
-        regs.r02 = 2;
-        regs.r03 = reinterpret_cast<uintptr_t>(hello_world);
+        regs.r02 = 11;
+        regs.r03 = reinterpret_cast<uintptr_t>(ops);
+        regs.r04 = 2;
         ctl.call_ioctl_vmcall(&regs, 0);
-        std::cout << "activate_split: " << (regs.r02 == 1 ? "success" : "failure") << std::endl;
+        std::cout << "create_split_context: " << (ops[0].status == 1 ? "success" : "failure") << std::endl;
+        std::cout << "activate_split: " << (ops[1].status == 1 ? "success" : "failure") << std::endl;
 
         std::cout << "after activate_split: ";
         unsigned char* v = new unsigned char[8];
@@ -270,32 +967,20 @@ main(int argc, const char *argv[])
         hello_world();
         */
 
-        // VMCALL: Get data num.
-        regs.r00 = VMCALL_REGISTERS;
-        regs.r01 = VMCALL_MAGIC_NUMBER;
-        regs.r02 = 7;
-        ctl.call_ioctl_vmcall(&regs, 0);
-        auto data_num = regs.r02;
+        // Get the latest flip data.
+        std::vector<flip_data> local_flip_log;
+        const auto &&error_bound = read_flips(ctl, local_flip_log);
 
-        if (data_num == 0)
+        if (local_flip_log.empty())
         {
             std::cout << "no flip data" << std::endl;
             exit(0);
         }
         else
-            std::cout << "# of registered flips: " << data_num << std::endl;
-
-        // Reserve enough space.
-        std::vector<flip_data> local_flip_log;
-        local_flip_log.resize(data_num);
+            std::cout << "# of registered flips: " << local_flip_log.size() << std::endl;
 
-        // VMCALL: Get latest flip data.
-        regs.r00 = VMCALL_REGISTERS;
-        regs.r01 = VMCALL_MAGIC_NUMBER;
-        regs.r02 = 8;
-        regs.r03 = reinterpret_cast<int_t>(local_flip_log.data());
-        regs.r04 = data_num * sizeof(flip_data);
-        ctl.call_ioctl_vmcall(&regs, 0);
+        if (error_bound != 0)
+            std::cout << "counters may overestimate by up to " << error_bound << " flips" << std::endl;
 
         // Sort the flip data log by RIP and counter (ascending).
         std::sort(local_flip_log.begin(), local_flip_log.end(), [](const flip_data& a, const flip_data& b)
@@ -309,21 +994,8 @@ main(int argc, const char *argv[])
             if (is_bit_set(flip.bits, access_t::exec))
                 continue;
 
-            std::cout
-              << "["
-              << (is_bit_set(flip.bits, access_t::read)     ? "R" : "-")
-              << (is_bit_set(flip.bits, access_t::write)    ? "W" : "-")
-              << (is_bit_set(flip.bits, access_t::exec)     ? "X" : "-")
-              << "]:"
-              << " rip: " << hex_out_s(transl(flip.rip, module_base))
-              << " gva: " << hex_out_s(transl(flip.gva, module_base))
-              << " orig_gva: " << hex_out_s(transl(flip.orig_gva, module_base))
-              //<< " gpa: " << hex_out_s(flip.gpa)
-              //<< " d_pa: " << hex_out_s(flip.d_pa)
-              << " cr3: " << hex_out_s(flip.cr3, 8)
-              << " counter: " << flip.counter
-              //<< " bits: " << std::bitset<3>(access_bits)
-              << std::endl;
+            print_flip(flip.bits, flip.rip, flip.gva, flip.orig_gva, flip.cr3, module_base);
+            std::cout << " counter: " << flip.counter << std::endl;
         }
 
     });
@@ -0,0 +1,331 @@
+#ifndef CODE_PAGE_CACHE_H
+#define CODE_PAGE_CACHE_H
+
+#include <exit_handler/code_page_pool.h>
+#include <exit_handler/flat_map.h>
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+class code_page_cache;
+
+/// Shared code page (owned by a code_page_cache)
+///
+struct shared_code_page {
+    unique_code_page page;
+    uint64_t hash = 0;      // Content hash, valid while <indexed> is true.
+    size_t refs = 0;        // Number of code_page_refs to this page.
+    bool indexed = false;   // True if the page can be found by its contents.
+};
+
+/// Code Page Reference
+///
+/// Counted reference to a shared_code_page. Releases the reference when
+/// it's destroyed.
+///
+class code_page_ref
+{
+public:
+
+    code_page_ref() = default;
+
+    code_page_ref(code_page_cache *cache, shared_code_page *page) noexcept
+        : m_cache(cache)
+        , m_page(page)
+    { }
+
+    ~code_page_ref()
+    { reset(); }
+
+    code_page_ref(code_page_ref &&other) noexcept
+        : m_cache(other.m_cache)
+        , m_page(other.m_page)
+    {
+        other.m_cache = nullptr;
+        other.m_page = nullptr;
+    }
+
+    code_page_ref &
+    operator=(code_page_ref &&other) noexcept
+    {
+        if (this != &other)
+        {
+            reset();
+            std::swap(m_cache, other.m_cache);
+            std::swap(m_page, other.m_page);
+        }
+
+        return *this;
+    }
+
+    code_page_ref(const code_page_ref &) = delete;
+    code_page_ref &operator=(const code_page_ref &) = delete;
+
+    uint8_t *
+    get() const noexcept
+    { return m_page != nullptr ? m_page->page.get() : nullptr; }
+
+    uintptr_t
+    phys() const noexcept
+    { return m_page != nullptr ? m_page->page.phys() : 0; }
+
+    /// Returns the number of references to the page (including this one).
+    ///
+    size_t
+    refs() const noexcept
+    { return m_page != nullptr ? m_page->refs : 0; }
+
+    explicit operator bool() const noexcept
+    { return m_page != nullptr; }
+
+    /// Drops the reference
+    ///
+    inline void reset() noexcept;
+
+private:
+
+    friend class code_page_cache;
+
+    code_page_cache *m_cache = nullptr;
+    shared_code_page *m_page = nullptr;
+};
+
+/// Code Page Cache
+///
+/// Content-addressed, reference-counted code pages. Splits of pages with
+/// byte-identical contents (the same module mapped in many processes, or
+/// the same patch applied to each copy) share one page of the pool.
+///
+/// A page that is about to be written to has to go through begin_write(),
+/// which hands out a private copy if the page is shared, and end_write(),
+/// which indexes the new contents again (or switches to an existing page
+/// with the same contents). Both may return a different page, so callers
+/// have to re-read the page's addresses afterwards.
+///
+class code_page_cache
+{
+public:
+
+    static constexpr const size_t page_size = code_page_pool::page_size;
+
+    explicit code_page_cache(code_page_pool &pool) noexcept
+        : m_pool(pool)
+    { }
+
+    ~code_page_cache() = default;
+
+    code_page_cache(const code_page_cache &) = delete;
+    code_page_cache &operator=(const code_page_cache &) = delete;
+
+    /// Returns a page with the given contents
+    ///
+    /// @param contents page_size bytes
+    ///
+    /// @return a reference to an existing page with the same contents, or
+    ///         to a new page
+    ///
+    code_page_ref
+    acquire(const uint8_t *contents)
+    {
+        const auto &&hash = hash_page(contents);
+
+        std::lock_guard<std::mutex> guard(m_mutex);
+
+        if (auto &&page = lookup(hash, contents))
+            return ref(page);
+
+        auto &&page = new_page();
+        std::memcpy(page->page.get(), contents, page_size);
+        index(page, hash);
+
+        return ref(page);
+    }
+
+    /// Returns another reference to the page of <page>
+    ///
+    code_page_ref
+    share(const code_page_ref &page)
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        return ref(page.m_page);
+    }
+
+    /// Prepares a page for writing
+    ///
+    /// @param page the page that is going to be written to
+    ///
+    /// @return a page with the same contents that only the caller
+    ///         references, and that isn't indexed anymore
+    ///
+    code_page_ref
+    begin_write(code_page_ref page)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        auto &&shared = page.m_page;
+        if (shared->refs == 1)
+        {
+            unindex(shared);
+            return page;
+        }
+
+        // Copy on write.
+        auto &&copy = new_page();
+        std::memcpy(copy->page.get(), shared->page.get(), page_size);
+        code_page_ref result = ref(copy);
+
+        // Releasing takes the lock.
+        lock.unlock();
+        page.reset();
+
+        return result;
+    }
+
+    /// Indexes a page after it was written to
+    ///
+    /// @param page the page returned by begin_write()
+    ///
+    /// @return <page>, or an existing page with the same contents
+    ///
+    code_page_ref
+    end_write(code_page_ref page)
+    {
+        const auto &&hash = hash_page(page.get());
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        if (auto &&existing = lookup(hash, page.get()))
+        {
+            code_page_ref result = ref(existing);
+
+            // Releasing takes the lock.
+            lock.unlock();
+            page.reset();
+
+            return result;
+        }
+
+        index(page.m_page, hash);
+        return page;
+    }
+
+    /// Returns the number of pages in use.
+    ///
+    size_t
+    size() const
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        return m_pages.size();
+    }
+
+private:
+
+    friend class code_page_ref;
+
+    static uint64_t
+    hash_page(const uint8_t *contents) noexcept
+    {
+        uint64_t hash = 0x9E3779B97F4A7C15ULL;
+
+        for (size_t i = 0; i < page_size; i += sizeof(uint64_t))
+        {
+            uint64_t word;
+            std::memcpy(&word, contents + i, sizeof(word));
+
+            hash = (hash ^ word) * 0xBF58476D1CE4E5B9ULL;
+            hash ^= hash >> 31;
+        }
+
+        return hash;
+    }
+
+    code_page_ref
+    ref(shared_code_page *page) noexcept
+    {
+        page->refs++;
+        return code_page_ref(this, page);
+    }
+
+    void
+    release(shared_code_page *page)
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+
+        if (--page->refs != 0)
+            return;
+
+        unindex(page);
+        m_pages.erase(key(page));
+    }
+
+    shared_code_page *
+    new_page()
+    {
+        auto &&page = std::make_unique<shared_code_page>();
+        page->page = m_pool.alloc();
+
+        auto &&raw = page.get();
+        m_pages[key(raw)] = std::move(page);
+
+        return raw;
+    }
+
+    shared_code_page *
+    lookup(const uint64_t hash, const uint8_t *contents)
+    {
+        const auto &&page = m_index.find(hash);
+        if (page == nullptr || std::memcmp((*page)->page.get(), contents, page_size) != 0)
+            return nullptr;
+
+        return *page;
+    }
+
+    void
+    index(shared_code_page *page, const uint64_t hash)
+    {
+        // On a (real) hash collision the page just isn't shared.
+        bool inserted;
+        auto &&slot = m_index.insert(hash, inserted);
+        if (!inserted)
+            return;
+
+        slot = page;
+        page->hash = hash;
+        page->indexed = true;
+    }
+
+    void
+    unindex(shared_code_page *page)
+    {
+        if (!page->indexed)
+            return;
+
+        m_index.erase(page->hash);
+        page->indexed = false;
+    }
+
+    static uint64_t
+    key(const shared_code_page *page) noexcept
+    { return page->page.phys() >> 12; }
+
+    code_page_pool &m_pool;
+
+    mutable std::mutex m_mutex;
+    flat_map<std::unique_ptr<shared_code_page> /*by pfn*/> m_pages;
+    flat_map<shared_code_page * /*by content hash*/> m_index;
+};
+
+inline void
+code_page_ref::reset() noexcept
+{
+    if (m_cache != nullptr && m_page != nullptr)
+        m_cache->release(m_page);
+
+    m_cache = nullptr;
+    m_page = nullptr;
+}
+
+#endif
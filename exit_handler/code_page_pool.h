@@ -0,0 +1,204 @@
+#ifndef CODE_PAGE_POOL_H
+#define CODE_PAGE_POOL_H
+
+#include <memory_manager/memory_manager_x64.h>
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+/// Code page (one 4k page of a code_page_pool)
+///
+struct code_page {
+    uint8_t *va = nullptr;  // (host) virtual address, 4k aligned
+    uintptr_t pa = 0;       // (host) physical address
+};
+
+class code_page_pool;
+
+/// Unique Code Page
+///
+/// Owns a page of a code_page_pool and gives it back when it's destroyed.
+///
+class unique_code_page
+{
+public:
+
+    unique_code_page() = default;
+
+    unique_code_page(code_page_pool *pool, const code_page &page) noexcept
+        : m_pool(pool)
+        , m_page(page)
+    { }
+
+    ~unique_code_page()
+    { reset(); }
+
+    unique_code_page(unique_code_page &&other) noexcept
+        : m_pool(other.m_pool)
+        , m_page(other.m_page)
+    {
+        other.m_pool = nullptr;
+        other.m_page = code_page();
+    }
+
+    unique_code_page &
+    operator=(unique_code_page &&other) noexcept
+    {
+        if (this != &other)
+        {
+            reset();
+            std::swap(m_pool, other.m_pool);
+            std::swap(m_page, other.m_page);
+        }
+
+        return *this;
+    }
+
+    unique_code_page(const unique_code_page &) = delete;
+    unique_code_page &operator=(const unique_code_page &) = delete;
+
+    uint8_t *
+    get() const noexcept
+    { return m_page.va; }
+
+    uintptr_t
+    phys() const noexcept
+    { return m_page.pa; }
+
+    explicit operator bool() const noexcept
+    { return m_page.va != nullptr; }
+
+    /// Returns the page to its pool
+    ///
+    inline void reset() noexcept;
+
+private:
+
+    code_page_pool *m_pool = nullptr;
+    code_page m_page;
+};
+
+/// Code Page Pool
+///
+/// Hands out page-aligned 4k pages for split code pages. Pages are carved
+/// out of slabs of <slab_pages> pages that are allocated once and never
+/// freed, and their physical addresses are looked up when the slab is
+/// created. Allocating and freeing a page is a push/pop on a free list, so
+/// there is no heap traffic and no address translation per split.
+///
+class code_page_pool
+{
+public:
+
+    static constexpr const size_t page_size = 0x1000;
+    static constexpr const size_t slab_pages = 64;
+
+    code_page_pool() = default;
+    ~code_page_pool() = default;
+
+    code_page_pool(const code_page_pool &) = delete;
+    code_page_pool &operator=(const code_page_pool &) = delete;
+
+    /// Allocates a code page
+    ///
+    /// Grows the pool by one slab if there is no free page left.
+    ///
+    /// @return the page (owned by the caller until it is destroyed)
+    ///
+    unique_code_page
+    alloc()
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+
+        if (m_free.empty())
+            add_slab();
+
+        const auto page = m_free.back();
+        m_free.pop_back();
+
+        return unique_code_page(this, page);
+    }
+
+    /// Makes sure that at least <pages> pages are free
+    ///
+    void
+    reserve(const size_t pages)
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+
+        while (m_free.size() < pages)
+            add_slab();
+    }
+
+    /// Returns the number of free pages.
+    ///
+    size_t
+    free_pages() const
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        return m_free.size();
+    }
+
+    /// Returns the number of pages owned by the pool.
+    ///
+    size_t
+    total_pages() const
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        return m_slabs.size() * slab_pages;
+    }
+
+private:
+
+    friend class unique_code_page;
+
+    void
+    free(const code_page &page)
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+
+        // Can't allocate: add_slab() reserved room for every page.
+        m_free.push_back(page);
+    }
+
+    void
+    add_slab()
+    {
+        // One spare page, so the slab can be aligned.
+        auto &&slab = std::make_unique<uint8_t[]>((slab_pages + 1) * page_size);
+
+        const auto &&addr = reinterpret_cast<uintptr_t>(slab.get());
+        const auto &&aligned = (addr + page_size - 1) & ~(page_size - 1);
+
+        m_free.reserve((m_slabs.size() + 1) * slab_pages);
+        for (size_t i = slab_pages; i > 0; i--)
+        {
+            code_page page;
+            page.va = reinterpret_cast<uint8_t *>(aligned + (i - 1) * page_size);
+            page.pa = g_mm->virtint_to_physint(reinterpret_cast<uintptr_t>(page.va));
+            m_free.push_back(page);
+        }
+
+        m_slabs.push_back(std::move(slab));
+    }
+
+    mutable std::mutex m_mutex;
+    std::vector<std::unique_ptr<uint8_t[]>> m_slabs;
+    std::vector<code_page> m_free;
+};
+
+inline void
+unique_code_page::reset() noexcept
+{
+    if (m_pool != nullptr && m_page.va != nullptr)
+        m_pool->free(m_page);
+
+    m_pool = nullptr;
+    m_page = code_page();
+}
+
+#endif
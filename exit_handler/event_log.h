@@ -0,0 +1,280 @@
+#ifndef EVENT_LOG_H
+#define EVENT_LOG_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <string>
+
+/// Log event ids
+///
+/// Every id has a format (see log_event_format()) that is only applied
+/// when the log is read, so recording an event is a handful of stores.
+///
+enum log_event_id : uint32_t {
+    log_none,
+    log_handler_initialized,
+    log_trap_reset,
+    log_unexpected_violation,       // gva, gpa, d_pa, cr3, bits
+    log_flip,                       // bits, cr3, rip, gva
+    log_thrashing,                  // rip
+    log_unexpected_qualification,   // gva, gpa, d_pa, cr3, bits
+    log_remap_4k,                   // 2m pa
+    log_already_remapped,           // 2m pa
+    log_split_page,                 // d_pa
+    log_split_created,              // splits in the 2m range, hooks on the page
+    log_already_split,              // d_pa, hooks on the page
+    log_already_active,             // d_pa
+    log_activate,                   // d_pa
+    log_deactivate_other_hooks,     // d_pa, hooks on the page (before)
+    log_deactivate,                 // d_pa, hooks on the page
+    log_deactivate_total,           // splits
+    log_deactivate_adjacent,        // d_pa
+    log_deactivate_2m_splits,       // splits in the 2m range
+    log_deactivate_2m_total,        // tracked 2m pages
+    log_coalesce,                   // 2m pa
+    log_deactivate_all,             // splits
+    log_deactivate_all_none,
+    log_write_to_c_page,            // from_va, to_va, size
+    log_write_two_pages,            // d_pa, end_pa
+    log_write_split_second,         // end_pa
+    log_write_one_page,             // d_pa
+    log_code_page_moved,            // d_pa, c_pa
+    log_split_range,                // gva, size
+    log_split_range_unmapped,       // gva
+    log_apply_patches,              // patches, pages
+    log_export_splits,              // splits, bytes
+    log_import_splits,              // splits
+    log_import_already_split,       // d_pa
+    log_import_moved,               // gva, d_pa
+    log_thrash_cooldown,            // d_pa, rip
+    log_thrash_cooldown_end,        // d_pa
+    log_thrash_deactivate,          // d_pa, rip
+    log_import_deactivated,         // d_pa
+    log_batch_split_ops,            // operations
+    log_clear_flip_data,
+    log_remove_flip_entry,          // rip
+    log_register_flip_ring,         // records
+    log_unregister_flip_ring,
+    num_log_event_ids
+};
+
+/// Returns the format of an event
+///
+/// Each placeholder consumes the next argument: %x prints it as a
+/// 64-bit hex value, %c as a CR3 (32-bit hex), %u as a decimal and %b as
+/// access bits.
+///
+inline const char *
+log_event_format(const uint32_t id) noexcept
+{
+    switch (id)
+    {
+        case log_handler_initialized: return "tlb_handler instance initialized";
+        case log_trap_reset: return "Resetting the trap";
+        case log_unexpected_violation: return "UNX_V: gva: %x gpa: %x d_pa: %x cr3: %c bits: %b";
+        case log_flip: return "[%b]: cr3: %c rip: %x gva: %x";
+        case log_thrashing: return "Thrashing detected at rip: %x";
+        case log_unexpected_qualification: return "Unexpected exit qualifications: gva: %x gpa: %x d_pa: %x cr3: %c bits: %b";
+        case log_remap_4k: return "create_split_context: remapping page from 2m to 4k for: %x";
+        case log_already_remapped: return "create_split_context: page already remapped: %x";
+        case log_split_page: return "create_split_context: splitting page for: %x";
+        case log_split_created: return "create_split_context: splits in this (2m) range: %u, # of hooks on this page: %u";
+        case log_already_split: return "create_split_context: page already split for: %x, # of hooks on this page: %u";
+        case log_already_active: return "activate_split: split already active for: %x";
+        case log_activate: return "activate_split: activating split for: %x";
+        case log_deactivate_other_hooks: return "deactivate_split_pa: other hooks found on this page: %x, # of hooks on this page (before): %u";
+        case log_deactivate: return "deactivate_split_pa: deactivating split for: %x, # of hooks on this page: %u";
+        case log_deactivate_total: return "deactivate_split_pa: total num of splits: %u";
+        case log_deactivate_adjacent: return "deactivate_split_pa: deactivating adjacent split for: %x";
+        case log_deactivate_2m_splits: return "deactivate_split_pa: splits in this (2m) range: %u";
+        case log_deactivate_2m_total: return "deactivate_split_pa: total num of tracked (2m) pages: %u";
+        case log_coalesce: return "coalesce_idle_pages: remapping pages from 4k to 2m for: %x";
+        case log_deactivate_all: return "deactivate_all_splits: deactivating all splits. current num of splits: %u";
+        case log_deactivate_all_none: return "deactivate_all_splits: no active splits found";
+        case log_write_to_c_page: return "write_to_c_page: from_va: %x, to_va: %x, size: %u";
+        case log_write_two_pages: return "write_to_c_page: we are writing to two pages: %x & %x";
+        case log_write_split_second: return "write_to_c_page: splitting second page: %x";
+        case log_write_one_page: return "write_to_c_page: we are writing to one page: %x";
+        case log_code_page_moved: return "write_code_page: moved code page of %x to: %x";
+        case log_split_range: return "create_split_range: splitting range: %x, size: %u";
+        case log_split_range_unmapped: return "create_split_range: skipping unmapped page: %x";
+        case log_apply_patches: return "apply_patches: applying %u patches to %u pages";
+        case log_export_splits: return "export_splits: exporting %u splits in %u bytes";
+        case log_import_splits: return "import_splits: importing %u splits";
+        case log_import_already_split: return "import_splits: skipping page that is already split: %x";
+        case log_import_moved: return "import_splits: skipping split that no longer maps to its page: %x (was %x)";
+        case log_thrash_cooldown: return "Thrashing page %x (rip: %x) kept on the data page for a while";
+        case log_thrash_cooldown_end: return "Thrashing page %x back on the code page";
+        case log_thrash_deactivate: return "Thrashing page %x (rip: %x) deactivated";
+        case log_import_deactivated: return "import_splits: split was deactivated while importing: %x";
+        case log_batch_split_ops: return "batch_split_ops: executing %u operations";
+        case log_clear_flip_data: return "clear_flip_data: clearing flip data";
+        case log_remove_flip_entry: return "remove_flip_entry: removing flip entry for: %x";
+        case log_register_flip_ring: return "register_flip_ring: registered ring with %u records";
+        case log_unregister_flip_ring: return "unregister_flip_ring: ring unregistered";
+        default: return "unknown event %u %u %u %u %u";
+    }
+}
+
+constexpr const size_t log_event_args = 5;
+
+/// Log event
+///
+/// <seq> is written last: a record at position <pos> is complete once
+/// its <seq> equals pos + 1. It's accessed with the __atomic builtins, so
+/// events stay trivially copyable.
+///
+struct log_event {
+    uint64_t seq = 0;
+    uint64_t tsc = 0;
+    uint32_t id = log_none;
+    uint32_t vcpuid = 0;
+    uint64_t args[log_event_args] = {};
+};
+
+namespace event_log_detail
+{
+    inline void
+    append_hex(std::string &out, const uint64_t value, const int digits)
+    {
+        static const char s_digits[] = "0123456789abcdef";
+
+        out += "0x";
+        for (auto shift = (digits - 1) * 4; shift >= 0; shift -= 4)
+            out += s_digits[(value >> shift) & 0xF];
+    }
+}
+
+/// Formats <event> as a line of text and appends it to <out>
+///
+inline void
+format_log_event(const log_event &event, std::string &out)
+{
+    using namespace event_log_detail;
+
+    out += '[';
+    out += std::to_string(event.vcpuid);
+    out += "] ";
+    out += std::to_string(event.tsc);
+    out += ": ";
+
+    size_t arg = 0;
+    for (auto fmt = log_event_format(event.id); *fmt != '\0'; fmt++)
+    {
+        if (fmt[0] != '%' || fmt[1] == '\0')
+        {
+            out += *fmt;
+            continue;
+        }
+
+        const auto &&value = arg < log_event_args ? event.args[arg++] : 0;
+        switch (*++fmt)
+        {
+            case 'x': append_hex(out, value, 16); break;
+            case 'c': append_hex(out, value, 8); break;
+            case 'b':
+                out += (value & 0x4) ? '1' : '0';
+                out += (value & 0x2) ? '1' : '0';
+                out += (value & 0x1) ? '1' : '0';
+                break;
+            default: out += std::to_string(value); break;
+        }
+    }
+
+    out += '\n';
+}
+
+/// Event Log
+///
+/// Ring of the last <capacity> events of one vCPU. Only the owning vCPU
+/// records, without locks or allocations, and overwrites the oldest
+/// events when the ring is full. Formatting is left to whoever drains the
+/// log (see read()), which may run on any vCPU: it copies a record and
+/// then checks that its <seq> didn't change, so a record that was
+/// overwritten while being copied is detected and can be counted as lost.
+///
+/// Readers keep their position in <tail>, and have to serialize among
+/// themselves.
+///
+class event_log
+{
+public:
+
+    static constexpr const size_t capacity = 1024;
+
+    explicit event_log(uint32_t vcpuid)
+        : m_vcpuid(vcpuid)
+        , m_records(std::make_unique<log_event[]>(capacity))
+    { }
+
+    ~event_log() = default;
+
+    event_log(const event_log &) = delete;
+    event_log &operator=(const event_log &) = delete;
+
+    /// Records an event (owner only)
+    ///
+    void
+    record(const log_event_id id, const uint64_t tsc,
+           const uint64_t a0 = 0, const uint64_t a1 = 0, const uint64_t a2 = 0,
+           const uint64_t a3 = 0, const uint64_t a4 = 0) noexcept
+    {
+        const auto &&pos = m_head.load(std::memory_order_relaxed);
+        auto &&record = m_records[pos & (capacity - 1)];
+
+        __atomic_store_n(&record.seq, 0, __ATOMIC_RELAXED);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        record.tsc = tsc;
+        record.id = id;
+        record.vcpuid = m_vcpuid;
+        record.args[0] = a0;
+        record.args[1] = a1;
+        record.args[2] = a2;
+        record.args[3] = a3;
+        record.args[4] = a4;
+
+        __atomic_store_n(&record.seq, pos + 1, __ATOMIC_RELEASE);
+        m_head.store(pos + 1, std::memory_order_release);
+    }
+
+    /// Returns the number of events recorded so far.
+    ///
+    uint64_t
+    head() const noexcept
+    { return m_head.load(std::memory_order_acquire); }
+
+    /// Copies the event at position <pos> into <out>
+    ///
+    /// @return false if the event was overwritten (or isn't there yet)
+    ///
+    bool
+    read(const uint64_t pos, log_event &out) const noexcept
+    {
+        const auto &record = m_records[pos & (capacity - 1)];
+
+        if (__atomic_load_n(&record.seq, __ATOMIC_ACQUIRE) != pos + 1)
+            return false;
+
+        out = record;
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return __atomic_load_n(&record.seq, __ATOMIC_RELAXED) == pos + 1;
+    }
+
+    /// Position of the first event the readers haven't consumed yet
+    ///
+    uint64_t tail = 0;
+
+private:
+
+    uint32_t m_vcpuid;
+    std::unique_ptr<log_event[]> m_records;
+    std::atomic<uint64_t> m_head{0};
+};
+
+#endif
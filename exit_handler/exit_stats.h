@@ -0,0 +1,142 @@
+#ifndef EXIT_STATS_H
+#define EXIT_STATS_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+/// Exit kinds counted by exit_stats
+///
+enum exit_kind_t {
+    exit_split_read,            // Read violation on a split, flipped to the data page
+    exit_split_read_emulated,   // Read violation on a split, completed by emulate_read()
+    exit_split_write,           // Write violation on a split
+    exit_split_exec,            // Execute violation on a split
+    exit_split_foreign,         // Violation on a split the address space doesn't use
+    exit_unexpected,            // Violation on a page that isn't split (UNX_V)
+    exit_thrash,                // Split violation the thrash policy was applied to
+    exit_monitor_trap,          // Monitor trap callback (end of a single step)
+    num_exit_kinds
+};
+
+// Number of latency buckets. Bucket i counts latencies of [2^i, 2^(i+1))
+// TSC ticks (bucket 0 includes 0), the last one everything above.
+constexpr const size_t exit_stats_buckets = 32;
+
+constexpr const uint64_t exit_stats_version = 1;
+
+/// Exit latency (this layout is shared with the guest monitor application)
+///
+struct exit_latency {
+    uint64_t count = 0;                         // Number of exits
+    uint64_t total = 0;                         // Sum of their latencies (TSC ticks)
+    uint64_t max = 0;                           // Largest latency (TSC ticks)
+    uint64_t buckets[exit_stats_buckets] = {};  // log2 histogram of the latencies
+};
+
+/// Exit statistics of one vCPU (this layout is shared with the guest
+/// monitor application)
+///
+struct vcpu_exit_stats {
+    uint64_t vcpuid = 0;
+    exit_latency kinds[num_exit_kinds];
+};
+
+/// Header of the buffer filled by get_exit_stats() (this layout is shared
+/// with the guest monitor application)
+///
+/// Followed by <num_vcpus> vcpu_exit_stats records.
+///
+struct exit_stats_header {
+    uint64_t version = 0;       // exit_stats_version
+    uint64_t num_kinds = 0;     // num_exit_kinds
+    uint64_t num_buckets = 0;   // exit_stats_buckets
+    uint64_t num_vcpus = 0;     // Number of records that follow
+};
+
+/// Exit Stats
+///
+/// Counters and log2 latency histograms of the exits of one vCPU. Only the
+/// owning vCPU records, so the counters are bumped with plain (relaxed)
+/// loads and stores; other vCPUs can take a snapshot at any time and see
+/// values that are at most a few exits behind.
+///
+class exit_stats
+{
+public:
+
+    exit_stats() = default;
+    ~exit_stats() = default;
+
+    exit_stats(const exit_stats &) = delete;
+    exit_stats &operator=(const exit_stats &) = delete;
+
+    /// Records an exit of <kind> that took <ticks> TSC ticks (owner only)
+    ///
+    void
+    record(const exit_kind_t kind, const uint64_t ticks) noexcept
+    {
+        auto &&stats = m_kinds[kind];
+
+        bump(stats.count, 1);
+        bump(stats.total, ticks);
+        bump(stats.buckets[bucket(ticks)], 1);
+
+        if (ticks > stats.max.load(std::memory_order_relaxed))
+            stats.max.store(ticks, std::memory_order_relaxed);
+    }
+
+    /// Copies the statistics into <out> (any vCPU)
+    ///
+    void
+    snapshot(vcpu_exit_stats &out) const noexcept
+    {
+        for (size_t kind = 0; kind < num_exit_kinds; kind++)
+        {
+            const auto &stats = m_kinds[kind];
+            auto &&latency = out.kinds[kind];
+
+            latency.count = stats.count.load(std::memory_order_relaxed);
+            latency.total = stats.total.load(std::memory_order_relaxed);
+            latency.max = stats.max.load(std::memory_order_relaxed);
+
+            for (size_t i = 0; i < exit_stats_buckets; i++)
+                latency.buckets[i] = stats.buckets[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    /// Returns the bucket of a latency of <ticks>
+    ///
+    static size_t
+    bucket(const uint64_t ticks) noexcept
+    {
+        if (ticks == 0)
+            return 0;
+
+        const auto &&log2 = static_cast<size_t>(63 - __builtin_clzll(ticks));
+        return log2 < exit_stats_buckets ? log2 : exit_stats_buckets - 1;
+    }
+
+private:
+
+    static void
+    bump(std::atomic<uint64_t> &counter, const uint64_t value) noexcept
+    { counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed); }
+
+    struct kind_stats {
+        std::atomic<uint64_t> count{0};
+        std::atomic<uint64_t> total{0};
+        std::atomic<uint64_t> max{0};
+        std::atomic<uint64_t> buckets[exit_stats_buckets];
+
+        kind_stats() noexcept
+        {
+            for (auto &&b : buckets)
+                b.store(0, std::memory_order_relaxed);
+        }
+    };
+
+    kind_stats m_kinds[num_exit_kinds];
+};
+
+#endif
@@ -0,0 +1,263 @@
+#ifndef FLAT_MAP_H
+#define FLAT_MAP_H
+
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+/// Flat Map
+///
+/// Open-addressing hash map with 64-bit integer keys and values stored
+/// inline in a single array. Collisions are resolved with linear probing
+/// and erase uses backward-shift deletion, so there are no tombstones and
+/// lookups never degrade after many insert/erase cycles.
+///
+/// The table grows (and rehashes) once it is half full. Rehashing moves
+/// the values, so pointers and references returned by find() and insert()
+/// are only valid until the next insert().
+///
+template<typename V>
+class flat_map
+{
+    struct slot
+    {
+        uint64_t key = 0;
+        V value = V();
+        bool used = false;
+    };
+
+public:
+
+    using key_type = uint64_t;
+    using value_type = V;
+
+    flat_map() = default;
+    ~flat_map() = default;
+
+    flat_map(flat_map &&) = default;
+    flat_map &operator=(flat_map &&) = default;
+    flat_map(const flat_map &) = default;
+    flat_map &operator=(const flat_map &) = default;
+
+    /// Returns the number of elements in the map.
+    ///
+    size_t
+    size() const noexcept
+    { return m_size; }
+
+    /// Returns true if the map holds no elements.
+    ///
+    bool
+    empty() const noexcept
+    { return m_size == 0; }
+
+    /// Looks up a key
+    ///
+    /// @param key the key to search for
+    ///
+    /// @return a pointer to the value, or nullptr if the key doesn't exist
+    ///
+    V *
+    find(const key_type key) noexcept
+    {
+        if (m_size == 0)
+            return nullptr;
+
+        for (auto i = home(key); m_slots[i].used; i = (i + 1) & m_mask)
+        {
+            if (m_slots[i].key == key)
+                return &m_slots[i].value;
+        }
+
+        return nullptr;
+    }
+
+    const V *
+    find(const key_type key) const noexcept
+    { return const_cast<flat_map *>(this)->find(key); }
+
+    /// Inserts a key (if it doesn't exist yet)
+    ///
+    /// @param key the key to insert
+    /// @param inserted set to true if a new element was created
+    ///
+    /// @return a reference to the (new or existing) value
+    ///
+    V &
+    insert(const key_type key, bool &inserted)
+    {
+        inserted = false;
+
+        if ((m_size + 1) * 2 > m_slots.size())
+            rehash(m_slots.empty() ? min_capacity : m_slots.size() * 2);
+
+        auto i = home(key);
+        for (; m_slots[i].used; i = (i + 1) & m_mask)
+        {
+            if (m_slots[i].key == key)
+                return m_slots[i].value;
+        }
+
+        m_slots[i].key = key;
+        m_slots[i].value = V();
+        m_slots[i].used = true;
+        m_size++;
+
+        inserted = true;
+        return m_slots[i].value;
+    }
+
+    V &
+    operator[](const key_type key)
+    {
+        bool inserted;
+        return insert(key, inserted);
+    }
+
+    /// Removes a key
+    ///
+    /// @param key the key to remove
+    ///
+    /// @return true if the key existed, false otherwise
+    ///
+    bool
+    erase(const key_type key)
+    {
+        if (m_size == 0)
+            return false;
+
+        auto i = home(key);
+        for (; m_slots[i].used; i = (i + 1) & m_mask)
+        {
+            if (m_slots[i].key == key)
+                break;
+        }
+
+        if (!m_slots[i].used)
+            return false;
+
+        // Backward-shift deletion: pull every following element of the
+        // probe chain into the hole unless its home slot lies cyclically
+        // between the hole and its current position.
+        auto hole = i;
+        for (auto j = (hole + 1) & m_mask; m_slots[j].used; j = (j + 1) & m_mask)
+        {
+            const auto &&k = home(m_slots[j].key);
+            const auto &&stays = (hole <= j) ? (hole < k && k <= j) : (hole < k || k <= j);
+
+            if (!stays)
+            {
+                m_slots[hole] = std::move(m_slots[j]);
+                hole = j;
+            }
+        }
+
+        m_slots[hole].value = V();
+        m_slots[hole].used = false;
+        m_size--;
+
+        return true;
+    }
+
+    /// Removes all elements (keeps the allocated capacity)
+    ///
+    void
+    clear()
+    {
+        for (auto &&s : m_slots)
+        {
+            if (s.used)
+            {
+                s.value = V();
+                s.used = false;
+            }
+        }
+
+        m_size = 0;
+    }
+
+    /// Makes sure that <count> elements fit without rehashing.
+    ///
+    void
+    reserve(const size_t count)
+    {
+        auto capacity = m_slots.empty() ? min_capacity : m_slots.size();
+        while (capacity < count * 2)
+            capacity *= 2;
+
+        if (capacity > m_slots.size())
+            rehash(capacity);
+    }
+
+    /// Calls f(key, value) for every element. The map must not be modified
+    /// from within f.
+    ///
+    template<typename F>
+    void
+    for_each(F f)
+    {
+        for (auto &&s : m_slots)
+        {
+            if (s.used)
+                f(s.key, s.value);
+        }
+    }
+
+    template<typename F>
+    void
+    for_each(F f) const
+    {
+        for (const auto &s : m_slots)
+        {
+            if (s.used)
+                f(s.key, s.value);
+        }
+    }
+
+private:
+
+    static constexpr const size_t min_capacity = 16;
+
+    size_t
+    home(const key_type key) const noexcept
+    {
+        // splitmix64 finalizer. Page frame numbers and RIPs have very
+        // regular low bits, so they need proper mixing before masking.
+        auto h = key;
+        h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+        h = h ^ (h >> 31);
+
+        return static_cast<size_t>(h) & m_mask;
+    }
+
+    void
+    rehash(const size_t capacity)
+    {
+        std::vector<slot> old(capacity);
+        old.swap(m_slots);
+        m_mask = capacity - 1;
+
+        for (auto &&s : old)
+        {
+            if (!s.used)
+                continue;
+
+            auto i = home(s.key);
+            while (m_slots[i].used)
+                i = (i + 1) & m_mask;
+
+            m_slots[i] = std::move(s);
+        }
+    }
+
+    std::vector<slot> m_slots;
+    size_t m_mask = 0;
+    size_t m_size = 0;
+};
+
+template<typename V>
+constexpr const size_t flat_map<V>::min_capacity;
+
+#endif
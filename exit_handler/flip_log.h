@@ -0,0 +1,447 @@
+#ifndef FLIP_LOG_H
+#define FLIP_LOG_H
+
+#include <exit_handler/flat_map.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/// Flip data (this layout is shared with the guest monitor application)
+///
+struct flip_data {
+    uintptr_t rip = 0;
+    uintptr_t gva = 0;
+    uintptr_t orig_gva = 0;
+    uintptr_t gpa = 0;
+    uintptr_t d_pa = 0;
+    uintptr_t cr3 = 0;
+    uintptr_t bits = 0;
+    uintptr_t counter = 0;
+
+    flip_data() = default;
+    flip_data(uintptr_t _rip, uintptr_t _gva, uintptr_t _orig_gva, uintptr_t _gpa, uintptr_t _d_pa, uintptr_t _cr3, uintptr_t _bits, uintptr_t _counter)
+    {
+        rip = _rip;
+        gva = _gva;
+        orig_gva = _orig_gva;
+        gpa = _gpa;
+        d_pa = _d_pa;
+        cr3 = _cr3;
+        bits = _bits;
+        counter = _counter;
+    }
+
+    ~flip_data() = default;
+};
+
+/// Flip log key
+///
+/// Packs (rip, access bits) into one 64-bit key. Canonical addresses have
+/// bits 63:48 equal to bit 47, so dropping the top three bits of the RIP
+/// doesn't lose any information.
+///
+inline uint64_t
+flip_key(const uintptr_t rip, const uintptr_t bits) noexcept
+{ return (static_cast<uint64_t>(rip) << 3) | (bits & 0x7); }
+
+/// Flip Log
+///
+/// Holds one flip_data record per (rip, access bits) pair. Each vCPU owns
+/// one flip_log and is the only one that records into it, so the exit
+/// path never takes a lock:
+///
+/// - Records live in fixed-size chunks that are never reallocated, and a
+///   new record is published by a release store of the record count. A
+///   reader on another vCPU can therefore walk [0, size()) at any time;
+///   the counters it sees might be a few flips behind, nothing more.
+/// - The (rip, bits) -> record index is only touched by the owner.
+/// - Clearing and removing records would race with the owner, so other
+///   vCPUs only post requests. The owner applies them the next time it
+///   records a flip (or right away, when the VMCALL runs on the owner).
+///   Until then, readers hide the affected records.
+///
+/// By default, the log keeps every (rip, bits) pair, up to
+/// chunk_records * max_chunks records. With a <capacity>, it keeps a
+/// fixed-size Space-Saving summary of the busiest pairs instead: once it
+/// is full, a new pair takes over the record with the smallest counter,
+/// inheriting that counter. Memory stays constant, counters never
+/// underestimate, and a counter overestimates by at most error_bound()
+/// (which is at most flips / capacity), so every pair that flipped more
+/// than that often is guaranteed to be in the log. A min-heap over the
+/// counters finds the record to replace, so a flip costs O(log capacity).
+/// Readers copy records under a sequence counter, so they never see a
+/// record that is half replaced.
+///
+class flip_log
+{
+public:
+
+    using records_type = std::unique_ptr<flip_data[]>;
+
+    static constexpr const size_t chunk_records = 1024;
+    static constexpr const size_t max_chunks = 1024;
+
+    /// Constructor
+    ///
+    /// @param capacity 0 to keep every (rip, bits) pair, otherwise the
+    ///        number of records of the Space-Saving summary
+    ///
+    explicit flip_log(size_t capacity = 0)
+        : m_capacity(std::min(capacity, chunk_records * max_chunks))
+    {
+        m_heap.reserve(m_capacity);
+        m_heap_pos.resize(m_capacity);
+    }
+
+    ~flip_log() = default;
+
+    flip_log(const flip_log &) = delete;
+    flip_log &operator=(const flip_log &) = delete;
+
+    /// Records a flip (owner only)
+    ///
+    /// Bumps the counter (and updates the addresses) of a known
+    /// (rip, bits) record, or appends a new one.
+    ///
+    void
+    record(uintptr_t rip, uintptr_t gva, uintptr_t orig_gva, uintptr_t gpa, uintptr_t d_pa, uintptr_t cr3, uintptr_t bits)
+    {
+        if (m_requested.load(std::memory_order_acquire) != m_applied)
+            apply_requests();
+
+        if (auto &&index = m_index.find(flip_key(rip, bits)))
+        {
+            // Other vCPUs may read the record at the same time (see
+            // load()).
+            auto &&entry = at(*index);
+            __atomic_store_n(&entry.counter, entry.counter + 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&entry.gva, gva, __ATOMIC_RELAXED);
+            __atomic_store_n(&entry.gpa, gpa, __ATOMIC_RELAXED);
+            __atomic_store_n(&entry.d_pa, d_pa, __ATOMIC_RELAXED);
+
+            if (m_capacity != 0)
+                heap_down(m_heap_pos[*index]);
+
+            return;
+        }
+
+        const auto &&size = m_size.load(std::memory_order_relaxed);
+        if (m_capacity != 0 && size == m_capacity)
+        {
+            replace_min(flip_data(rip, gva, orig_gva, gpa, d_pa, cr3, bits, 0));
+            return;
+        }
+
+        if (size == chunk_records * max_chunks)
+        {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        auto &&chunk = m_chunks[size / chunk_records];
+        if (!chunk)
+            chunk = std::make_unique<flip_data[]>(chunk_records);
+
+        chunk[size % chunk_records] = flip_data(rip, gva, orig_gva, gpa, d_pa, cr3, bits, 1);
+        m_index[flip_key(rip, bits)] = size;
+
+        if (m_capacity != 0)
+            heap_push(size);
+
+        m_size.store(size + 1, std::memory_order_release);
+    }
+
+    /// Requests that all records are removed (any vCPU)
+    ///
+    void
+    request_clear()
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+
+        m_clear_requested = true;
+        m_removes_requested.clear();
+        m_requested.fetch_add(1, std::memory_order_release);
+    }
+
+    /// Requests that all records for <rip> are removed (any vCPU)
+    ///
+    void
+    request_remove(const uintptr_t rip)
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+
+        m_removes_requested.push_back(rip);
+        m_requested.fetch_add(1, std::memory_order_release);
+    }
+
+    /// Applies pending clear/remove requests (owner only)
+    ///
+    void
+    apply_requests()
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+
+        if (m_clear_requested)
+        {
+            m_size.store(0, std::memory_order_release);
+            m_index.clear();
+            m_heap.clear();
+            m_error_bound.store(0, std::memory_order_relaxed);
+        }
+        else if (!m_removes_requested.empty())
+        {
+            compact();
+        }
+
+        m_clear_requested = false;
+        m_removes_requested.clear();
+        m_applied = m_requested.load(std::memory_order_relaxed);
+    }
+
+    /// Calls f(record) for every visible record (any vCPU)
+    ///
+    /// Records hidden by pending requests are skipped.
+    ///
+    template<typename F>
+    void
+    for_each(F f) const
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+
+        if (m_clear_requested)
+            return;
+
+        const auto &&size = m_size.load(std::memory_order_acquire);
+        for (size_t i = 0; i < size; i++)
+        {
+            const auto &&entry = load(i);
+            if (is_removed(entry.rip))
+                continue;
+
+            f(entry);
+        }
+    }
+
+    /// Returns the number of records that didn't fit into the log.
+    ///
+    size_t
+    dropped() const noexcept
+    { return m_dropped.load(std::memory_order_relaxed); }
+
+    /// Returns the capacity of the Space-Saving summary (0 if the log
+    /// keeps every (rip, bits) pair).
+    ///
+    size_t
+    capacity() const noexcept
+    { return m_capacity; }
+
+    /// Returns by how much a counter may overestimate the flips of its
+    /// pair (any vCPU). 0 until a record has been replaced.
+    ///
+    uint64_t
+    error_bound() const noexcept
+    { return m_error_bound.load(std::memory_order_relaxed); }
+
+    /// Merges the records of several logs
+    ///
+    /// Records with the same (rip, bits) pair are combined into one: the
+    /// counters are summed up, the addresses of the last log win.
+    ///
+    /// @param logs the logs to merge
+    /// @param out the merged records
+    ///
+    static void
+    merge(const std::vector<flip_log *> &logs, std::vector<flip_data> &out)
+    {
+        flat_map<size_t> index;
+
+        out.clear();
+        for (const auto &log : logs)
+        {
+            log->for_each([&](const flip_data &entry)
+            {
+                bool inserted;
+                auto &&i = index.insert(flip_key(entry.rip, entry.bits), inserted);
+
+                if (inserted)
+                {
+                    i = out.size();
+                    out.push_back(entry);
+                    return;
+                }
+
+                auto &&merged = out[i];
+                merged.counter += entry.counter;
+                merged.gva = entry.gva;
+                merged.gpa = entry.gpa;
+                merged.d_pa = entry.d_pa;
+            });
+        }
+    }
+
+private:
+
+    flip_data &
+    at(const size_t index) const noexcept
+    { return m_chunks[index / chunk_records][index % chunk_records]; }
+
+    // Copies record <index>, retrying while the owner replaces a record.
+    // The fields that record() updates in place are loaded atomically.
+    flip_data
+    load(const size_t index) const noexcept
+    {
+        while (true)
+        {
+            const auto &&seq = m_replace_seq.load(std::memory_order_acquire);
+            const auto &source = at(index);
+
+            auto entry = source;
+            entry.counter = __atomic_load_n(&source.counter, __ATOMIC_RELAXED);
+            entry.gva = __atomic_load_n(&source.gva, __ATOMIC_RELAXED);
+            entry.gpa = __atomic_load_n(&source.gpa, __ATOMIC_RELAXED);
+            entry.d_pa = __atomic_load_n(&source.d_pa, __ATOMIC_RELAXED);
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if ((seq & 1) == 0 && m_replace_seq.load(std::memory_order_relaxed) == seq)
+                return entry;
+        }
+    }
+
+    // Space-Saving: <record> takes over the record with the smallest
+    // counter, and counts on from there.
+    void
+    replace_min(flip_data record)
+    {
+        const auto index = m_heap[0];
+        auto &&entry = at(index);
+
+        m_index.erase(flip_key(entry.rip, entry.bits));
+        m_index[flip_key(record.rip, record.bits)] = index;
+
+        // The counters of the heap only grow, so the latest minimum is the
+        // largest error of any record.
+        m_error_bound.store(entry.counter, std::memory_order_relaxed);
+        record.counter = entry.counter + 1;
+
+        const auto &&seq = m_replace_seq.load(std::memory_order_relaxed);
+        m_replace_seq.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        entry = record;
+
+        m_replace_seq.store(seq + 2, std::memory_order_release);
+
+        heap_down(0);
+    }
+
+    // Min-heap of record indexes, ordered by counter. m_heap_pos maps a
+    // record index to its position in the heap.
+    void
+    heap_swap(const size_t a, const size_t b) noexcept
+    {
+        std::swap(m_heap[a], m_heap[b]);
+        m_heap_pos[m_heap[a]] = a;
+        m_heap_pos[m_heap[b]] = b;
+    }
+
+    void
+    heap_push(const size_t index)
+    {
+        m_heap.push_back(index);
+        m_heap_pos[index] = m_heap.size() - 1;
+
+        for (auto pos = m_heap.size() - 1; pos > 0;)
+        {
+            const auto &&parent = (pos - 1) / 2;
+            if (at(m_heap[parent]).counter <= at(m_heap[pos]).counter)
+                break;
+
+            heap_swap(parent, pos);
+            pos = parent;
+        }
+    }
+
+    void
+    heap_down(size_t pos) noexcept
+    {
+        while (true)
+        {
+            auto smallest = pos;
+            const auto &&left = pos * 2 + 1;
+            const auto &&right = left + 1;
+
+            if (left < m_heap.size() && at(m_heap[left]).counter < at(m_heap[smallest]).counter)
+                smallest = left;
+            if (right < m_heap.size() && at(m_heap[right]).counter < at(m_heap[smallest]).counter)
+                smallest = right;
+
+            if (smallest == pos)
+                return;
+
+            heap_swap(pos, smallest);
+            pos = smallest;
+        }
+    }
+
+    bool
+    is_removed(const uintptr_t rip) const
+    {
+        return std::find(m_removes_requested.begin(), m_removes_requested.end(), rip) !=
+               m_removes_requested.end();
+    }
+
+    void
+    compact()
+    {
+        const auto &&size = m_size.load(std::memory_order_relaxed);
+
+        m_index.clear();
+
+        size_t kept = 0;
+        for (size_t i = 0; i < size; i++)
+        {
+            const auto &entry = at(i);
+            if (is_removed(entry.rip))
+                continue;
+
+            if (kept != i)
+                at(kept) = entry;
+
+            m_index[flip_key(entry.rip, entry.bits)] = kept++;
+        }
+
+        m_size.store(kept, std::memory_order_release);
+
+        if (m_capacity != 0)
+        {
+            m_heap.clear();
+            for (size_t i = 0; i < kept; i++)
+                heap_push(i);
+        }
+    }
+
+    std::array<records_type, max_chunks> m_chunks;
+    std::atomic<size_t> m_size{0};
+    std::atomic<size_t> m_dropped{0};
+
+    size_t m_capacity;
+    std::vector<size_t> m_heap;
+    std::vector<size_t> m_heap_pos;
+    std::atomic<uint64_t> m_error_bound{0};
+    std::atomic<uint64_t> m_replace_seq{0};
+
+    flat_map<size_t> m_index;
+
+    mutable std::mutex m_mutex;
+    std::atomic<uint64_t> m_requested{0};
+    uint64_t m_applied = 0;
+    bool m_clear_requested = false;
+    std::vector<uintptr_t> m_removes_requested;
+};
+
+#endif
@@ -0,0 +1,283 @@
+#ifndef FLIP_RING_H
+#define FLIP_RING_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+/// Flip event (this layout is shared with the guest monitor application)
+///
+/// <seq> numbers the events of a ring, starting at 1 when the ring is
+/// registered.
+///
+struct flip_event {
+    uint64_t seq = 0;
+    uint64_t rip = 0;
+    uint64_t gva = 0;
+    uint64_t orig_gva = 0;
+    uint64_t gpa = 0;
+    uint64_t cr3 = 0;
+    uint64_t tsc = 0;
+    uint32_t bits = 0;
+    uint32_t vcpuid = 0;
+};
+
+/// Flip Ring
+///
+/// Multi-producer, single-consumer ring in VMM memory. Every vCPU appends
+/// its flip events directly, and the guest monitor drains them with a
+/// VMCALL (see read()), so the VMM never writes to guest memory that the
+/// guest isn't waiting on. A monitor that goes away without unregistering
+/// the ring leaves nothing behind but the ring itself.
+///
+/// A producer reserves a position by bumping <head> (only if the consumer
+/// has made room, otherwise the event is dropped and counted), fills in
+/// the record and finally publishes it through its <seq>.
+///
+/// Each vCPU pushes through its own producer, which flags it as busy with
+/// the ring. detach() waits for these flags, so the ring can be freed
+/// without the vCPUs sharing a counter on the exit path.
+///
+class flip_ring
+{
+public:
+
+    // Largest number of records a ring may have (1 MiB of events)
+    static constexpr const uint64_t max_capacity = 1ULL << 14;
+
+    /// Producer (one per vCPU)
+    ///
+    class producer
+    {
+    public:
+
+        explicit producer(flip_ring &ring)
+            : m_ring(ring)
+        {
+            std::lock_guard<std::mutex> guard(m_ring.m_mutex);
+            m_ring.m_producers.push_back(this);
+        }
+
+        ~producer()
+        {
+            std::lock_guard<std::mutex> guard(m_ring.m_mutex);
+            auto &&producers = m_ring.m_producers;
+            producers.erase(std::remove(producers.begin(), producers.end(), this), producers.end());
+        }
+
+        producer(const producer &) = delete;
+        producer &operator=(const producer &) = delete;
+
+        /// Appends an event
+        ///
+        /// @return false if the event was dropped
+        ///
+        bool
+        push(const flip_event &event) noexcept
+        {
+            // Cheap check first, so the exit path doesn't touch anything
+            // while nobody is listening.
+            if (!m_ring.attached())
+                return false;
+
+            m_busy.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+
+            auto &&pushed = m_ring.produce(event);
+
+            m_busy.store(false, std::memory_order_release);
+            return pushed;
+        }
+
+    private:
+
+        friend class flip_ring;
+
+        flip_ring &m_ring;
+        std::atomic<bool> m_busy{false};
+    };
+
+    flip_ring() = default;
+
+    ~flip_ring()
+    { detach(); }
+
+    flip_ring(const flip_ring &) = delete;
+    flip_ring &operator=(const flip_ring &) = delete;
+
+    /// Returns the number of records a ring of <capacity> records really
+    /// gets (rounded down to a power of two, at most max_capacity).
+    ///
+    static uint64_t
+    capacity_for(const uint64_t capacity) noexcept
+    {
+        if (capacity == 0)
+            return 0;
+
+        uint64_t result = 1;
+        while (result * 2 <= capacity && result * 2 <= max_capacity)
+            result *= 2;
+
+        return result;
+    }
+
+    /// Allocates a new (empty) ring and starts producing into it
+    ///
+    /// @expects !attached()
+    /// @expects capacity_for(capacity) != 0
+    ///
+    /// @param capacity the requested number of records
+    ///
+    /// @return false if the ring couldn't be allocated
+    ///
+    bool
+    attach(const uint64_t capacity)
+    {
+        const auto &&num_records = capacity_for(capacity);
+
+        m_storage.reset(new (std::nothrow) slot[num_records]);
+        if (!m_storage)
+            return false;
+
+        m_mask = num_records - 1;
+        m_head.store(0, std::memory_order_relaxed);
+        m_tail.store(0, std::memory_order_relaxed);
+        m_dropped.store(0, std::memory_order_relaxed);
+
+        m_slots.store(m_storage.get(), std::memory_order_release);
+        return true;
+    }
+
+    /// Stops producing into the ring, and frees it
+    ///
+    /// Waits for producers that are still writing.
+    ///
+    void
+    detach()
+    {
+        if (m_slots.exchange(nullptr) == nullptr)
+            return;
+
+        {
+            std::lock_guard<std::mutex> guard(m_mutex);
+            for (const auto &producer : m_producers)
+            {
+                while (producer->m_busy.load())
+                { }
+            }
+        }
+
+        m_storage.reset();
+    }
+
+    /// Returns true if a ring is attached.
+    ///
+    bool
+    attached() const noexcept
+    { return m_slots.load(std::memory_order_relaxed) != nullptr; }
+
+    /// Returns the ring's capacity (in records), 0 if it isn't attached.
+    ///
+    uint64_t
+    capacity() const noexcept
+    { return attached() ? m_mask + 1 : 0; }
+
+    /// Returns the number of events that were ever reserved, i.e. the
+    /// <seq> of the latest one.
+    ///
+    uint64_t
+    head() const noexcept
+    { return m_head.load(); }
+
+    /// Returns the number of events that were dropped because the ring
+    /// was full.
+    ///
+    uint64_t
+    dropped() const noexcept
+    { return m_dropped.load(std::memory_order_relaxed); }
+
+    /// Returns the number of events that are reserved, but not consumed
+    /// yet (some may still be written).
+    ///
+    uint64_t
+    pending() const noexcept
+    { return m_head.load(std::memory_order_acquire) - m_tail.load(std::memory_order_relaxed); }
+
+    /// Copies up to <max> published events, oldest first, to <out>, and
+    /// hands their records back to the producers (consumer only).
+    ///
+    /// @return the number of copied events
+    ///
+    size_t
+    read(flip_event *out, const size_t max) noexcept
+    {
+        auto &&slots = m_slots.load(std::memory_order_acquire);
+        if (slots == nullptr)
+            return 0;
+
+        size_t num_read = 0;
+        auto tail = m_tail.load(std::memory_order_relaxed);
+        while (num_read < max)
+        {
+            auto &&record = slots[tail & m_mask];
+            if (record.seq.load(std::memory_order_acquire) != tail + 1)
+                break;
+
+            out[num_read++] = record.event;
+            m_tail.store(++tail, std::memory_order_release);
+        }
+
+        return num_read;
+    }
+
+private:
+
+    struct slot {
+        std::atomic<uint64_t> seq{0};
+        flip_event event;
+    };
+
+    bool
+    produce(const flip_event &event) noexcept
+    {
+        auto &&slots = m_slots.load(std::memory_order_acquire);
+        if (slots == nullptr)
+            return false;
+
+        auto &&pos = m_head.load(std::memory_order_relaxed);
+        do
+        {
+            const auto &&tail = m_tail.load(std::memory_order_acquire);
+            if (pos - tail > m_mask)
+            {
+                m_dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+        }
+        while (!m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_acq_rel, std::memory_order_relaxed));
+
+        auto &&record = slots[pos & m_mask];
+        record.event = event;
+        record.event.seq = pos + 1;
+        record.seq.store(pos + 1, std::memory_order_release);
+
+        return true;
+    }
+
+    std::atomic<slot *> m_slots{nullptr};
+    std::unique_ptr<slot[]> m_storage;
+    uint64_t m_mask = 0;
+
+    std::atomic<uint64_t> m_head{0};    // Number of records reserved so far.
+    std::atomic<uint64_t> m_tail{0};    // Number of records consumed so far.
+    std::atomic<uint64_t> m_dropped{0};
+
+    std::mutex m_mutex;
+    std::vector<producer *> m_producers;
+};
+
+#endif
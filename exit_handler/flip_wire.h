@@ -0,0 +1,113 @@
+#ifndef FLIP_WIRE_H
+#define FLIP_WIRE_H
+
+#include <exit_handler/flip_log.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+/// Packed flip records (the format is shared with the guest monitor
+/// application)
+///
+/// All integers are LEB128 varints, the signed ones zigzag encoded. The
+/// buffer starts with a header:
+///
+///   version (flip_wire_version)
+///   number of records
+///   error bound of the counters (see flip_log::error_bound())
+///
+/// followed by the records, sorted by (rip, bits). Values marked with
+/// "delta" are relative to the same value of the previous record (0 for
+/// the first one):
+///
+///   rip (delta)
+///   flags: access bits (2:0) and the flip_wire_* flags below
+///   orig_gva (signed delta)
+///   gva & 0xFFF if flip_wire_same_page, gva otherwise
+///   d_pa >> 12 (signed delta) if flip_wire_gpa_in_page, gpa and d_pa otherwise
+///   cr3, unless flip_wire_same_cr3
+///   counter
+///
+/// A new version is needed whenever this layout changes.
+///
+constexpr const uint64_t flip_wire_version = 1;
+
+constexpr const uint64_t flip_wire_same_page = 1ULL << 3;     // gva is on the page of orig_gva
+constexpr const uint64_t flip_wire_gpa_in_page = 1ULL << 4;   // gpa = d_pa + (gva & 0xFFF)
+constexpr const uint64_t flip_wire_same_cr3 = 1ULL << 5;      // cr3 is the one of the previous record
+
+namespace flip_wire_detail
+{
+    inline void
+    put(std::vector<uint8_t> &out, uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            out.push_back(static_cast<uint8_t>(value | 0x80));
+            value >>= 7;
+        }
+
+        out.push_back(static_cast<uint8_t>(value));
+    }
+
+    inline void
+    put_signed(std::vector<uint8_t> &out, const uint64_t value, const uint64_t prev)
+    {
+        const auto &&delta = static_cast<int64_t>(value - prev);
+        put(out, (static_cast<uint64_t>(delta) << 1) ^ static_cast<uint64_t>(delta >> 63));
+    }
+}
+
+/// Packs <flips> (see above) and appends them to <out>
+///
+/// <flips> gets sorted by (rip, bits) on the way.
+///
+inline void
+pack_flips(std::vector<flip_data> &flips, const uint64_t error_bound, std::vector<uint8_t> &out)
+{
+    using namespace flip_wire_detail;
+
+    std::sort(flips.begin(), flips.end(), [](const flip_data &lhs, const flip_data &rhs)
+    { return flip_key(lhs.rip, lhs.bits) < flip_key(rhs.rip, rhs.bits); });
+
+    // A record rarely takes more than 32 bytes.
+    out.reserve(out.size() + 32 + flips.size() * 32);
+
+    put(out, flip_wire_version);
+    put(out, flips.size());
+    put(out, error_bound);
+
+    flip_data prev;
+    for (const auto &flip : flips)
+    {
+        auto &&flags = flip.bits & 0x7;
+        if ((flip.gva >> 12) == (flip.orig_gva >> 12))
+            flags |= flip_wire_same_page;
+        if ((flip.d_pa & 0xFFF) == 0 && flip.gpa == flip.d_pa + (flip.gva & 0xFFF))
+            flags |= flip_wire_gpa_in_page;
+        if (flip.cr3 == prev.cr3)
+            flags |= flip_wire_same_cr3;
+
+        put(out, flip.rip - prev.rip);
+        put(out, flags);
+        put_signed(out, flip.orig_gva, prev.orig_gva);
+        put(out, (flags & flip_wire_same_page) != 0 ? flip.gva & 0xFFF : flip.gva);
+
+        if ((flags & flip_wire_gpa_in_page) != 0)
+            put_signed(out, flip.d_pa >> 12, prev.d_pa >> 12);
+        else
+        {
+            put(out, flip.gpa);
+            put(out, flip.d_pa);
+        }
+
+        if ((flags & flip_wire_same_cr3) == 0)
+            put(out, flip.cr3);
+
+        put(out, flip.counter);
+        prev = flip;
+    }
+}
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef GUEST_PAGE_WALKER_H
+#define GUEST_PAGE_WALKER_H
+
+#include <memory_manager/map_ptr_x64.h>
+
+#include <cstdint>
+#include <cstddef>
+
+/// Guest Page Walker
+///
+/// Translates guest virtual addresses of one address space (4-level
+/// paging). bfn::virt_to_phys_with_cr3() maps every level of the guest
+/// page tables for every address it translates; the walker keeps the last
+/// table of each level mapped instead, so walking a range of pages maps
+/// each table once: a 2m range costs one page table, not 2048 mappings.
+///
+/// The tables are read as they are when an address is translated, so a
+/// walker should only live for the duration of one VM exit.
+///
+class guest_page_walker
+{
+public:
+
+    /// Constructor
+    ///
+    /// @param cr3 the guest CR3 of the address space
+    ///
+    explicit guest_page_walker(uintptr_t cr3) noexcept
+        : m_pml4(cr3 & phys_mask)
+    { }
+
+    ~guest_page_walker() = default;
+
+    guest_page_walker(const guest_page_walker &) = delete;
+    guest_page_walker &operator=(const guest_page_walker &) = delete;
+
+    /// Translates <virt>
+    ///
+    /// @return the guest physical address, or 0 if <virt> isn't mapped
+    ///
+    uintptr_t
+    translate(const uintptr_t virt)
+    {
+        auto table = m_pml4;
+        for (size_t level = 0; level < num_levels; level++)
+        {
+            const auto &&entry = read_entry(level, table, virt);
+            if ((entry & present) == 0)
+                return 0;
+
+            // PDPTEs and PDEs can map 1g and 2m pages.
+            const auto &&shift = 39 - level * 9;
+            if (level == num_levels - 1 || (level != 0 && (entry & page_size) != 0))
+            {
+                const auto &&offset_mask = (1ULL << shift) - 1;
+                return ((entry & phys_mask) & ~offset_mask) | (virt & offset_mask);
+            }
+
+            table = entry & phys_mask;
+        }
+
+        return 0;
+    }
+
+private:
+
+    static constexpr const size_t num_levels = 4;
+    static constexpr const uintptr_t phys_mask = 0x000FFFFFFFFFF000ULL;
+    static constexpr const uintptr_t present = 1ULL << 0;
+    static constexpr const uintptr_t page_size = 1ULL << 7;
+
+    uintptr_t
+    read_entry(const size_t level, const uintptr_t table, const uintptr_t virt)
+    {
+        auto &&mapped = m_tables[level];
+        if (!mapped.map || mapped.phys != table)
+        {
+            mapped.map = bfn::make_unique_map_x64<uintptr_t>(table);
+            mapped.phys = table;
+        }
+
+        return mapped.map.get()[(virt >> (39 - level * 9)) & 0x1FF];
+    }
+
+    struct mapped_table {
+        uintptr_t phys = 0;
+        bfn::unique_map_ptr_x64<uintptr_t> map;
+    };
+
+    uintptr_t m_pml4;
+    mapped_table m_tables[num_levels];
+};
+
+#endif
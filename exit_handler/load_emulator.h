@@ -0,0 +1,351 @@
+#ifndef LOAD_EMULATOR_H
+#define LOAD_EMULATOR_H
+
+#include <cstdint>
+#include <cstddef>
+
+/// Decoded load instruction
+///
+/// Describes one of the (64-bit mode) instructions decode_load() knows:
+///
+/// - MOV r, r/m                (8A, 8B)
+/// - MOVZX/MOVSX r, r/m8/16    (0F B6, 0F B7, 0F BE, 0F BF)
+/// - MOVSXD r, r/m32           (63)
+/// - CMP r/m, r and CMP r, r/m (38, 39, 3A, 3B)
+/// - CMP r/m, imm              (80 /7, 81 /7, 83 /7)
+///
+/// All of them only read their memory operand, so they can be completed
+/// with the data page contents without giving the guest access to it.
+///
+struct load_insn {
+
+    enum kind_t {
+        mov,            // reg = mem
+        movzx,          // reg = zero_extend(mem)
+        movsx,          // reg = sign_extend(mem)
+        cmp_mem_reg,    // flags = mem - reg
+        cmp_reg_mem,    // flags = reg - mem
+        cmp_mem_imm     // flags = mem - imm
+    };
+
+    kind_t kind = mov;
+    size_t length = 0;      // Length of the instruction in bytes.
+    size_t mem_size = 0;    // Size of the memory operand in bytes.
+    size_t reg_size = 0;    // Size of the register (or immediate) operand in bytes.
+    int reg = 0;            // Register operand (0 = rax ... 15 = r15).
+    bool rex = false;       // A REX prefix was present (selects spl..dil over ah..bh).
+    uint64_t imm = 0;       // Immediate operand (sign-extended to reg_size).
+
+    int base = -1;          // Base register, -1 if none.
+    int index = -1;         // Index register, -1 if none.
+    int scale = 1;
+    int64_t disp = 0;
+    bool rip_relative = false;
+};
+
+namespace load_emulator_detail
+{
+    inline uint64_t
+    size_mask(const size_t size) noexcept
+    { return size >= 8 ? ~0ULL : (1ULL << (size * 8)) - 1; }
+
+    inline uint64_t
+    sign_extend(const uint64_t value, const size_t size) noexcept
+    {
+        const auto &&shift = 64 - size * 8;
+        return size >= 8 ? value : static_cast<uint64_t>(static_cast<int64_t>(value << shift) >> shift);
+    }
+
+    inline bool
+    read_le(const uint8_t *code, const size_t code_size, size_t &pos, const size_t size, uint64_t &value) noexcept
+    {
+        if (pos + size > code_size)
+            return false;
+
+        value = 0;
+        for (size_t i = 0; i < size; i++)
+            value |= static_cast<uint64_t>(code[pos + i]) << (i * 8);
+
+        pos += size;
+        return true;
+    }
+}
+
+/// Decodes a load instruction
+///
+/// Only instructions with a memory operand, 64-bit addressing and no FS/GS
+/// segment override are accepted. Anything else (LOCK/REP prefixes,
+/// register-only forms, unknown opcodes) is rejected, and the caller has
+/// to fall back to flipping the page.
+///
+/// @param code the instruction bytes
+/// @param code_size the number of valid bytes at <code>
+/// @param insn receives the decoded instruction
+///
+/// @return true if the instruction was decoded, false otherwise
+///
+inline bool
+decode_load(const uint8_t *code, const size_t code_size, load_insn &insn) noexcept
+{
+    using namespace load_emulator_detail;
+
+    insn = load_insn();
+
+    size_t pos = 0;
+    bool opsize_16 = false;
+    uint8_t rex = 0;
+
+    // Legacy prefixes
+    for (; pos < code_size; pos++)
+    {
+        const auto prefix = code[pos];
+
+        if (prefix == 0x66)
+            opsize_16 = true;
+        else if (prefix == 0x26 || prefix == 0x2E || prefix == 0x36 || prefix == 0x3E)
+            continue; // Ignored in 64-bit mode.
+        else if (prefix == 0x64 || prefix == 0x65 || prefix == 0x67 || prefix == 0xF0 || prefix == 0xF2 || prefix == 0xF3)
+            return false;
+        else
+            break;
+    }
+
+    // REX prefix (has to come right before the opcode)
+    if (pos < code_size && (code[pos] & 0xF0) == 0x40)
+        rex = code[pos++];
+
+    if (pos >= code_size)
+        return false;
+
+    const bool rex_w = (rex & 0x8) != 0;
+    const auto &&op_size = rex_w ? 8UL : (opsize_16 ? 2UL : 4UL);
+
+    insn.rex = rex != 0;
+
+    // Opcode
+    bool has_imm = false;
+    size_t imm_size = 0;
+    bool needs_cmp_ext = false;
+
+    const auto opcode = code[pos++];
+    switch (opcode)
+    {
+        case 0x8A: insn.kind = load_insn::mov; insn.mem_size = 1; insn.reg_size = 1; break;
+        case 0x8B: insn.kind = load_insn::mov; insn.mem_size = op_size; insn.reg_size = op_size; break;
+
+        case 0x63:
+            if (!rex_w)
+                return false;
+            insn.kind = load_insn::movsx; insn.mem_size = 4; insn.reg_size = 8;
+            break;
+
+        case 0x38: insn.kind = load_insn::cmp_mem_reg; insn.mem_size = 1; insn.reg_size = 1; break;
+        case 0x39: insn.kind = load_insn::cmp_mem_reg; insn.mem_size = op_size; insn.reg_size = op_size; break;
+        case 0x3A: insn.kind = load_insn::cmp_reg_mem; insn.mem_size = 1; insn.reg_size = 1; break;
+        case 0x3B: insn.kind = load_insn::cmp_reg_mem; insn.mem_size = op_size; insn.reg_size = op_size; break;
+
+        case 0x80:
+            insn.kind = load_insn::cmp_mem_imm; insn.mem_size = 1; insn.reg_size = 1;
+            has_imm = true; imm_size = 1; needs_cmp_ext = true;
+            break;
+        case 0x81:
+            insn.kind = load_insn::cmp_mem_imm; insn.mem_size = op_size; insn.reg_size = op_size;
+            has_imm = true; imm_size = opsize_16 && !rex_w ? 2 : 4; needs_cmp_ext = true;
+            break;
+        case 0x83:
+            insn.kind = load_insn::cmp_mem_imm; insn.mem_size = op_size; insn.reg_size = op_size;
+            has_imm = true; imm_size = 1; needs_cmp_ext = true;
+            break;
+
+        case 0x0F:
+        {
+            if (pos >= code_size)
+                return false;
+
+            switch (code[pos++])
+            {
+                case 0xB6: insn.kind = load_insn::movzx; insn.mem_size = 1; break;
+                case 0xB7: insn.kind = load_insn::movzx; insn.mem_size = 2; break;
+                case 0xBE: insn.kind = load_insn::movsx; insn.mem_size = 1; break;
+                case 0xBF: insn.kind = load_insn::movsx; insn.mem_size = 2; break;
+                default:
+                    return false;
+            }
+
+            insn.reg_size = op_size;
+            break;
+        }
+
+        default:
+            return false;
+    }
+
+    // ModRM
+    if (pos >= code_size)
+        return false;
+
+    const auto modrm = code[pos++];
+    const auto &&mod = modrm >> 6;
+    const auto &&reg = (modrm >> 3) & 0x7;
+    const auto &&rm = modrm & 0x7;
+
+    if (mod == 3)
+        return false; // Register operand, nothing to load.
+
+    if (needs_cmp_ext && reg != 7)
+        return false; // Group 1, but not CMP.
+
+    insn.reg = reg | ((rex & 0x4) ? 8 : 0);
+
+    size_t disp_size = mod == 1 ? 1 : (mod == 2 ? 4 : 0);
+
+    if (rm == 4)
+    {
+        // SIB
+        if (pos >= code_size)
+            return false;
+
+        const auto sib = code[pos++];
+        const auto &&scale = sib >> 6;
+        const auto &&index = ((sib >> 3) & 0x7) | ((rex & 0x2) ? 8 : 0);
+        const auto &&base = (sib & 0x7) | ((rex & 0x1) ? 8 : 0);
+
+        insn.scale = 1 << scale;
+        insn.index = index == 4 ? -1 : index;
+
+        if ((sib & 0x7) == 5 && mod == 0)
+            disp_size = 4;
+        else
+            insn.base = base;
+    }
+    else if (rm == 5 && mod == 0)
+    {
+        insn.rip_relative = true;
+        disp_size = 4;
+    }
+    else
+    {
+        insn.base = rm | ((rex & 0x1) ? 8 : 0);
+    }
+
+    uint64_t value = 0;
+    if (disp_size > 0)
+    {
+        if (!read_le(code, code_size, pos, disp_size, value))
+            return false;
+
+        insn.disp = static_cast<int64_t>(sign_extend(value, disp_size));
+    }
+
+    if (has_imm)
+    {
+        if (!read_le(code, code_size, pos, imm_size, value))
+            return false;
+
+        insn.imm = sign_extend(value, imm_size) & size_mask(insn.reg_size);
+    }
+
+    if (pos > 15)
+        return false;
+
+    insn.length = pos;
+    return true;
+}
+
+/// Returns the linear address of the memory operand
+///
+/// @param insn the decoded instruction
+/// @param next_rip the address of the next instruction
+/// @param gpr gpr(n) returns the value of register n (0 = rax ... 15 = r15)
+///
+template<typename R>
+uint64_t
+load_address(const load_insn &insn, const uint64_t next_rip, R &&gpr)
+{
+    auto &&address = static_cast<uint64_t>(insn.disp);
+
+    if (insn.rip_relative)
+        address += next_rip;
+    if (insn.base != -1)
+        address += gpr(insn.base);
+    if (insn.index != -1)
+        address += gpr(insn.index) * static_cast<uint64_t>(insn.scale);
+
+    return address;
+}
+
+/// Returns <rflags> with the arithmetic flags set like CMP <a>, <b> does
+///
+inline uint64_t
+cmp_flags(uint64_t a, uint64_t b, const size_t size, const uint64_t rflags) noexcept
+{
+    using namespace load_emulator_detail;
+
+    const auto &&mask = size_mask(size);
+    const auto &&sign = size * 8 - 1;
+
+    a &= mask;
+    b &= mask;
+    const auto &&r = (a - b) & mask;
+
+    uint64_t flags = 0;
+    flags |= (a < b) ? (1ULL << 0) : 0;                                     // CF
+    flags |= (__builtin_popcountll(r & 0xFF) & 1) ? 0 : (1ULL << 2);        // PF
+    flags |= ((a ^ b ^ r) & 0x10) ? (1ULL << 4) : 0;                        // AF
+    flags |= (r == 0) ? (1ULL << 6) : 0;                                    // ZF
+    flags |= ((r >> sign) & 1) ? (1ULL << 7) : 0;                           // SF
+    flags |= ((((a ^ b) & (a ^ r)) >> sign) & 1) ? (1ULL << 11) : 0;        // OF
+
+    return (rflags & ~0x8D5ULL) | flags;
+}
+
+/// Completes a decoded load
+///
+/// @param insn the decoded instruction
+/// @param value the contents of the memory operand (mem_size bytes)
+/// @param gpr gpr(n) returns a reference to register n (0 = rax ... 15 = r15)
+/// @param rflags the guest's RFLAGS, updated by CMP
+///
+template<typename R>
+void
+complete_load(const load_insn &insn, uint64_t value, R &&gpr, uint64_t &rflags)
+{
+    using namespace load_emulator_detail;
+
+    value &= size_mask(insn.mem_size);
+
+    // Without REX, byte registers 4-7 are ah, ch, dh and bh.
+    const auto &&high_byte = insn.reg_size == 1 && !insn.rex && insn.reg >= 4 && insn.reg < 8;
+    auto &&reg = gpr(high_byte ? insn.reg - 4 : insn.reg);
+    const auto &&reg_value = high_byte ? (reg >> 8) & 0xFF : reg & size_mask(insn.reg_size);
+
+    switch (insn.kind)
+    {
+        case load_insn::cmp_mem_reg:
+            rflags = cmp_flags(value, reg_value, insn.reg_size, rflags);
+            return;
+        case load_insn::cmp_reg_mem:
+            rflags = cmp_flags(reg_value, value, insn.reg_size, rflags);
+            return;
+        case load_insn::cmp_mem_imm:
+            rflags = cmp_flags(value, insn.imm, insn.reg_size, rflags);
+            return;
+        case load_insn::movsx:
+            value = sign_extend(value, insn.mem_size) & size_mask(insn.reg_size);
+            break;
+        case load_insn::mov:
+        case load_insn::movzx:
+            break;
+    }
+
+    // Writing a 32-bit register clears the upper half, 8 and 16-bit
+    // writes leave the rest of the register alone.
+    if (high_byte)
+        reg = (reg & ~0xFF00ULL) | (value << 8);
+    else if (insn.reg_size >= 4)
+        reg = value;
+    else
+        reg = (reg & ~size_mask(insn.reg_size)) | value;
+}
+
+#endif
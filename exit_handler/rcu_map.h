@@ -0,0 +1,566 @@
+#ifndef RCU_MAP_H
+#define RCU_MAP_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+/// RCU Domain
+///
+/// Epoch-based reclamation for data that is read on the exit path without
+/// any locking. Every vCPU owns a reader, which it enters when an exit
+/// starts and leaves before it resumes the guest. A writer that unlinks an
+/// object hands it to retire(), and reclaim() destroys it once no vCPU
+/// can still be in an exit that started before it was unlinked.
+///
+/// A vCPU that runs in the guest holds nothing, so it never delays a
+/// grace period, no matter how long it doesn't exit. The exception are
+/// objects the guest reaches through the EPT (see retire_cached()), which
+/// also have to wait until every vCPU has flushed its TLB.
+///
+class rcu_domain
+{
+public:
+
+    /// Reader (one per vCPU)
+    ///
+    /// Registers itself with the domain for its lifetime. enter() and
+    /// leave() are a store each, and must only be called by the owning
+    /// vCPU. Entering again without leaving is fine (e.g. after an exit
+    /// that never returned), it just starts a new read-side section.
+    ///
+    class reader
+    {
+    public:
+
+        explicit reader(rcu_domain &domain)
+            : m_domain(domain)
+        {
+            std::lock_guard<std::mutex> guard(m_domain.m_mutex);
+            m_domain.m_readers.push_back(this);
+
+            // A new vCPU hasn't cached anything yet.
+            m_flushed.store(m_domain.m_epoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+
+        ~reader()
+        {
+            std::lock_guard<std::mutex> guard(m_domain.m_mutex);
+            auto &&readers = m_domain.m_readers;
+            readers.erase(std::remove(readers.begin(), readers.end(), this), readers.end());
+        }
+
+        reader(const reader &) = delete;
+        reader &operator=(const reader &) = delete;
+
+        /// Starts a read-side section. Everything loaded afterwards stays
+        /// valid until leave().
+        ///
+        void
+        enter() noexcept
+        {
+            m_epoch.store(m_domain.m_epoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+
+        /// Ends the read-side section
+        ///
+        void
+        leave() noexcept
+        { m_epoch.store(0, std::memory_order_release); }
+
+        /// Records that the vCPU flushed its TLB, after reading <epoch>
+        /// from epoch(). Everything retired before is no longer cached.
+        ///
+        void
+        flushed(const uint64_t epoch) noexcept
+        { m_flushed.store(epoch, std::memory_order_release); }
+
+    private:
+
+        friend class rcu_domain;
+
+        rcu_domain &m_domain;
+        std::atomic<uint64_t> m_epoch{0};   // Epoch at enter(), 0 outside of a section.
+        std::atomic<uint64_t> m_flushed{0}; // Epoch before the last TLB flush.
+    };
+
+    rcu_domain() = default;
+    ~rcu_domain() = default;
+
+    rcu_domain(const rcu_domain &) = delete;
+    rcu_domain &operator=(const rcu_domain &) = delete;
+
+    /// Destroys <object> after a grace period
+    ///
+    /// The object must already be unreachable for readers that enter
+    /// from now on.
+    ///
+    template<typename T>
+    void
+    retire(std::unique_ptr<T> object)
+    { retire_object(std::shared_ptr<const void>(std::move(object)), false); }
+
+    /// Destroys <object> after a grace period, once every reader has
+    /// flushed its TLB (see reader::flushed())
+    ///
+    /// For memory the guest reaches through the EPT, like code pages. A
+    /// vCPU keeps using translations it has cached after the EPT changed,
+    /// until it flushes. So the object has to be retired after the EPT no
+    /// longer maps it, but before the vCPUs are asked to flush.
+    ///
+    template<typename T>
+    void
+    retire_cached(std::unique_ptr<T> object)
+    { retire_object(std::shared_ptr<const void>(std::move(object)), true); }
+
+    /// Returns the current epoch (see reader::flushed()).
+    ///
+    uint64_t
+    epoch() const noexcept
+    { return m_epoch.load(); }
+
+    /// Destroys the retired objects whose grace period is over
+    ///
+    /// Must not be called from within a read-side section of the calling
+    /// vCPU (that section would keep its own objects alive).
+    ///
+    /// @return the number of objects destroyed
+    ///
+    size_t
+    reclaim()
+    {
+        std::vector<retired_object> done;
+        {
+            std::lock_guard<std::mutex> guard(m_mutex);
+            if (m_retired.empty())
+                return 0;
+
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+
+            // Readers that entered at or before an object's epoch might
+            // still hold it, and readers that flushed at or before it
+            // might still have it cached.
+            auto oldest = std::numeric_limits<uint64_t>::max();
+            auto oldest_flush = std::numeric_limits<uint64_t>::max();
+            for (const auto &reader : m_readers)
+            {
+                const auto &&epoch = reader->m_epoch.load(std::memory_order_relaxed);
+                if (epoch != 0)
+                    oldest = std::min(oldest, epoch);
+
+                oldest_flush = std::min(oldest_flush, reader->m_flushed.load(std::memory_order_acquire));
+            }
+
+            auto &&split = std::stable_partition(m_retired.begin(), m_retired.end(), [&](const auto &retired)
+            { return retired.epoch >= oldest || (retired.cached && retired.epoch >= oldest_flush); });
+
+            done.assign(std::make_move_iterator(split), std::make_move_iterator(m_retired.end()));
+            m_retired.erase(split, m_retired.end());
+        }
+
+        // Destructors may take other locks, so they run unlocked.
+        return done.size();
+    }
+
+    /// Returns the number of objects waiting for their grace period.
+    ///
+    size_t
+    pending() const
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        return m_retired.size();
+    }
+
+private:
+
+    struct retired_object
+    {
+        uint64_t epoch;
+        bool cached;
+        std::shared_ptr<const void> object;
+    };
+
+    void
+    retire_object(std::shared_ptr<const void> object, const bool cached)
+    {
+        if (!object)
+            return;
+
+        std::lock_guard<std::mutex> guard(m_mutex);
+
+        // Readers that enter (or flush) from now on get a newer epoch.
+        const auto &&epoch = m_epoch.fetch_add(1);
+        m_retired.push_back({epoch, cached, std::move(object)});
+    }
+
+    mutable std::mutex m_mutex;
+    std::atomic<uint64_t> m_epoch{1};
+
+    std::vector<reader *> m_readers;
+    std::vector<retired_object> m_retired;
+};
+
+/// RCU Pointer
+///
+/// Owning pointer to an immutable object that readers load without
+/// locking. Writers replace the object as a whole, and the old one is
+/// retired to the domain. Writers have to be serialized by the caller.
+///
+template<typename T>
+class rcu_ptr
+{
+public:
+
+    rcu_ptr() = default;
+
+    ~rcu_ptr()
+    { delete m_ptr.load(std::memory_order_relaxed); }
+
+    rcu_ptr(const rcu_ptr &) = delete;
+    rcu_ptr &operator=(const rcu_ptr &) = delete;
+
+    /// Returns the current object (nullptr if there is none). Only valid
+    /// within a read-side section, or while writers are excluded.
+    ///
+    const T *
+    get() const noexcept
+    { return m_ptr.load(std::memory_order_acquire); }
+
+    /// Replaces the object, and retires the old one to <domain>
+    ///
+    void
+    publish(std::unique_ptr<const T> value, rcu_domain &domain)
+    { domain.retire(std::unique_ptr<const T>(m_ptr.exchange(value.release(), std::memory_order_acq_rel))); }
+
+private:
+    std::atomic<const T *> m_ptr{nullptr};
+};
+
+/// RCU Map
+///
+/// Maps 64-bit integer keys to heap-allocated values, with lookups that
+/// neither lock nor write to shared memory (see rcu_domain). It's an
+/// open-addressing table with linear probing, like flat_map, but the
+/// values stay where they are, so pointers returned by find() remain
+/// valid until the value is erased and its grace period is over.
+///
+/// A key keeps its slot for the lifetime of the table: insert() stores the
+/// value before the key, and erase() only clears the value, leaving a
+/// tombstone that the key reuses if it's inserted again. Once keys and
+/// tombstones fill half of the table, a new table without tombstones is
+/// published and the old one is retired.
+///
+/// Writers are serialized internally, readers never wait.
+///
+template<typename V>
+class rcu_map
+{
+    struct slot
+    {
+        std::atomic<uint64_t> key{empty_key};
+        std::atomic<V *> value{nullptr};
+    };
+
+    struct table
+    {
+        explicit table(const size_t capacity)
+            : slots(new slot[capacity])
+            , mask(capacity - 1)
+        { }
+
+        std::unique_ptr<slot[]> slots;
+        size_t mask;
+    };
+
+public:
+
+    using key_type = uint64_t;
+    using value_type = V;
+
+    /// Constructor
+    ///
+    /// @param domain the domain that erased values are retired to
+    /// @param cached true if the guest reaches (memory owned by) the
+    ///        values through the EPT (see rcu_domain::retire_cached())
+    ///
+    explicit rcu_map(rcu_domain &domain, const bool cached = false)
+        : m_domain(domain)
+        , m_cached(cached)
+    { }
+
+    ~rcu_map()
+    {
+        auto &&current = m_table.load(std::memory_order_relaxed);
+        if (current == nullptr)
+            return;
+
+        for (size_t i = 0; i <= current->mask; i++)
+            delete current->slots[i].value.load(std::memory_order_relaxed);
+
+        delete current;
+    }
+
+    rcu_map(const rcu_map &) = delete;
+    rcu_map &operator=(const rcu_map &) = delete;
+
+    /// Returns the number of values in the map.
+    ///
+    size_t
+    size() const noexcept
+    { return m_size.load(std::memory_order_relaxed); }
+
+    /// Returns true if the map holds no values.
+    ///
+    bool
+    empty() const noexcept
+    { return size() == 0; }
+
+    /// Looks up a key (wait-free)
+    ///
+    /// @param key the key to search for
+    ///
+    /// @return a pointer to the value, or nullptr if the key doesn't exist
+    ///
+    V *
+    find(const key_type key) const noexcept
+    {
+        const auto &&current = m_table.load(std::memory_order_acquire);
+        if (current == nullptr)
+            return nullptr;
+
+        for (auto i = home(key, current->mask); ; i = (i + 1) & current->mask)
+        {
+            const auto &&k = current->slots[i].key.load(std::memory_order_acquire);
+            if (k == key)
+                return current->slots[i].value.load(std::memory_order_acquire);
+
+            if (k == empty_key)
+                return nullptr;
+        }
+    }
+
+    /// Inserts a value (if the key doesn't exist yet)
+    ///
+    /// The value is visible to readers as soon as this returns, so it has
+    /// to be complete.
+    ///
+    /// @param key the key to insert
+    /// @param value the value to insert
+    ///
+    /// @return the new value, or the existing one (<value> is dropped)
+    ///
+    V &
+    insert(const key_type key, std::unique_ptr<V> value)
+    {
+        std::lock_guard<std::mutex> guard(m_mutex);
+
+        if (auto &&existing = find(key))
+            return *existing;
+
+        auto &&current = m_table.load(std::memory_order_relaxed);
+        if (current == nullptr || (m_used + 1) * 2 > current->mask + 1)
+            current = rehash();
+
+        auto i = home(key, current->mask);
+        for (;; i = (i + 1) & current->mask)
+        {
+            const auto &&k = current->slots[i].key.load(std::memory_order_relaxed);
+            if (k == key || k == empty_key)
+                break;
+        }
+
+        auto &&s = current->slots[i];
+        s.value.store(value.get(), std::memory_order_release);
+
+        if (s.key.load(std::memory_order_relaxed) == empty_key)
+        {
+            s.key.store(key, std::memory_order_release);
+            m_used++;
+        }
+
+        m_size.fetch_add(1, std::memory_order_relaxed);
+        return *value.release();
+    }
+
+    /// Removes a key. The value is retired, so readers that found it can
+    /// keep using it until they leave their read-side section.
+    ///
+    /// @param key the key to remove
+    ///
+    /// @return true if the key existed, false otherwise
+    ///
+    bool
+    erase(const key_type key)
+    {
+        std::unique_ptr<V> value;
+        {
+            std::lock_guard<std::mutex> guard(m_mutex);
+
+            auto &&current = m_table.load(std::memory_order_relaxed);
+            if (current == nullptr)
+                return false;
+
+            for (auto i = home(key, current->mask); ; i = (i + 1) & current->mask)
+            {
+                auto &&s = current->slots[i];
+                const auto &&k = s.key.load(std::memory_order_relaxed);
+                if (k == empty_key)
+                    return false;
+
+                if (k == key)
+                {
+                    value.reset(s.value.exchange(nullptr, std::memory_order_acq_rel));
+                    break;
+                }
+            }
+
+            if (!value)
+                return false;
+
+            m_size.fetch_sub(1, std::memory_order_relaxed);
+        }
+
+        retire_value(std::move(value));
+        return true;
+    }
+
+    /// Removes all values. They are retired with the table, as a single
+    /// object, so clearing a large map costs one grace period entry.
+    ///
+    void
+    clear()
+    {
+        std::unique_ptr<table> old;
+        auto &&values = std::make_unique<std::vector<std::unique_ptr<V>>>();
+        {
+            std::lock_guard<std::mutex> guard(m_mutex);
+
+            old.reset(m_table.exchange(nullptr, std::memory_order_acq_rel));
+            if (!old)
+                return;
+
+            values->reserve(size());
+            for (size_t i = 0; i <= old->mask; i++)
+            {
+                if (auto &&value = old->slots[i].value.load(std::memory_order_relaxed))
+                    values->emplace_back(value);
+            }
+
+            m_size.store(0, std::memory_order_relaxed);
+            m_used = 0;
+        }
+
+        m_domain.retire(std::move(old));
+        retire_value(std::move(values));
+    }
+
+    /// Calls f(key, value) for every value. Readers may call it too, but
+    /// then see values that are inserted or erased meanwhile or not. The
+    /// map must not be modified from within f.
+    ///
+    template<typename F>
+    void
+    for_each(F f) const
+    {
+        const auto &&current = m_table.load(std::memory_order_acquire);
+        if (current == nullptr)
+            return;
+
+        for (size_t i = 0; i <= current->mask; i++)
+        {
+            auto &&s = current->slots[i];
+            if (auto &&value = s.value.load(std::memory_order_acquire))
+                f(s.key.load(std::memory_order_relaxed), *value);
+        }
+    }
+
+private:
+
+    static constexpr const size_t min_capacity = 16;
+    static constexpr const key_type empty_key = std::numeric_limits<key_type>::max();
+
+    static size_t
+    home(const key_type key, const size_t mask) noexcept
+    {
+        // splitmix64 finalizer (see flat_map)
+        auto h = key;
+        h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+        h = h ^ (h >> 31);
+
+        return static_cast<size_t>(h) & mask;
+    }
+
+    /// Publishes a new table with room for the current values, without
+    /// tombstones, and retires the old one. Called with m_mutex held.
+    ///
+    table *
+    rehash()
+    {
+        auto capacity = min_capacity;
+        while (capacity < (size() + 1) * 4)
+            capacity *= 2;
+
+        auto &&next = std::make_unique<table>(capacity);
+        m_used = 0;
+
+        std::unique_ptr<table> old(m_table.load(std::memory_order_relaxed));
+        if (old)
+        {
+            for (size_t i = 0; i <= old->mask; i++)
+            {
+                auto &&value = old->slots[i].value.load(std::memory_order_relaxed);
+                if (value == nullptr)
+                    continue;
+
+                const auto &&key = old->slots[i].key.load(std::memory_order_relaxed);
+
+                auto j = home(key, next->mask);
+                while (next->slots[j].key.load(std::memory_order_relaxed) != empty_key)
+                    j = (j + 1) & next->mask;
+
+                next->slots[j].value.store(value, std::memory_order_relaxed);
+                next->slots[j].key.store(key, std::memory_order_relaxed);
+                m_used++;
+            }
+        }
+
+        m_table.store(next.get(), std::memory_order_release);
+        m_domain.retire(std::move(old));
+
+        return next.release();
+    }
+
+    template<typename T>
+    void
+    retire_value(std::unique_ptr<T> value)
+    {
+        if (m_cached)
+            m_domain.retire_cached(std::move(value));
+        else
+            m_domain.retire(std::move(value));
+    }
+
+    rcu_domain &m_domain;
+    bool m_cached;
+
+    std::mutex m_mutex;
+    std::atomic<table *> m_table{nullptr};
+    std::atomic<size_t> m_size{0};
+    size_t m_used = 0;      // Slots with a key (values and tombstones).
+};
+
+template<typename V>
+constexpr const size_t rcu_map<V>::min_capacity;
+
+template<typename V>
+constexpr const typename rcu_map<V>::key_type rcu_map<V>::empty_key;
+
+#endif
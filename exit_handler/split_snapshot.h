@@ -0,0 +1,335 @@
+#ifndef SPLIT_SNAPSHOT_H
+#define SPLIT_SNAPSHOT_H
+
+#include <exit_handler/flip_wire.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+/// Split set snapshots
+///
+/// A snapshot describes the splits of a VMM instance in a form that a
+/// later instance can re-install (see tlb_handler::import_splits()). The
+/// guest only stores it, so the format is private to the VMM. The code
+/// pages aren't stored as a whole, only the bytes they differ in from
+/// their data pages.
+///
+/// All integers are LEB128 varints, the signed ones zigzag encoded. The
+/// buffer starts with a header:
+///
+///   version (split_snapshot_version)
+///   number of records
+///
+/// followed by the records, sorted by data page. Values marked with
+/// "delta" are relative to the same value of the previous record (0 for
+/// the first one):
+///
+///   gva (signed delta)
+///   flags (split_snapshot_* below)
+///   d_pa >> 12 (signed delta)
+///   cr3, unless split_snapshot_same_cr3
+///   number of hooks
+///   number of further address spaces, and their cr3 bases
+///   number of runs, and for each of them:
+///     offset (relative to the end of the previous run)
+///     size
+///     <size> bytes of code
+///
+/// A new version is needed whenever this layout changes.
+///
+constexpr const uint64_t split_snapshot_version = 1;
+
+constexpr const uint64_t split_snapshot_active = 1ULL << 0;     // The split is active
+constexpr const uint64_t split_snapshot_same_cr3 = 1ULL << 1;   // cr3 is the one of the previous record
+
+// Bytes of a page that differ from the bytes around them are merged into
+// one run if they are at most this far apart (a run costs 2 bytes).
+constexpr const size_t split_snapshot_max_gap = 2;
+
+/// Split of a snapshot
+///
+struct split_snapshot_entry {
+    uint64_t gva = 0;               // The address the split was requested for.
+    uint64_t cr3 = 0;               // The address space of <gva>.
+    uint64_t d_pa = 0;              // The (4k aligned) data page <gva> translated to.
+    uint64_t num_hooks = 0;
+    bool active = false;
+
+    std::vector<uint64_t> cr3s;     // Further address spaces (cr3 bases) the split is enabled in.
+
+    struct run {
+        uint16_t offset;
+        uint16_t size;
+    };
+
+    std::vector<run> runs;          // Where the code page differs from the data page,
+    std::vector<uint8_t> code;      // and its bytes there (the runs back to back).
+
+    /// Records the bytes of <code_page> that differ from <data_page>
+    ///
+    void
+    diff(const uint8_t *data_page, const uint8_t *code_page)
+    {
+        runs.clear();
+        code.clear();
+
+        for (size_t i = 0; i < page_size; i++)
+        {
+            // Most of a page is unchanged, so skip equal words at once.
+            if ((i & 7) == 0)
+            {
+                while (i < page_size && word(code_page + i) == word(data_page + i))
+                    i += 8;
+
+                if (i == page_size)
+                    break;
+            }
+
+            if (code_page[i] == data_page[i])
+                continue;
+
+            if (!runs.empty() && i - (runs.back().offset + runs.back().size) <= split_snapshot_max_gap)
+            {
+                const auto &&end = runs.back().offset + runs.back().size;
+                code.insert(code.end(), code_page + end, code_page + i + 1);
+                runs.back().size = static_cast<uint16_t>(i + 1 - runs.back().offset);
+            }
+            else
+            {
+                runs.push_back({static_cast<uint16_t>(i), 1});
+                code.push_back(code_page[i]);
+            }
+        }
+    }
+
+    /// Writes the recorded bytes to <page>
+    ///
+    void
+    patch(uint8_t *page) const noexcept
+    {
+        auto *bytes = code.data();
+        for (const auto &r : runs)
+        {
+            std::memcpy(page + r.offset, bytes, r.size);
+            bytes += r.size;
+        }
+    }
+
+    static constexpr const size_t page_size = 0x1000;
+
+private:
+
+    static uint64_t
+    word(const uint8_t *bytes) noexcept
+    {
+        uint64_t value;
+        std::memcpy(&value, bytes, sizeof(value));
+        return value;
+    }
+};
+
+namespace split_snapshot_detail
+{
+    using flip_wire_detail::put;
+    using flip_wire_detail::put_signed;
+
+    /// Cursor over a packed snapshot (see above). Every read fails once
+    /// the data runs out.
+    ///
+    class reader
+    {
+    public:
+
+        reader(const uint8_t *data, size_t size) noexcept
+            : m_pos(data)
+            , m_end(data + size)
+        { }
+
+        bool
+        get(uint64_t &value) noexcept
+        {
+            value = 0;
+            for (unsigned shift = 0; m_pos != m_end && shift < 64; shift += 7)
+            {
+                const auto byte = *m_pos++;
+                value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+
+                if ((byte & 0x80) == 0)
+                    return true;
+            }
+
+            return false;
+        }
+
+        bool
+        get_signed(uint64_t &value, const uint64_t prev) noexcept
+        {
+            uint64_t zigzag = 0;
+            if (!get(zigzag))
+                return false;
+
+            value = prev + ((zigzag >> 1) ^ (0 - (zigzag & 1)));
+            return true;
+        }
+
+        bool
+        get_bytes(std::vector<uint8_t> &out, const size_t size)
+        {
+            if (static_cast<size_t>(m_end - m_pos) < size)
+                return false;
+
+            out.insert(out.end(), m_pos, m_pos + size);
+            m_pos += size;
+            return true;
+        }
+
+        size_t
+        remaining() const noexcept
+        { return static_cast<size_t>(m_end - m_pos); }
+
+    private:
+        const uint8_t *m_pos;
+        const uint8_t *m_end;
+    };
+}
+
+/// Packs <entries> (see above) and appends them to <out>
+///
+/// <entries> gets sorted by data page on the way.
+///
+inline void
+pack_split_snapshot(std::vector<split_snapshot_entry> &entries, std::vector<uint8_t> &out)
+{
+    using namespace split_snapshot_detail;
+
+    std::sort(entries.begin(), entries.end(), [](const split_snapshot_entry &lhs, const split_snapshot_entry &rhs)
+    { return lhs.d_pa < rhs.d_pa; });
+
+    put(out, split_snapshot_version);
+    put(out, entries.size());
+
+    split_snapshot_entry prev;
+    for (const auto &entry : entries)
+    {
+        auto &&flags = entry.active ? split_snapshot_active : 0;
+        if (entry.cr3 == prev.cr3)
+            flags |= split_snapshot_same_cr3;
+
+        put_signed(out, entry.gva, prev.gva);
+        put(out, flags);
+        put_signed(out, entry.d_pa >> 12, prev.d_pa >> 12);
+
+        if ((flags & split_snapshot_same_cr3) == 0)
+            put(out, entry.cr3);
+
+        put(out, entry.num_hooks);
+
+        put(out, entry.cr3s.size());
+        for (const auto &cr3 : entry.cr3s)
+            put(out, cr3);
+
+        put(out, entry.runs.size());
+
+        size_t end = 0;
+        auto *bytes = entry.code.data();
+        for (const auto &r : entry.runs)
+        {
+            put(out, r.offset - end);
+            put(out, r.size);
+            out.insert(out.end(), bytes, bytes + r.size);
+
+            end = r.offset + r.size;
+            bytes += r.size;
+        }
+
+        prev.gva = entry.gva;
+        prev.cr3 = entry.cr3;
+        prev.d_pa = entry.d_pa;
+    }
+}
+
+/// Unpacks a snapshot (see above) into <entries>
+///
+/// @return false if the snapshot has an unsupported version or is
+///     malformed (<entries> is undefined then)
+///
+inline bool
+unpack_split_snapshot(const uint8_t *data, const size_t size, std::vector<split_snapshot_entry> &entries)
+{
+    using namespace split_snapshot_detail;
+
+    reader in(data, size);
+    entries.clear();
+
+    uint64_t version = 0;
+    uint64_t count = 0;
+    if (!in.get(version) || version != split_snapshot_version || !in.get(count))
+        return false;
+
+    // Every record takes at least 6 bytes, which bounds <count> before
+    // anything gets allocated for it.
+    if (count > in.remaining() / 6)
+        return false;
+
+    entries.resize(count);
+
+    const split_snapshot_entry *prev = nullptr;
+    for (auto &&entry : entries)
+    {
+        uint64_t flags = 0;
+        uint64_t pfn = 0;
+
+        if (!in.get_signed(entry.gva, prev != nullptr ? prev->gva : 0) ||
+            !in.get(flags) ||
+            !in.get_signed(pfn, prev != nullptr ? prev->d_pa >> 12 : 0))
+            return false;
+
+        entry.d_pa = pfn << 12;
+        entry.active = (flags & split_snapshot_active) != 0;
+
+        if ((flags & split_snapshot_same_cr3) != 0)
+            entry.cr3 = prev != nullptr ? prev->cr3 : 0;
+        else if (!in.get(entry.cr3))
+            return false;
+
+        uint64_t num_cr3s = 0;
+        if (!in.get(entry.num_hooks) || !in.get(num_cr3s) || num_cr3s > in.remaining())
+            return false;
+
+        entry.cr3s.resize(num_cr3s);
+        for (auto &&cr3 : entry.cr3s)
+        {
+            if (!in.get(cr3))
+                return false;
+        }
+
+        uint64_t num_runs = 0;
+        if (!in.get(num_runs) || num_runs > split_snapshot_entry::page_size)
+            return false;
+
+        uint64_t end = 0;
+        for (uint64_t i = 0; i < num_runs; i++)
+        {
+            uint64_t gap = 0;
+            uint64_t run_size = 0;
+
+            if (!in.get(gap) || !in.get(run_size) || run_size == 0 ||
+                gap > split_snapshot_entry::page_size - end ||
+                run_size > split_snapshot_entry::page_size - end - gap ||
+                !in.get_bytes(entry.code, run_size))
+                return false;
+
+            entry.runs.push_back({static_cast<uint16_t>(end + gap), static_cast<uint16_t>(run_size)});
+            end += gap + run_size;
+        }
+
+        prev = &entry;
+    }
+
+    return in.remaining() == 0;
+}
+
+#endif
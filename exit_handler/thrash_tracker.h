@@ -0,0 +1,248 @@
+#ifndef THRASH_TRACKER_H
+#define THRASH_TRACKER_H
+
+#include <exit_handler/flat_map.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <limits>
+#include <vector>
+
+/// What happens to a split page that exceeds its exit budget (see
+/// thrash_tracker)
+///
+enum thrash_policy_t {
+    thrash_single_step,     // Single-step the next instructions through the clean EPT
+    thrash_data_view,       // Keep the page on the data page (in the vCPU's view) for a while
+    thrash_deactivate       // Deactivate the split (on the next VMCALL), and report it in the event log
+};
+
+/// Result of thrash_tracker::record()
+///
+enum thrash_verdict_t {
+    thrash_none,
+    thrash_livelock,        // The same instruction keeps faulting on the page
+    thrash_hot              // The page exceeded its exit budget
+};
+
+/// Thrash Tracker
+///
+/// Counts the EPT violations each split page causes on one vCPU, over a
+/// sliding window of 2^<window_shift> TSC ticks. The window is
+/// approximated with two fixed ones: the exits of the current window, plus
+/// those of the previous one weighted by how much of it still overlaps.
+///
+/// Two patterns are reported:
+///
+/// - An instruction that faults on the page more than <max_repeats> times
+///   in a row, with nothing completed in between, can't make progress on
+///   its own (e.g. it executes from the page and reads from it too). Only
+///   the faults of that page count, so exits elsewhere don't hide it.
+/// - A page that causes more than <max_exits> exits per window, no matter
+///   from which instructions (e.g. two that alternate).
+///
+/// Once reported, a page starts over with a clean slate. Pages can also be
+/// put on a cooldown, which the tracker only keeps time for.
+///
+/// Only the owning vCPU may use its tracker, so nothing is locked.
+///
+class thrash_tracker
+{
+public:
+
+    thrash_tracker(uint64_t window_shift, uint64_t max_exits, uint64_t max_repeats) noexcept
+        : m_window_shift(window_shift)
+        , m_max_exits(max_exits)
+        , m_max_repeats(max_repeats)
+    { }
+
+    ~thrash_tracker() = default;
+
+    thrash_tracker(const thrash_tracker &) = delete;
+    thrash_tracker &operator=(const thrash_tracker &) = delete;
+
+    /// Records an exit caused by the page <pfn>
+    ///
+    /// @param pfn the page frame number of the split
+    /// @param rip the faulting instruction
+    /// @param completed true if the access was completed without a flip
+    ///     (e.g. an emulated read), so the instruction made progress
+    /// @param now the current TSC value
+    ///
+    /// @return what (if anything) the page should be treated for
+    ///
+    thrash_verdict_t
+    record(const uint64_t pfn, const uint64_t rip, const bool completed, const uint64_t now)
+    {
+        auto &&page = lookup(pfn, now);
+        const auto &&window = 1ULL << m_window_shift;
+
+        const auto &&elapsed = now - page.window_start;
+        if (elapsed >= 2 * window)
+        {
+            page.window_start = now;
+            page.prev_exits = 0;
+            page.exits = 0;
+        }
+        else if (elapsed >= window)
+        {
+            page.window_start += window;
+            page.prev_exits = page.exits;
+            page.exits = 0;
+        }
+
+        page.exits++;
+
+        if (completed) {}
+        else if (rip == page.last_rip)
+            page.repeats++;
+        else
+        {
+            page.last_rip = rip;
+            page.repeats = 0;
+        }
+
+        auto verdict = thrash_none;
+        if (page.repeats > m_max_repeats)
+            verdict = thrash_livelock;
+        else
+        {
+            const auto &&overlap = window - (now - page.window_start);
+            const auto &&exits = page.exits + ((page.prev_exits * overlap) >> m_window_shift);
+
+            if (exits > m_max_exits)
+                verdict = thrash_hot;
+        }
+
+        if (verdict != thrash_none)
+        {
+            page.prev_exits = 0;
+            page.exits = 0;
+            page.last_rip = 0;
+            page.repeats = 0;
+        }
+
+        return verdict;
+    }
+
+    /// Puts the page <pfn> on a cooldown that ends at <until>
+    ///
+    void
+    start_cooldown(const uint64_t pfn, const uint64_t until)
+    {
+        auto &&page = m_pages[pfn];
+        if (page.cooldown_until == 0)
+            m_num_cooling++;
+
+        page.cooldown_until = until;
+        m_next_cooldown_end = std::min(m_next_cooldown_end, until);
+    }
+
+    /// Returns true if the page <pfn> is on a cooldown
+    ///
+    bool
+    cooling(const uint64_t pfn) const noexcept
+    {
+        if (m_num_cooling == 0)
+            return false;
+
+        const auto &&page = m_pages.find(pfn);
+        return page != nullptr && page->cooldown_until != 0;
+    }
+
+    /// Returns the number of pages on a cooldown.
+    ///
+    size_t
+    num_cooling() const noexcept
+    { return m_num_cooling; }
+
+    /// Ends the cooldowns that are over at <now>, and calls f(pfn) for
+    /// each of their pages
+    ///
+    template<typename F> void
+    end_cooldowns(const uint64_t now, F f)
+    {
+        if (m_num_cooling == 0 || now < m_next_cooldown_end)
+            return;
+
+        m_next_cooldown_end = std::numeric_limits<uint64_t>::max();
+        m_pages.for_each([&](uint64_t pfn, page_state &page)
+        {
+            if (page.cooldown_until == 0)
+                return;
+
+            if (page.cooldown_until > now)
+            {
+                m_next_cooldown_end = std::min(m_next_cooldown_end, page.cooldown_until);
+                return;
+            }
+
+            page.cooldown_until = 0;
+            m_num_cooling--;
+            f(pfn);
+        });
+    }
+
+    /// Returns the number of tracked pages.
+    ///
+    size_t
+    size() const noexcept
+    { return m_pages.size(); }
+
+private:
+
+    struct page_state {
+        uint64_t window_start = 0;      // TSC value at the start of the current window.
+        uint64_t exits = 0;             // Exits in the current window.
+        uint64_t prev_exits = 0;        // Exits in the previous window.
+        uint64_t last_rip = 0;          // Last instruction that faulted on the page.
+        uint64_t repeats = 0;           // How often in a row it did.
+        uint64_t cooldown_until = 0;    // End of the cooldown (0 if there is none).
+    };
+
+    /// Returns the state of <pfn>, creating it if needed. Pages of splits
+    /// that are gone stay behind, so every time the map doubled, the ones
+    /// that have been quiet for two windows are dropped.
+    ///
+    page_state &
+    lookup(const uint64_t pfn, const uint64_t now)
+    {
+        const auto &&existing = m_pages.find(pfn);
+        if (existing != nullptr)
+            return *existing;
+
+        if (m_pages.size() >= m_prune_at)
+        {
+            std::vector<uint64_t> quiet;
+            m_pages.for_each([&](uint64_t key, const page_state &page)
+            {
+                if (page.cooldown_until == 0 && now - page.window_start >= (2ULL << m_window_shift))
+                    quiet.push_back(key);
+            });
+
+            for (const auto &key : quiet)
+                m_pages.erase(key);
+
+            m_prune_at = std::max(static_cast<size_t>(min_prune_at), m_pages.size() * 2);
+        }
+
+        auto &&page = m_pages[pfn];
+        page.window_start = now;
+        return page;
+    }
+
+    static constexpr const size_t min_prune_at = 64;
+
+    uint64_t m_window_shift;
+    uint64_t m_max_exits;
+    uint64_t m_max_repeats;
+
+    flat_map<page_state> m_pages;
+    size_t m_prune_at = min_prune_at;
+
+    size_t m_num_cooling = 0;
+    uint64_t m_next_cooldown_end = std::numeric_limits<uint64_t>::max();
+};
+
+#endif
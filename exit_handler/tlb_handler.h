@@ -6,6 +6,8 @@
 #include <vmcs/ept_entry_intel_x64.h>
 #include <vmcs/vmcs_intel_x64_eapis.h>
 #include <vmcs/vmcs_intel_x64_16bit_control_fields.h>
+#include <vmcs/vmcs_intel_x64_32bit_control_fields.h>
+#include <vmcs/vmcs_intel_x64_32bit_guest_state_fields.h>
 #include <vmcs/vmcs_intel_x64_32bit_read_only_data_fields.h>
 #include <vmcs/vmcs_intel_x64_64bit_guest_state_fields.h>
 #include <vmcs/vmcs_intel_x64_64bit_read_only_data_fields.h>
@@ -13,6 +15,20 @@
 #include <vmcs/vmcs_intel_x64_natural_width_read_only_data_fields.h>
 #include <exit_handler/exit_handler_intel_x64_eapis.h>
 #include <serial/serial_port_intel_x64.h>
+#include <exit_handler/flat_map.h>
+#include <exit_handler/rcu_map.h>
+#include <exit_handler/flip_log.h>
+#include <exit_handler/flip_wire.h>
+#include <exit_handler/flip_ring.h>
+#include <exit_handler/code_page_pool.h>
+#include <exit_handler/code_page_cache.h>
+#include <exit_handler/load_emulator.h>
+#include <exit_handler/guest_page_walker.h>
+#include <exit_handler/split_snapshot.h>
+#include <exit_handler/thrash_tracker.h>
+#include <exit_handler/exit_stats.h>
+#include <exit_handler/event_log.h>
+#include <exit_handler/tsc.h>
 
 #include <limits.h>
 #include <algorithm>
@@ -21,9 +37,10 @@
 #include <sstream>
 #include <iomanip>
 #include <vector>
-#include <map>
 #include <mutex>
+#include <atomic>
 #include <bitset>
+#include <limits>
 
 using namespace intel_x64;
 
@@ -61,49 +78,96 @@ std::string hex_out_s(T val, int width = (sizeof(T) * CHAR_BIT / detail::HEX_DIG
     return ss.str();
 }
 
+// Address spaces (cr3 bases) a split is enabled in
+using cr3_list = std::vector<uint64_t>;
+
 /// Context structure for TLB splits
 ///
+/// The exit path reads split contexts without locking (see g_splits), so
+/// the fields it reads are either set before the split is published, or
+/// atomic, or replaced as a whole (see rcu_ptr).
+///
 struct split_context {
-    std::unique_ptr<uint8_t[]> c_page = nullptr; // This is the owner of the code page memory.
+    code_page_ref c_page; // Reference to the (possibly shared) code page (see g_code_page_cache).
 
-    int_t c_va = 0; // This is the (host) virtual address of the code page.
-    int_t c_pa = 0; // This is the (host) physical of the code page.
+    std::atomic<int_t> c_va{0}; // This is the (host) virtual address of the code page.
+    std::atomic<int_t> c_pa{0}; // This is the (host) physical of the code page.
 
     int_t d_va = 0; // This is the (guest) virtual address of the data page.
     int_t d_pa = 0; // This is the (guest) physical address of the data page.
 
-    int_t gva = 0;          // The (guest) physical address this split was requested for. (Only first request.)
-    size_t num_hooks = 0;   // This holds the number of hooks for this split context.
-    uint64_t cr3 = 0;       // This is the cr3 value of the process which requested the split.
-    bool active = false;    // This defines whether this split is active or not.
+    int_t gva = 0;                      // The (guest) physical address this split was requested for. (Only first request.)
+    size_t num_hooks = 0;               // This holds the number of hooks for this split context.
+    uint64_t cr3 = 0;                   // This is the cr3 value of the process which requested the split.
+    std::atomic<bool> active{false};    // This defines whether this split is active or not.
+
+    rcu_ptr<cr3_list> cr3s;     // The address spaces (cr3 bases) this split is enabled in.
+    bool global = false;        // Splits of kernel addresses are enabled in every address space.
+
+    // VMM mapping of the data page (see emulate_read()), created on first
+    // use by whichever vCPU gets there first.
+    std::atomic<bfn::unique_map_ptr_x64<uint8_t> *> d_map{nullptr};
+
+    split_context() = default;
+
+    ~split_context()
+    { delete d_map.load(); }
+
+    split_context(const split_context &) = delete;
+    split_context &operator=(const split_context &) = delete;
+};
+
+/// Context structure for 2m pages that got remapped to 4k pages
+///
+/// A 2m range is remapped to 4k pages when it gets its first split and
+/// re-promoted to a single 2m page once it has been without splits for
+/// <delay> TSC ticks. A range that gets split again shortly after it was
+/// re-promoted doubles its delay (up to coalesce_max_delay), so ranges that
+/// are hooked and unhooked over and over stop churning.
+///
+struct page_2m_context {
+    size_t num_splits = 0;      // Number of splits in this 2m range.
+    bool remapped = false;      // True while the range is mapped with 4k pages.
+    uint64_t idle_since = 0;    // TSC value when num_splits dropped to 0.
+    uint64_t coalesced_at = 0;  // TSC value when the range was last re-promoted.
+    uint64_t delay = 0;         // Current re-promotion delay (TSC ticks).
+};
+
+/// Split operation (this layout is shared with the guest)
+///
+/// One entry of the array passed to batch_split_ops(). <method> and
+/// <args> are the same as for a single VMCALL (r02 and r03-r05), and
+/// <status> receives what that VMCALL would have returned in r02.
+///
+struct split_op {
+    int_t method = 0;
+    int_t args[3] = {0, 0, 0};
+    int_t status = 0;
 };
 
-struct flip_data {
-    int_t rip = 0;
-    int_t gva = 0;
-    int_t orig_gva = 0;
-    int_t gpa = 0;
-    int_t d_pa = 0;
-    int_t cr3 = 0;
-    int_t bits = 0;
-    int_t counter = 0;
-
-    flip_data() = default;
-    flip_data(int_t _rip, int_t _gva, int_t _orig_gva, int_t _gpa, int_t _d_pa, int_t _cr3, int_t _bits, int_t _counter)
-    {
-        rip = _rip;
-        gva = _gva;
-        orig_gva = _orig_gva;
-        gpa = _gpa;
-        d_pa = _d_pa;
-        cr3 = _cr3;
-        bits = _bits;
-        counter = _counter;
-    }
-
-    ~flip_data() = default;
+// Maximum number of operations per batch_split_ops() call
+constexpr const auto max_split_ops = 4096UL;
+
+// Maximum size of the range passed to create_split_range() (64m)
+constexpr const auto max_split_range = 0x4000000UL;
+
+/// Patch record (this layout is shared with the guest)
+///
+/// The buffer passed to apply_patches() is a sequence of records: each
+/// header is followed by the <size> bytes to write to <to_va>, padded to a
+/// multiple of 8 bytes.
+///
+struct patch_header {
+    int_t to_va = 0;
+    int_t size = 0;
 };
 
+// Maximum size of the buffer passed to apply_patches()
+constexpr const auto max_patch_buffer = 0x10000UL;
+
+// Maximum size of the snapshot passed to import_splits() (16m)
+constexpr const auto max_split_snapshot = 0x1000000UL;
+
 namespace access_t
 {
     constexpr const auto read = 0;
@@ -121,28 +185,275 @@ enum flip_access_t
 };
 
 // EPTs
-extern std::unique_ptr<root_ept_intel_x64> g_root_ept;
 extern std::unique_ptr<root_ept_intel_x64> g_clean_ept;
 
-// Global maps for splits and 2m pages
-using split_map_t   = std::map<int_t  /*d_pa*/,         std::unique_ptr<split_context>>;
-using page_map_t    = std::map<int_t /*aligned_2m_pa*/, size_t /*num_splits*/>;
-split_map_t g_splits;
+/// EPT view of a vCPU
+///
+/// Every vCPU runs on its own copy of the split EPT. Structural changes
+/// (remapping 2m ranges, activating and deactivating splits) are applied to
+/// all views, while the flips done on an EPT violation only touch the view
+/// of the faulting vCPU. A view changed by another vCPU is marked <stale>
+/// and its owner flushes it on its next exit.
+///
+/// Re-promoting a 2m range frees its 4k tables, which the vCPU might still
+/// walk until it flushes. So other vCPUs only queue the range in <coalesce>
+/// (with g_views_mutex held), and the owner re-promotes it right before
+/// its flush (see coalesce_view()).
+///
+struct ept_view {
+    std::unique_ptr<root_ept_intel_x64> ept;
+    std::atomic<bool> stale{false};
+
+    std::vector<uint64_t> coalesce;             // 2m pfns to re-promote.
+    std::atomic<bool> coalesce_pending{false};
+};
+
+// Pool for the code pages of the splits, and the cache that shares pages
+// with identical contents between splits. Defined before g_splits, since
+// the splits give their pages back when they are destroyed.
+code_page_pool g_code_pages;
+code_page_cache g_code_page_cache(g_code_pages);
+
+// Grace periods for the data the exit path reads without locking. Every
+// tlb_handler is a reader (see handle_exit()), and what writers unlink is
+// reclaimed at the end of a VMCALL (see handle_vmcall_registers()).
+// Defined before everything that retires objects to it.
+rcu_domain g_rcu;
+
+// Global maps for splits and 2m pages, keyed by page frame number. The
+// exit path looks splits up without locking (see rcu_map). Split contexts
+// don't move while they're in the map, and erased ones are only freed
+// after every vCPU that might still use them has resumed the guest, and
+// has flushed its TLB (they own code pages, see flush_ept()).
+// 2m page contexts are stored inline and move when the map grows, so
+// they're only ever accessed with g_mutex held.
+using split_map_t   = rcu_map<split_context /*by 4k pfn of d_pa*/>;
+using page_map_t    = flat_map<page_2m_context /*by 2m pfn*/>;
+split_map_t g_splits(g_rcu, true);
 page_map_t g_2m_pages;
 
-// Vector holding all the registered flip data
-std::vector<flip_data> g_flip_log;
+// Remapped 2m pages (pfns) which lost their last split and might be
+// re-promoted (see coalesce_idle_pages()), and the TSC value when the
+// first of them is due, so VMCALLs only take g_mutex when one is.
+std::vector<uint64_t> g_2m_idle_pages;
+std::atomic<uint64_t> g_2m_idle_due{std::numeric_limits<uint64_t>::max()};
+
+/// Adds the 2m page <pfn> to the idle list (with g_mutex held)
+///
+inline void
+mark_2m_idle(const uint64_t pfn, page_2m_context &page, const uint64_t now)
+{
+    page.idle_since = now;
+    g_2m_idle_pages.push_back(pfn);
+
+    if (now + page.delay < g_2m_idle_due.load(std::memory_order_relaxed))
+        g_2m_idle_due.store(now + page.delay, std::memory_order_relaxed);
+}
+
+// Splits (pfns) that are only enabled in some address spaces. While there
+// are any, the vCPUs exit on CR3 loads (see apply_cr3_splits()). The exit
+// path walks the set without locking, like it looks up g_splits.
+using pfn_set_t = rcu_map<bool /*unused, by 4k pfn*/>;
+pfn_set_t g_cr3_splits(g_rcu);
+std::atomic<size_t> g_num_cr3_splits{0};
+
+// Splits (pfns) the thrash policy wants deactivated. The exit path can't
+// do it (see deactivate_thrashing_splits()).
+std::vector<uint64_t> g_thrash_splits;
+std::atomic<size_t> g_num_thrash_splits{0};
+
+/// Returns the address space of <cr3>
+///
+/// Drops the PCID and no-flush bits, and bit 12: with page table isolation
+/// (Linux PTI) a process has an 8k aligned pair of PML4s, and runs user
+/// code under the upper one (kernel cr3 | 0x1000), so both have to name
+/// the same address space. Two unrelated PML4s that happen to make up
+/// such a pair share their (non-global) splits.
+///
+inline uint64_t
+cr3_base(const uint64_t cr3) noexcept
+{ return cr3 & 0x000FFFFFFFFFE000ULL; }
+
+/// Returns true if <split> is enabled in the address space of <cr3>
+///
+inline bool
+split_applies_to(const split_context &split, const uint64_t cr3)
+{
+    if (split.global)
+        return true;
+
+    const auto &&cr3s = split.cr3s.get();
+    return cr3s != nullptr && std::find(cr3s->begin(), cr3s->end(), cr3_base(cr3)) != cr3s->end();
+}
+
+/// Enables <split> in the address space of <cr3> too (with g_mutex held)
+///
+inline void
+enable_split_in(split_context &split, const uint64_t cr3)
+{
+    const auto &&cr3s = split.cr3s.get();
+    auto &&next = cr3s != nullptr ? std::make_unique<cr3_list>(*cr3s) : std::make_unique<cr3_list>();
+    next->push_back(cr3_base(cr3));
+
+    split.cr3s.publish(std::move(next), g_rcu);
+}
+
+inline uint64_t
+pfn_4k(const int_t pa) noexcept
+{ return pa >> 12; }
+
+inline uint64_t
+pfn_2m(const int_t pa) noexcept
+{ return pa >> 21; }
+
+// Per-vCPU flip logs (one per tlb_handler) and the merged snapshot which
+// is handed out to the guest
+std::vector<flip_log *> g_flip_logs;
+std::vector<flip_data> g_flip_snapshot;
+bool g_flip_snapshot_valid = false;
+std::vector<uint8_t> g_flip_packed;
+
+// Ring that flip events are streamed into for the guest monitor (see
+// register_flip_ring())
+flip_ring g_flip_ring;
+
+// Per-vCPU exit statistics (one per tlb_handler), see get_exit_stats()
+std::vector<std::pair<vcpuid::type, const exit_stats *>> g_exit_stats;
+
+// Per-vCPU debug event logs (one per tlb_handler), see read_event_log()
+std::vector<event_log *> g_event_logs;
+
+// EPT views, indexed by vcpuid (see get_ept_view())
+std::vector<std::unique_ptr<ept_view>> g_ept_views;
 
 // Mutexes
 static std::mutex g_mutex;
 static std::mutex g_flip_mutex;
+static std::mutex g_views_mutex; // Lock order: g_mutex -> g_views_mutex
+static std::mutex g_stats_mutex;
+static std::mutex g_event_mutex;
+static std::mutex g_thrash_mutex;
+
+// Re-promotion delays for idle 2m ranges (TSC ticks, roughly 0.5s to 45s)
+constexpr const uint64_t coalesce_min_delay = 1ULL << 30;
+constexpr const uint64_t coalesce_max_delay = 1ULL << 37;
+
+/// Flip the EPT entry of <d_pa> in <ept> to <phys_addr> with the access
+/// bits of <flip_access>
+///
+inline void
+flip_epte(root_ept_intel_x64 &ept, const int_t phys_addr, const int_t d_pa, const flip_access_t flip_access)
+{
+    auto *m_epte = ept.gpa_to_epte(d_pa).epte();
+
+    switch (flip_access) {
+        case flip_access_t::read:
+        { *m_epte = set_bits(*m_epte, 0xFFFFFFFFF007UL, phys_addr | 0x1UL); break; }
+        case flip_access_t::write:
+        { *m_epte = set_bits(*m_epte, 0xFFFFFFFFF007UL, phys_addr | 0x2UL); break; }
+        case flip_access_t::readwrite:
+        { *m_epte = set_bits(*m_epte, 0xFFFFFFFFF007UL, phys_addr | 0x3UL); break; }
+        case flip_access_t::exec:
+        { *m_epte = set_bits(*m_epte, 0xFFFFFFFFF007UL, phys_addr | 0x4UL); break; }
+        case flip_access_t::all:
+        { *m_epte = set_bits(*m_epte, 0xFFFFFFFFF007UL, phys_addr | 0x7UL); break; }
+    }
+}
+
+/// Maps the 2m range at <aligned_2m_pa> in <root_ept> with a single 2m
+/// page again, which frees its 4k tables
+///
+inline void
+remap_2m(root_ept_intel_x64 &root_ept, const int_t aligned_2m_pa)
+{
+    root_ept.unmap_identity_map_4k(aligned_2m_pa, aligned_2m_pa + ept::pd::size_bytes);
+    root_ept.map_2m(aligned_2m_pa, aligned_2m_pa, ept::memory_attr::pt_wb);
+}
 
-// Macros for easier access
-#define CONTEXT(_d_pa) g_splits[_d_pa]
-#define IT(_split_it) _split_it->second
+/// Calls f(view) for every EPT view
+///
+template<typename F>
+void
+for_each_ept_view(F f)
+{
+    std::lock_guard<std::mutex> views_guard(g_views_mutex);
+
+    for (const auto &view : g_ept_views)
+    {
+        if (view)
+            f(*view);
+    }
+}
+
+/// Returns the EPT view of a vCPU
+///
+/// A new view starts out as a 2m identity map, and then gets every
+/// remapped 2m range and every active split of the existing views, so
+/// vCPUs that come up late see the same splits as the others.
+///
+/// @param vcpuid the id of the vCPU
+///
+/// @return the vCPU's EPT view
+///
+inline ept_view &
+get_ept_view_context(const vcpuid::type vcpuid)
+{
+    std::lock_guard<std::mutex> guard(g_mutex);
+    std::lock_guard<std::mutex> views_guard(g_views_mutex);
+
+    if (vcpuid >= g_ept_views.size())
+        g_ept_views.resize(vcpuid + 1);
+
+    auto &&view = g_ept_views[vcpuid];
+    if (view)
+        return *view;
+
+    view = std::make_unique<ept_view>();
+    view->ept = std::make_unique<root_ept_intel_x64>();
+    view->ept->setup_identity_map_2m(0, MAX_PHYS_ADDR);
+
+    g_2m_pages.for_each([&](uint64_t pfn, const page_2m_context &page)
+    {
+        if (!page.remapped)
+            return;
+
+        const auto &&aligned_2m_pa = pfn << 21;
+        view->ept->unmap(aligned_2m_pa);
+        view->ept->setup_identity_map_4k(aligned_2m_pa, aligned_2m_pa + ept::pd::size_bytes);
+    });
+
+    g_splits.for_each([&](uint64_t, const split_context &split)
+    {
+        if (split.active)
+            flip_epte(*view->ept, split.c_pa, split.d_pa, flip_access_t::exec);
+    });
+
+    return *view;
+}
+
+root_ept_intel_x64 &
+get_ept_view(vcpuid::type vcpuid)
+{ return *get_ept_view_context(vcpuid).ept; }
+
+// Flip sites kept per vCPU: 0 keeps all of them, otherwise the flip log is
+// a Space-Saving summary of that many of the busiest ones (see flip_log)
+constexpr const size_t flip_log_top_k = 0;
+
+// Thrash policy (see thrash_tracker). A split page may cause up to
+// thrash_max_exits exits on a vCPU per window of 2^thrash_window_shift TSC
+// ticks (roughly 5ms) before thrash_policy is applied to it. A livelocked
+// instruction is always single-stepped.
+constexpr const auto thrash_policy = thrash_single_step;
+constexpr const uint64_t thrash_window_shift = 24;
+constexpr const uint64_t thrash_max_exits = 512;
+constexpr const uint64_t thrash_max_repeats = 3;
+constexpr const uint64_t thrash_single_steps = 16;      // thrash_single_step: instructions to single-step
+constexpr const uint64_t thrash_cooldown = 1ULL << 28;  // thrash_data_view: TSC ticks (roughly 90ms)
 
 // Debug/Logging switches
 constexpr const auto flip_logging_disabled = false;
+constexpr const auto read_emulation_disabled = false;
+constexpr const auto exit_stats_disabled = false;
 constexpr const auto flip_debug_disabled = true;
 constexpr const auto debug_disabled = false;
 #define _bfdebug            \
@@ -152,23 +463,93 @@ constexpr const auto debug_disabled = false;
 class tlb_handler : public exit_handler_intel_x64_eapis
 {
 private:
-    int_t prev_rip, rip_count;
+
+    // Exits caused by each split page on this vCPU, and the number of
+    // instructions left to single-step
+    thrash_tracker m_thrash;
+    uint64_t m_single_steps;
+
+    // Flips registered on this vCPU. Only this vCPU records into it.
+    flip_log m_flip_log;
+
+    // EPT view of this vCPU
+    ept_view *m_view;
+
+    // Deferred EPT invalidation (see ept_flush_batch)
+    size_t m_flush_depth;
+    bool m_flush_pending;
+
+    // Flip events of this vCPU are pushed through this (see g_flip_ring)
+    flip_ring::producer m_flip_producer;
+
+    // True while CR3-load exiting is enabled on this vCPU
+    bool m_cr3_exiting;
+
+    // Exit counters and latencies of this vCPU, and the TSC value at the
+    // start of the current exit
+    exit_stats m_exit_stats;
+    uint64_t m_exit_tsc;
+
+    // Debug events of this vCPU, formatted when they are read
+    event_log m_event_log;
+
+    // Read-side sections of this vCPU (see g_rcu)
+    rcu_domain::reader m_reader;
 
 public:
 
-    /// Default Constructor
+    /// Constructor
     ///
-    tlb_handler ()
-        : prev_rip(0)
-        , rip_count(0)
+    /// @param vcpuid the id of the vCPU this handler belongs to
+    ///
+    explicit tlb_handler (vcpuid::type vcpuid)
+        : m_thrash(thrash_window_shift, thrash_max_exits, thrash_max_repeats)
+        , m_single_steps(0)
+        , m_flip_log(flip_log_top_k)
+        , m_view(&get_ept_view_context(vcpuid))
+        , m_flush_depth(0)
+        , m_flush_pending(false)
+        , m_flip_producer(g_flip_ring)
+        , m_cr3_exiting(false)
+        , m_exit_tsc(0)
+        , m_event_log(static_cast<uint32_t>(vcpuid))
+        , m_reader(g_rcu)
     {
-        _bfdebug << "tlb_handler instance initialized" << bfendl;
+        {
+            std::lock_guard<std::mutex> stats_guard(g_stats_mutex);
+            g_exit_stats.emplace_back(vcpuid, &m_exit_stats);
+        }
+
+        {
+            std::lock_guard<std::mutex> event_guard(g_event_mutex);
+            g_event_logs.push_back(&m_event_log);
+        }
+
+        std::lock_guard<std::mutex> flip_guard(g_flip_mutex);
+        g_flip_logs.push_back(&m_flip_log);
+
+        log_debug(log_handler_initialized);
     }
 
     /// Destructor
     ///
     ~tlb_handler() override
-    { }
+    {
+        {
+            std::lock_guard<std::mutex> stats_guard(g_stats_mutex);
+            g_exit_stats.erase(std::remove_if(g_exit_stats.begin(), g_exit_stats.end(), [this](const auto &entry)
+            { return entry.second == &m_exit_stats; }), g_exit_stats.end());
+        }
+
+        {
+            std::lock_guard<std::mutex> event_guard(g_event_mutex);
+            g_event_logs.erase(std::remove(g_event_logs.begin(), g_event_logs.end(), &m_event_log), g_event_logs.end());
+        }
+
+        std::lock_guard<std::mutex> flip_guard(g_flip_mutex);
+        g_flip_logs.erase(std::remove(g_flip_logs.begin(), g_flip_logs.end(), &m_flip_log), g_flip_logs.end());
+        g_flip_snapshot_valid = false;
+    }
 
     /// Monitor Trap Callback
     ///
@@ -180,10 +561,22 @@ public:
     void
     monitor_trap_callback()
     {
-        _bfdebug << "Resetting the trap" << bfendl;
+        record_exit(exit_monitor_trap);
+
+        // Keep stepping through the clean EPT, if more steps were asked for.
+        if (m_single_steps > 1)
+        {
+            m_single_steps--;
+            this->register_monitor_trap(&tlb_handler::monitor_trap_callback);
+        }
+        else
+        {
+            log_debug(log_trap_reset);
 
-        // Reset the trap.
-        m_vmcs_eapis->set_eptp(g_root_ept->eptp());
+            // Reset the trap.
+            m_single_steps = 0;
+            m_vmcs_eapis->set_eptp(m_view->ept->eptp());
+        }
 
         // Resume the VM
         this->resume();
@@ -191,23 +584,59 @@ public:
 
     /// Flip page (set physical address) and set respective access bits
     ///
+    /// Only changes the EPT view of this vCPU.
+    ///
     void
     flip_page(const int_t &phys_addr, const int_t &d_pa, const flip_access_t flip_access)
+    { flip_epte(*m_view->ept, phys_addr, d_pa, flip_access); }
+
+    /// Flip page in the EPT views of all vCPUs
+    ///
+    void
+    flip_page_all(const int_t &phys_addr, const int_t &d_pa, const flip_access_t flip_access)
+    {
+        for_each_ept_view([&](ept_view &view)
+        { flip_epte(*view.ept, phys_addr, d_pa, flip_access); });
+    }
+
+    /// Flip the page of <split> to its code page (in our view only)
+    ///
+    /// A split can be deactivated or get a new code page on another vCPU
+    /// meanwhile, and its old code page is freed once this exit is over.
+    /// So after the entry is written, the split is looked up again, and
+    /// if it's gone, inactive or on a different code page by now, the
+    /// entry is written again (with the identity mapping, or the new code
+    /// page). The other side changes the split before it updates the
+    /// views, and both sides fence in between, so either this sees the
+    /// change, or the other side overwrites our entry.
+    ///
+    void
+    flip_to_code_page(split_context *split, const int_t d_pa)
     {
-        //std::lock_guard<std::mutex> guard(g_mutex);
-        auto *m_epte = g_root_ept->gpa_to_epte(d_pa).epte();
+        while (true)
+        {
+            const int_t c_pa = split->c_pa;
+            flip_page(c_pa, d_pa, flip_access_t::exec);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+
+            auto &&current = g_splits.find(pfn_4k(d_pa));
+            if (current != nullptr && current->active)
+            {
+                if (current == split && current->c_pa == c_pa)
+                    return;
+            }
+            else
+            {
+                flip_page(d_pa, d_pa, flip_access_t::all);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
 
-        switch (flip_access) {
-            case flip_access_t::read:
-            { *m_epte = set_bits(*m_epte, 0xFFFFFFFFF007UL, phys_addr | 0x1UL); break; }
-            case flip_access_t::write:
-            { *m_epte = set_bits(*m_epte, 0xFFFFFFFFF007UL, phys_addr | 0x2UL); break; }
-            case flip_access_t::readwrite:
-            { *m_epte = set_bits(*m_epte, 0xFFFFFFFFF007UL, phys_addr | 0x3UL); break; }
-            case flip_access_t::exec:
-            { *m_epte = set_bits(*m_epte, 0xFFFFFFFFF007UL, phys_addr | 0x4UL); break; }
-            case flip_access_t::all:
-            { *m_epte = set_bits(*m_epte, 0xFFFFFFFFF007UL, phys_addr | 0x7UL); break; }
+                // The page may have been split (and activated) again.
+                current = g_splits.find(pfn_4k(d_pa));
+                if (current == nullptr || !current->active)
+                    return;
+            }
+
+            split = current;
         }
     }
 
@@ -215,6 +644,43 @@ public:
     ///
     void handle_exit(intel_x64::vmcs::value_type reason) override
     {
+        if (exit_stats_disabled) {}
+        else
+            m_exit_tsc = read_tsc();
+
+        // Split contexts we look up stay valid until we leave again, which
+        // has to happen before every resume (it doesn't return).
+        m_reader.enter();
+
+        // Catch up on changes another vCPU made to our EPT view, and on
+        // splits that got tied to (or freed from) address spaces. An EPT
+        // violation invalidates the faulting translation by itself, so
+        // this waits for the next exit of any other kind. Until then, the
+        // code pages we might have cached aren't reused (see flush_ept()).
+        if (reason != vmcs::exit_reason::basic_exit_reason::ept_violation)
+        {
+            if (m_view->stale.exchange(false))
+            {
+                const auto &&epoch = g_rcu.epoch();
+                if (m_view->coalesce_pending.load())
+                    coalesce_view();
+
+                vmx::invept_single_context(m_view->ept->eptp());
+                m_reader.flushed(epoch);
+            }
+
+            sync_cr3_exiting();
+            end_thrash_cooldowns();
+        }
+
+        // Check for CR3 load
+        if (reason == vmcs::exit_reason::basic_exit_reason::control_register_accesses && handle_mov_to_cr3())
+        {
+            // Resume the VM
+            m_reader.leave();
+            this->resume();
+        }
+
         // Check for EPT violation
         if (reason == vmcs::exit_reason::basic_exit_reason::ept_violation)
         {
@@ -237,150 +703,167 @@ public:
             // access_bits == (hex) 0x2 -> WRITE    -> (bin) 010
             // access_bits == (hex) 0x4 -> READ     -> (bin) 100
             //
-            const auto &&access_bits = get_bits(vmcs::exit_qualification::ept_violation::get(), 0x7UL);
+            const auto &&qualification = vmcs::exit_qualification::ept_violation::get();
+            const auto &&access_bits = get_bits(qualification, 0x7UL);
             //bfdebug << "violation access bits: " << hex_out_s(access_bits, 3) << bfendl;
 
-            // Search for relevant entry in <map> m_splits.
-            const auto &&split_it = g_splits.find(d_pa);
-            if (split_it == g_splits.end())
+            // What kind of exit this was (see exit_stats)
+            auto kind = exit_unexpected;
+            auto thrashing = false;
+
+            // Search for relevant entry in g_splits.
+            const auto &&split = g_splits.find(pfn_4k(d_pa));
+            if (split == nullptr)
             {
                 // Unexpected EPT violation for this page.
                 // Try to reset the access flags to pass-through.
                 // (I don't get why they wouldn't be in the first place.)
 
-                bfinfo << bfcolor_error << "UNX_V" << bfcolor_end << ": gva: " << hex_out_s(gva)
-                  << " gpa: " << hex_out_s(gpa)
-                  << " d_pa: " << hex_out_s(d_pa)
-                  << " cr3: " << hex_out_s(cr3, 8)
-                  << " bits: " << std::bitset<3>(access_bits)
-                  << bfendl;
+                m_event_log.record(log_unexpected_violation, read_tsc(), gva, gpa, d_pa, cr3, access_bits);
 
-                auto &&entry = g_root_ept->gpa_to_epte(d_pa);
-                flip_page(entry.phys_addr(), d_pa, flip_access_t::all);
+                flip_page(d_pa, d_pa, flip_access_t::all);
+            }
+            else if (!split_applies_to(*split, cr3))
+            {
+                // This address space doesn't use the split. Give it the data
+                // page (in our view only) until we switch to an address
+                // space that does (see apply_cr3_splits()).
+                flip_page(split->d_pa, d_pa, flip_access_t::all);
+                kind = exit_split_foreign;
             }
             else
             {
                 if (flip_logging_disabled) {}
                 else
                 {
-                    // Check for known RIPs.
-                    auto &&flip_it = std::find_if(g_flip_log.begin(), g_flip_log.end(), [&rip, &access_bits](const flip_data & m) -> bool
-                    {
-                        return (m.rip == rip && m.bits == access_bits);
-                    });
+                    // Count the flip for its (rip, bits) pair. The log
+                    // belongs to this vCPU, so there is nothing to lock.
+                    m_flip_log.record(rip, gva, split->gva, gpa, d_pa, cr3, access_bits);
 
-                    if (flip_it != g_flip_log.end())
-                    {
-                        // Increase counter and update addresses.
-                        std::lock_guard<std::mutex> flip_guard(g_flip_mutex);
-                        flip_it->counter++;
-                        flip_it->gva = gva;
-                        flip_it->gpa = gpa;
-                        flip_it->d_pa = d_pa;
-                    }
-                    else
+                    // Stream the event to the guest monitor, if it asked for it.
+                    if (g_flip_ring.attached())
                     {
-                        // Add violation data to the flip log.
-                        std::lock_guard<std::mutex> flip_guard(g_flip_mutex);
-                        g_flip_log.emplace_back(rip, gva, IT(split_it)->gva, gpa, d_pa, cr3, access_bits, 1);
+                        flip_event event;
+                        event.rip = rip;
+                        event.gva = gva;
+                        event.orig_gva = split->gva;
+                        event.gpa = gpa;
+                        event.cr3 = cr3;
+                        event.tsc = read_tsc();
+                        event.bits = static_cast<uint32_t>(access_bits);
+                        event.vcpuid = static_cast<uint32_t>(vcpuid);
+                        m_flip_producer.push(event);
                     }
                 }
 
                 // Log entry
-                ///* This seems to cause thrashing
                 if (flip_debug_disabled) {}
                 else
+                    m_event_log.record(log_flip, read_tsc(), access_bits, cr3, rip, gva);
+
+                // Reads (e.g. of constants or jump tables next to the hooked
+                // code) are completed from the data page if we can decode
+                // the instruction. The page stays on the code page, so
+                // there's no flip back and nothing that could thrash. Only
+                // reads of the page itself qualify: the guest linear address
+                // has to be valid (bit 7) and the access must not be one of
+                // the guest's page walks (bit 8).
+                const auto &&emulated = !read_emulation_disabled &&
+                                        is_bit_set(qualification, 7) &&
+                                        is_bit_set(qualification, 8) &&
+                                        is_bit_set(access_bits, access_t::read) &&
+                                        !is_bit_set(access_bits, access_t::write) &&
+                                        emulate_read(*split, gva, cr3);
+
+                // Check for TLB thrashing (see thrash_tracker). Pages that
+                // are taken off the code page don't get flipped below.
+                const auto &&now = exit_stats_disabled ? read_tsc() : m_exit_tsc;
+                const auto &&verdict = m_thrash.record(pfn_4k(d_pa), rip, emulated, now);
+                auto parked = false;
+
+                if (verdict == thrash_livelock || (verdict == thrash_hot && thrash_policy == thrash_single_step))
                 {
-                    bfinfo
-                      << bfcolor_func << "["
-                      << std::bitset<3>(access_bits)
-                      << "]:"  << bfcolor_end
-                      << " cr3: " << hex_out_s(cr3, 8)
-                      << " rip: " << hex_out_s(rip)
-                      << " gva: " << hex_out_s(gva)
-                      //<< " gpa: " << hex_out_s(gpa)
-                      //<< " d_pa: " << hex_out_s(d_pa)
-                      //<< " bits: " << std::bitset<3>(access_bits)
-                      << " vcpuid: " << vcpuid
-                      << bfendl;
-                }
-                //*/
-
-                // Compare the previous violation RIP to the current one and
-                // increase the counter, if they are the same.
-                // Else, just assign the current RIP to prev_rip and reset the
-                // counter.
-                if (rip == prev_rip)
-                    rip_count++;
-                else {
-                    prev_rip = rip;
-                    rip_count = 0;
-                }
-
-                // Check for TLB thrashing
-                if (rip_count > 3)
-                {
-                    _bfdebug << bfcolor_error << "[" << vcpuid << "] " << bfcolor_end << "Thrashing detected at rip: " << hex_out_s(prev_rip) << bfendl;
-
-                    // Reset prev_rip and rip_count
-                    prev_rip = 0;
-                    rip_count = 0;
+                    log_debug(log_thrashing, rip);
 
                     // Single-step through the clean EPT
+                    m_single_steps = verdict == thrash_livelock ? 1 : thrash_single_steps;
                     m_vmcs_eapis->set_eptp(g_clean_ept->eptp());
                     this->register_monitor_trap(&tlb_handler::monitor_trap_callback);
-                    //this->resume();
-                }
 
-                // Check exit qualifications
-                if (is_bit_set(access_bits, access_t::write))
+                    thrashing = true;
+                }
+                else if (verdict == thrash_hot)
                 {
-                    if (IT(split_it)->cr3 != cr3)
+                    // Give the page the data page (in our view only), which
+                    // ends its exits here.
+                    flip_page(split->d_pa, d_pa, flip_access_t::all);
+
+                    if (thrash_policy == thrash_data_view)
                     {
-                        // WRITE violation. Deactivate split and flip to data page.
-                        //
-                        bfwarning << "[" << vcpuid << "] " << "handle_exit: deactivating page because of write violation from different cr3: " << hex_out_s(cr3, 8) << bfendl;
-                        deactivate_split(gva);
+                        log_debug(log_thrash_cooldown, d_pa, rip);
+                        m_thrash.start_cooldown(pfn_4k(d_pa), now + thrash_cooldown);
                     }
                     else
                     {
-                        // Switch to data page.
-                        //_bfdebug << "[" << vcpuid << "] " << "handle_exit: switch to data for write: " << hex_out_s(cr3, 8) << '/' << hex_out_s(rip) << '/' << hex_out_s(gva) << bfendl;
-                        flip_page(IT(split_it)->d_pa, d_pa, flip_access_t::readwrite);
+                        m_event_log.record(log_thrash_deactivate, now, d_pa, rip);
+
+                        std::lock_guard<std::mutex> thrash_guard(g_thrash_mutex);
+                        g_thrash_splits.push_back(pfn_4k(d_pa));
+                        g_num_thrash_splits = g_thrash_splits.size();
                     }
+
+                    parked = true;
+                    thrashing = true;
+                }
+
+                // Check exit qualifications
+                if (parked) {}
+                else if (emulated)
+                {
+                    // READ violation, already completed. Nothing to flip.
+                    kind = exit_split_read_emulated;
+                }
+                else if (is_bit_set(access_bits, access_t::write))
+                {
+                    // WRITE violation. Flip to data page.
+                    //
+                    //_bfdebug << "[" << vcpuid << "] " << "handle_exit: switch to data for write: " << hex_out_s(cr3, 8) << '/' << hex_out_s(rip) << '/' << hex_out_s(gva) << bfendl;
+                    flip_page(split->d_pa, d_pa, flip_access_t::readwrite);
+                    kind = exit_split_write;
                 }
                 else if (is_bit_set(access_bits, access_t::read))
                 {
                     // READ violation. Flip to data page.
                     //
                     //_bfdebug << "[" << vcpuid << "] " << "handle_exit: switch to data for read: " << hex_out_s(cr3, 8) << '/' << hex_out_s(rip) << '/' << hex_out_s(gva) << bfendl;
-                    flip_page(IT(split_it)->d_pa, d_pa, flip_access_t::readwrite);
+                    flip_page(split->d_pa, d_pa, flip_access_t::readwrite);
+                    kind = exit_split_read;
                 }
                 else if(is_bit_set(access_bits, access_t::exec))
                 {
                     // EXEC violation. Flip to code page.
                     //
                     //_bfdebug << "[" << vcpuid << "] " << "handle_exit: switch to code for exec: " << hex_out_s(cr3, 8) << '/' << hex_out_s(rip) << '/' << hex_out_s(gva) << bfendl;
-                    flip_page(IT(split_it)->c_pa, d_pa, flip_access_t::exec);
+                    flip_to_code_page(split, d_pa);
+                    kind = exit_split_exec;
                 }
                 else
                 {
                     // This shouldn't even be possible...
                     //
 
-                    bferror << "Unexpected exit qualifications: gva: " << hex_out_s(gva)
-                      << " gpa: " << hex_out_s(gpa)
-                      << " d_pa: " << hex_out_s(d_pa)
-                      << " cr3: " << hex_out_s(cr3, 8)
-                      << " bits: " << std::bitset<3>(access_bits)
-                      << bfendl;
+                    m_event_log.record(log_unexpected_qualification, read_tsc(), gva, gpa, d_pa, cr3, access_bits);
                 }
             }
 
+            record_exit(thrashing ? exit_thrash : kind);
+
             // Resume the VM
+            m_reader.leave();
             this->resume();
         }
 
+        m_reader.leave();
         exit_handler_intel_x64_eapis::handle_exit(reason);
     }
 
@@ -405,6 +888,17 @@ public:
         /// 8 = get_flip_data(int_t out_addr, int_t out_size)
         /// 9 = clear_flip_data()
         /// 10 = remove_flip_entry(int_t rip)
+        /// 11 = batch_split_ops(int_t ops_addr, size_t num_ops)
+        /// 12 = register_flip_ring(size_t capacity)
+        /// 13 = unregister_flip_ring()
+        /// 14 = get_exit_stats(int_t out_addr, int_t out_size)
+        /// 15 = read_event_log(int_t out_addr, int_t out_size)
+        /// 16 = get_flip_data_packed(int_t out_addr, int_t out_size)
+        /// 17 = create_split_range(int_t gva, size_t size)
+        /// 18 = apply_patches(int_t patches_addr, size_t patches_size)
+        /// 19 = export_splits(int_t out_addr, int_t out_size)
+        /// 20 = import_splits(int_t in_addr, size_t in_size)
+        /// 21 = read_flip_ring(int_t out_addr, int_t out_size)
         ///
         /// <r03+> for args
         ///
@@ -413,6 +907,9 @@ public:
         const auto _switch = regs.r02;
         regs.r02 = 0;
 
+        // Other vCPUs may erase the splits we use in the meantime.
+        m_reader.enter();
+
         switch (_switch)
         {
             case 0: // hv_present()
@@ -437,8 +934,14 @@ public:
                 regs.r02 = static_cast<uintptr_t>(write_to_c_page(regs.r03, regs.r04, regs.r05));
                 break;
             case 7: // get_flip_num()
-                regs.r02 = get_flip_num();
+            {
+                // The flip ring's head at the time of the snapshot is
+                // returned in <r03>.
+                uintptr_t ring_head = 0;
+                regs.r02 = get_flip_num(ring_head);
+                regs.r03 = ring_head;
                 break;
+            }
             case 8: // get_flip_data(int_t out_addr, int_t out_size)
                 regs.r02 = static_cast<uintptr_t>(get_flip_data(regs.r03, regs.r04));
                 break;
@@ -448,111 +951,622 @@ public:
             case 10: // remove_flip_entry(int_t rip)
                 regs.r02 = static_cast<uintptr_t>(remove_flip_entry(regs.r03));
                 break;
+            case 11: // batch_split_ops(int_t ops_addr, size_t num_ops)
+                regs.r02 = static_cast<uintptr_t>(batch_split_ops(regs.r03, regs.r04));
+                break;
+            case 12: // register_flip_ring(size_t capacity)
+                regs.r02 = static_cast<uintptr_t>(register_flip_ring(regs.r03));
+                break;
+            case 13: // unregister_flip_ring()
+                regs.r02 = static_cast<uintptr_t>(unregister_flip_ring());
+                break;
+            case 14: // get_exit_stats(int_t out_addr, int_t out_size)
+                regs.r02 = get_exit_stats(regs.r03, regs.r04);
+                break;
+            case 15: // read_event_log(int_t out_addr, int_t out_size)
+                regs.r02 = read_event_log(regs.r03, regs.r04);
+                break;
+            case 16: // get_flip_data_packed(int_t out_addr, int_t out_size)
+                regs.r02 = get_flip_data_packed(regs.r03, regs.r04);
+                break;
+            case 17: // create_split_range(int_t gva, size_t size)
+                regs.r02 = create_split_range(regs.r03, regs.r04);
+                break;
+            case 18: // apply_patches(int_t patches_addr, size_t patches_size)
+                regs.r02 = apply_patches(regs.r03, regs.r04);
+                break;
+            case 19: // export_splits(int_t out_addr, int_t out_size)
+                regs.r02 = export_splits(regs.r03, regs.r04);
+                break;
+            case 20: // import_splits(int_t in_addr, size_t in_size)
+                regs.r02 = import_splits(regs.r03, regs.r04);
+                break;
+            case 21: // read_flip_ring(int_t out_addr, int_t out_size)
+            {
+                // The number of dropped events is returned in <r03>.
+                uintptr_t dropped = 0;
+                regs.r02 = read_flip_ring(regs.r03, regs.r04, dropped);
+                regs.r03 = dropped;
+                break;
+            }
             default:
                 regs.r02 = -1u;
                 break;
         }
+
+        // VMCALLs are the only place where we may flush the TLB, so this
+        // is where idle 2m ranges get re-promoted.
+        coalesce_idle_pages();
+        deactivate_thrashing_splits();
+
+        // Splits may have been tied to (or freed from) address spaces.
+        sync_cr3_exiting();
+
+        // Free what was unlinked, as far as no vCPU can still use it.
+        m_reader.leave();
+        g_rcu.reclaim();
     }
 
 private:
 
-    /// Returns a predefined value (1)
-    ///
-    /// @expects none
-    ///
-    /// @return 1
+    /// Records the current exit in the exit statistics of this vCPU
     ///
-    int
-    hv_present() noexcept
+    void
+    record_exit(const exit_kind_t kind) noexcept
     {
-        return 1;
+        if (exit_stats_disabled) {}
+        else
+            m_exit_stats.record(kind, read_tsc() - m_exit_tsc);
     }
 
-    /// Creates a split for gva
-    ///
-    /// @expects gva != 0
-    ///
-    /// @param gva the guest virtual address of the page to split
+    /// Records a debug event in the event log of this vCPU
     ///
-    /// @return 1 for success, 0 for failure
+    void
+    log_debug(const log_event_id id, const uint64_t a0 = 0, const uint64_t a1 = 0, const uint64_t a2 = 0) noexcept
+    {
+        if (debug_disabled) {}
+        else
+            m_event_log.record(id, read_tsc(), a0, a1, a2);
+    }
+
+    /// Returns guest register <n> (0 = rax ... 15 = r15)
     ///
-    int
-    create_split_context(const int_t gva)
+    uint64_t &
+    gpr(const int n) noexcept
     {
-        expects(gva != 0);
+        switch (n)
+        {
+            case 0: return m_state_save->rax;
+            case 1: return m_state_save->rcx;
+            case 2: return m_state_save->rdx;
+            case 3: return m_state_save->rbx;
+            case 4: return m_state_save->rsp;
+            case 5: return m_state_save->rbp;
+            case 6: return m_state_save->rsi;
+            case 7: return m_state_save->rdi;
+            case 8: return m_state_save->r08;
+            case 9: return m_state_save->r09;
+            case 10: return m_state_save->r10;
+            case 11: return m_state_save->r11;
+            case 12: return m_state_save->r12;
+            case 13: return m_state_save->r13;
+            case 14: return m_state_save->r14;
+            default: return m_state_save->r15;
+        }
+    }
 
-        // Get the physical aligned (4k) data page address.
-        const auto &&cr3 = vmcs::guest_cr3::get();
-        const auto &&mask_4k = ~(ept::pt::size_bytes - 1);
-        const auto &&d_va = gva & mask_4k;
-        const auto &&d_pa = bfn::virt_to_phys_with_cr3(d_va, cr3);
+    /// Enables or disables CR3-load exiting, depending on whether there
+    /// are splits that are tied to address spaces
+    ///
+    void
+    sync_cr3_exiting()
+    {
+        const auto &&wanted = g_num_cr3_splits.load(std::memory_order_relaxed) != 0;
+        if (wanted == m_cr3_exiting)
+            return;
 
-        // Check whether we have already remapped the relevant **2m** page.
-        const auto &&mask_2m = ~(ept::pd::size_bytes - 1);
-        const auto &&aligned_2m_pa = d_pa & mask_2m;
+        m_cr3_exiting = wanted;
 
-        const auto &&aligned_2m_it = g_2m_pages.find(aligned_2m_pa);
-        if (aligned_2m_it == g_2m_pages.end())
+        if (wanted)
         {
-            // This (2m) page range has to be remapped to 4k.
-            //
-            _bfdebug << "create_split_context: remapping page from 2m to 4k for: " << hex_out_s(aligned_2m_pa) << bfendl;
-
-            std::lock_guard<std::mutex> guard(g_mutex);
-            const auto saddr = aligned_2m_pa;
-            const auto eaddr = aligned_2m_pa + ept::pd::size_bytes;
-            g_root_ept->unmap(aligned_2m_pa);
-            g_root_ept->setup_identity_map_4k(saddr, eaddr);
-            g_2m_pages[aligned_2m_pa] = 0;
-
-            // Invalidate/Flush TLB
-            vmx::invvpid_all_contexts();
-            vmx::invept_global();
+            vmcs::primary_processor_based_vm_execution_controls::cr3_load_exiting::enable();
+            apply_cr3_splits(vmcs::guest_cr3::get());
         }
         else
-            _bfdebug << "create_split_context: page already remapped: " << hex_out_s(aligned_2m_pa) << bfendl;
+            vmcs::primary_processor_based_vm_execution_controls::cr3_load_exiting::disable();
+    }
 
-        // Check if we have already split the relevant **4k** page.
-        const auto &&split_it = g_splits.find(d_pa);
-        if (split_it == g_splits.end())
-        {
-            // We haven't split this page yet, so do it now.
-            //
-            _bfdebug << "create_split_context: splitting page for: " << hex_out_s(d_pa) << bfendl;
+    /// Handles a MOV to CR3 (CR3-load exiting)
+    ///
+    /// Emulates the load (including the TLB invalidation the guest
+    /// expects) and enables the splits of the new address space in our EPT
+    /// view, while disabling the ones it doesn't use.
+    ///
+    /// @return true if the exit was a MOV to CR3, false otherwise
+    ///
+    bool
+    handle_mov_to_cr3()
+    {
+        const auto &&qualification = vmcs::exit_qualification::control_register_access::get();
 
-            // Create and assign unqiue split_context.
-            std::lock_guard<std::mutex> guard(g_mutex);
-            CONTEXT(d_pa) = std::make_unique<split_context>();
-            CONTEXT(d_pa)->gva = gva;
-            CONTEXT(d_pa)->cr3 = cr3;
-            CONTEXT(d_pa)->d_pa = d_pa;
-            CONTEXT(d_pa)->d_va = d_va;
+        // Control register 3, access type 0 (MOV to CR)
+        if ((qualification & 0xF) != 3 || ((qualification >> 4) & 0x3) != 0)
+            return false;
 
-            // Allocate memory (4k) for new code page (host virtual).
-            CONTEXT(d_pa)->c_page = std::make_unique<uint8_t[]>(ept::pt::size_bytes);
-            CONTEXT(d_pa)->c_va = reinterpret_cast<int_t>(CONTEXT(d_pa)->c_page.get());
-            CONTEXT(d_pa)->c_pa = g_mm->virtint_to_physint(CONTEXT(d_pa)->c_va);
+        auto cr3 = gpr(static_cast<int>((qualification >> 8) & 0xF));
 
-            // Map data page into VMM (Host) memory.
-            const auto &&vmm_data = bfn::make_unique_map_x64<uint8_t>(d_va, cr3, ept::pt::size_bytes, vmcs::guest_ia32_pat::get());
+        // With CR4.PCIDE, bit 63 asks to keep the TLB entries of the PCID.
+        // It isn't part of CR3.
+        const auto &&no_flush = is_bit_set(vmcs::guest_cr4::get(), 17) && is_bit_set(cr3, 63);
+        cr3 &= ~(1ULL << 63);
 
-            // Copy contents of data page (VMM copy) to code page.
-            std::memmove(reinterpret_cast<ptr_t>(CONTEXT(d_pa)->c_va), reinterpret_cast<ptr_t>(vmm_data.get()), ept::pt::size_bytes);
+        vmcs::guest_cr3::set(cr3);
+        if (!no_flush)
+            vmx::invvpid_single_context_global(vmcs::virtual_processor_identifier::get());
 
-            // Ensure that split is deactivated, increase split counter and set hook counter to 1.
-            CONTEXT(d_pa)->active = false;
-            CONTEXT(d_pa)->num_hooks = 1;
-            g_2m_pages[aligned_2m_pa]++;
-            _bfdebug << "create_split_context: splits in this (2m) range: " << g_2m_pages[aligned_2m_pa] << bfendl;
-            _bfdebug << "create_split_context: # of hooks on this page: " << CONTEXT(d_pa)->num_hooks << bfendl;
-        }
-        else
-        {
+        apply_cr3_splits(cr3);
+
+        this->advance_rip();
+        return true;
+    }
+
+    /// Enables the splits of the address space <cr3> in our EPT view, and
+    /// disables the ones that it doesn't use
+    ///
+    /// Splits that are flipped to the data page stay flipped.
+    ///
+    void
+    apply_cr3_splits(const uint64_t cr3)
+    {
+        auto changed = false;
+
+        g_cr3_splits.for_each([&](uint64_t pfn, bool)
+        {
+            const auto &&split = g_splits.find(pfn);
+            if (split == nullptr || !split->active || m_thrash.cooling(pfn))
+                return;
+
+            auto *m_epte = m_view->ept->gpa_to_epte(split->d_pa).epte();
+            const auto &&entry = *m_epte & 0xFFFFFFFFF007UL;
+
+            if (split_applies_to(*split, cr3))
+            {
+                if (entry == (split->c_pa | 0x4UL) || entry == (split->d_pa | 0x3UL))
+                    return;
+
+                flip_to_code_page(split, split->d_pa);
+            }
+            else
+            {
+                if (entry == (split->d_pa | 0x7UL))
+                    return;
+
+                flip_page(split->d_pa, split->d_pa, flip_access_t::all);
+            }
+
+            changed = true;
+        });
+
+        if (changed)
+            vmx::invept_single_context(m_view->ept->eptp());
+    }
+
+    /// Returns the pages whose thrash cooldown is over to the code page
+    /// (see thrash_data_view)
+    ///
+    void
+    end_thrash_cooldowns()
+    {
+        if (m_thrash.num_cooling() == 0)
+            return;
+
+        const auto &&cr3 = vmcs::guest_cr3::get();
+        auto changed = false;
+
+        m_thrash.end_cooldowns(read_tsc(), [&](uint64_t pfn)
+        {
+            const auto &&split = g_splits.find(pfn);
+            if (split == nullptr || !split->active || !split_applies_to(*split, cr3))
+                return;
+
+            log_debug(log_thrash_cooldown_end, split->d_pa);
+
+            flip_to_code_page(split, split->d_pa);
+            changed = true;
+        });
+
+        if (changed)
+            vmx::invept_single_context(m_view->ept->eptp());
+    }
+
+    /// Deactivates the splits the thrash policy gave up on (see
+    /// thrash_deactivate), with all of their hooks
+    ///
+    /// This erases splits and flushes every view, so it's only done at the
+    /// end of a VMCALL. Until then, the vCPUs that gave up on a split keep
+    /// its page on the data page.
+    ///
+    void
+    deactivate_thrashing_splits()
+    {
+        if (g_num_thrash_splits.load(std::memory_order_relaxed) == 0)
+            return;
+
+        std::vector<uint64_t> pfns;
+        {
+            std::lock_guard<std::mutex> thrash_guard(g_thrash_mutex);
+            pfns.swap(g_thrash_splits);
+            g_num_thrash_splits = 0;
+        }
+
+        ept_flush_batch batch(this);
+        for (const auto &pfn : pfns)
+        {
+            int_t d_pa;
+            {
+                std::lock_guard<std::mutex> guard(g_mutex);
+
+                // Several vCPUs may have given up on the same split.
+                const auto &&split = g_splits.find(pfn);
+                if (split == nullptr)
+                    continue;
+
+                d_pa = split->d_pa;
+                split->num_hooks = 1;
+            }
+
+            deactivate_split_pa(d_pa);
+        }
+    }
+
+    /// Reads <size> instruction bytes at <va>, as the guest would fetch
+    /// them (i.e. from the code page, if <va> is on an active split)
+    ///
+    /// @return true on success, false if the page isn't present
+    ///
+    bool
+    read_code(const int_t va, const int_t gva, const split_context &split, const int_t cr3, uint8_t *out, const size_t size)
+    {
+        const auto &&mask_4k = ~(ept::pt::size_bytes - 1);
+        const auto &&offset = va & (ept::pt::size_bytes - 1);
+
+        // Most of the time, the code reads from its own page.
+        if ((va & mask_4k) == (gva & mask_4k))
+        {
+            std::memcpy(out, reinterpret_cast<ptr_t>(split.c_va + offset), size);
+            return true;
+        }
+
+        try
+        {
+            const auto &&pa = bfn::virt_to_phys_with_cr3(va, cr3);
+
+            const auto &&other = g_splits.find(pfn_4k(pa));
+            if (other != nullptr && other->active)
+            {
+                std::memcpy(out, reinterpret_cast<ptr_t>(other->c_va + offset), size);
+                return true;
+            }
+
+            auto &&vmm_code = bfn::make_unique_map_x64<uint8_t>(va, cr3, size, vmcs::guest_ia32_pat::get());
+            std::memcpy(out, vmm_code.get(), size);
+        }
+        catch (std::exception &)
+        {
+            return false;
+        }
+
+        return true;
+    }
+
+    /// Emulates a read from the data page of a split
+    ///
+    /// Decodes the instruction at RIP and, if it's one of the loads
+    /// decode_load() knows, completes it with the contents of the data
+    /// page and moves RIP past it. The EPT entry isn't touched.
+    ///
+    /// @param split the split the guest read from
+    /// @param gva the guest virtual address that was read
+    /// @param cr3 the guest's cr3
+    ///
+    /// @return true if the read was emulated, false if the page has to be
+    ///         flipped instead
+    ///
+    bool
+    emulate_read(split_context &split, const int_t gva, const int_t cr3)
+    {
+        // Only 64-bit code, and no emulation while the guest single-steps
+        // (we would swallow its debug trap).
+        auto rflags = vmcs::guest_rflags::get();
+        if (!is_bit_set(vmcs::guest_cs_access_rights::get(), 13) || is_bit_set(rflags, 8))
+            return false;
+
+        // Fetch up to 15 bytes, without crossing into a page that isn't
+        // present.
+        const auto &&mask_4k = ~(ept::pt::size_bytes - 1);
+        const auto rip = m_state_save->rip;
+
+        uint8_t code[15];
+        size_t code_size = 0;
+        while (code_size < sizeof(code))
+        {
+            const auto &&va = rip + code_size;
+            const auto count = std::min<size_t>(sizeof(code) - code_size, ((va & mask_4k) + ept::pt::size_bytes) - va);
+
+            if (!read_code(va, gva, split, cr3, code + code_size, count))
+                break;
+
+            code_size += count;
+        }
+
+        load_insn insn;
+        if (!decode_load(code, code_size, insn))
+            return false;
+
+        // The operand has to be the one that faulted, and must not
+        // continue on the next page.
+        const auto &&address = load_address(insn, rip + insn.length, [this](int n) { return gpr(n); });
+        const auto &&offset = address & (ept::pt::size_bytes - 1);
+        if ((address & mask_4k) != (gva & mask_4k) || offset + insn.mem_size > ept::pt::size_bytes)
+            return false;
+
+        // The data page is mapped by its physical address, so the mapping
+        // is the same for every address space the split is used in.
+        auto d_map = split.d_map.load(std::memory_order_acquire);
+        if (d_map == nullptr)
+        {
+            try
+            {
+                // If another vCPU maps the page at the same time, its mapping
+                // is used and ours is dropped.
+                auto &&map = std::make_unique<bfn::unique_map_ptr_x64<uint8_t>>(
+                    bfn::make_unique_map_x64<uint8_t>(split.d_pa));
+
+                if (split.d_map.compare_exchange_strong(d_map, map.get(), std::memory_order_acq_rel))
+                    d_map = map.release();
+            }
+            catch (std::exception &)
+            {
+                return false;
+            }
+        }
+
+        uint64_t value = 0;
+        std::memcpy(&value, d_map->get() + offset, insn.mem_size);
+
+        complete_load(insn, value, [this](int n) -> uint64_t & { return gpr(n); }, rflags);
+
+        vmcs::guest_rflags::set(rflags);
+        m_state_save->rip = rip + insn.length;
+
+        return true;
+    }
+
+    /// EPT Flush Batch
+    ///
+    /// Defers every flush_ept() issued while the (outermost) batch is
+    /// alive, and flushes once when it goes out of scope. Use it when a
+    /// single request mutates several splits.
+    ///
+    class ept_flush_batch
+    {
+    public:
+
+        explicit ept_flush_batch(tlb_handler *handler) noexcept
+            : m_handler(handler)
+        { m_handler->m_flush_depth++; }
+
+        ~ept_flush_batch()
+        {
+            if (--m_handler->m_flush_depth == 0 && m_handler->m_flush_pending)
+                m_handler->flush_ept();
+        }
+
+        ept_flush_batch(const ept_flush_batch &) = delete;
+        ept_flush_batch &operator=(const ept_flush_batch &) = delete;
+
+    private:
+        tlb_handler *m_handler;
+    };
+
+    /// Invalidates the cached translations derived from the EPT views
+    ///
+    /// Called after a change to all views. INVEPT only acts on the logical
+    /// processor that executes it, so a single-context INVEPT flushes our
+    /// own view, and the views of the other vCPUs are marked stale, which
+    /// makes them flush on their next exit (see handle_exit()). There is
+    /// no INVEPT type that targets a single address, and INVVPID doesn't
+    /// touch EPT derived information, so this is as narrow as it gets.
+    ///
+    /// Every flush is reported to g_rcu, so code pages that were retired
+    /// before (see rcu_domain::retire_cached()) are only reused once no
+    /// vCPU can have them cached anymore.
+    ///
+    /// Inside an ept_flush_batch the flush is only recorded.
+    ///
+    void
+    flush_ept()
+    {
+        if (m_flush_depth > 0)
+        {
+            m_flush_pending = true;
+            return;
+        }
+
+        m_flush_pending = false;
+
+        for_each_ept_view([this](ept_view &view)
+        {
+            if (&view != m_view)
+                view.stale = true;
+        });
+
+        const auto &&epoch = g_rcu.epoch();
+        vmx::invept_single_context(m_view->ept->eptp());
+        m_reader.flushed(epoch);
+    }
+
+    /// Returns a predefined value (1)
+    ///
+    /// @expects none
+    ///
+    /// @return 1
+    ///
+    int
+    hv_present() noexcept
+    {
+        return 1;
+    }
+
+    /// Creates a split for gva
+    ///
+    /// @expects gva != 0
+    ///
+    /// @param gva the guest virtual address of the page to split
+    ///
+    /// @return 1 for success, 0 for failure
+    ///
+    int
+    create_split_context(const int_t gva)
+    {
+        expects(gva != 0);
+
+        // Get the physical aligned (4k) data page address.
+        const auto &&cr3 = vmcs::guest_cr3::get();
+        const auto &&mask_4k = ~(ept::pt::size_bytes - 1);
+        const auto &&d_pa = bfn::virt_to_phys_with_cr3(gva & mask_4k, cr3);
+
+        return create_split_context_pa(gva, d_pa, cr3);
+    }
+
+    /// Creates a split for the data page at <d_pa>
+    ///
+    /// @expects d_pa != 0
+    ///
+    /// @param gva the guest virtual address the split is created for
+    /// @param d_pa the physical (4k aligned) address of its data page
+    /// @param cr3 the address space of <gva>
+    /// @param contents the contents of a new code page (a copy of the data
+    ///     page if nullptr)
+    ///
+    /// @return 1 for success, 0 for failure
+    ///
+    int
+    create_split_context_pa(const int_t gva, const int_t d_pa, const int_t cr3, const uint8_t *contents = nullptr)
+    {
+        expects(d_pa != 0);
+
+        const auto &&mask_4k = ~(ept::pt::size_bytes - 1);
+        const auto &&d_va = gva & mask_4k;
+
+        // Two requests for the same page must not both remap it or both
+        // split it.
+        std::lock_guard<std::mutex> guard(g_mutex);
+
+        // Check whether we have already remapped the relevant **2m** page.
+        const auto &&mask_2m = ~(ept::pd::size_bytes - 1);
+        const auto &&aligned_2m_pa = d_pa & mask_2m;
+
+        const auto &&page = g_2m_pages.find(pfn_2m(aligned_2m_pa));
+        if (page == nullptr || !page->remapped)
+        {
+            // This (2m) page range has to be remapped to 4k.
+            //
+            log_debug(log_remap_4k, aligned_2m_pa);
+
+            const auto saddr = aligned_2m_pa;
+            const auto eaddr = aligned_2m_pa + ept::pd::size_bytes;
+            for_each_ept_view([&](ept_view &view)
+            {
+                // Views that haven't re-promoted the range yet just keep
+                // their 4k tables (see coalesce_view()).
+                auto &&queued = std::find(view.coalesce.begin(), view.coalesce.end(), pfn_2m(aligned_2m_pa));
+                if (queued != view.coalesce.end())
+                {
+                    view.coalesce.erase(queued);
+                    return;
+                }
+
+                view.ept->unmap(aligned_2m_pa);
+                view.ept->setup_identity_map_4k(saddr, eaddr);
+            });
+
+            auto &&context = g_2m_pages[pfn_2m(aligned_2m_pa)];
+            context.remapped = true;
+
+            // Back off if this range was re-promoted only recently.
+            const auto &&now = read_tsc();
+            if (context.delay != 0 && now - context.coalesced_at < context.delay * 4)
+                context.delay = std::min(context.delay * 2, coalesce_max_delay);
+            else
+                context.delay = coalesce_min_delay;
+
+            // Invalidate/Flush TLB
+            flush_ept();
+        }
+        else
+            log_debug(log_already_remapped, aligned_2m_pa);
+
+        // Check if we have already split the relevant **4k** page.
+        const auto &&split = g_splits.find(pfn_4k(d_pa));
+        if (split == nullptr)
+        {
+            // We haven't split this page yet, so do it now.
+            //
+            log_debug(log_split_page, d_pa);
+
+            // Create and assign unqiue split_context. It's only published
+            // (see rcu_map::insert()) once it's complete.
+            auto &&owner = std::make_unique<split_context>();
+            auto &&context = *owner;
+            context.gva = gva;
+            context.cr3 = cr3;
+            context.d_pa = d_pa;
+            context.d_va = d_va;
+
+            // Get a code page with the contents of the data page. If another
+            // split has the same contents, the page is shared.
+            if (contents != nullptr)
+                context.c_page = g_code_page_cache.acquire(contents);
+            else
+            {
+                // Map data page into VMM (Host) memory. We already know where
+                // it is, so there's no need to walk the guest page tables again.
+                const auto &&vmm_data = bfn::make_unique_map_x64<uint8_t>(d_pa);
+                context.c_page = g_code_page_cache.acquire(vmm_data.get());
+            }
+            context.c_va = reinterpret_cast<int_t>(context.c_page.get());
+            context.c_pa = context.c_page.phys();
+
+            // Splits of kernel addresses are enabled everywhere, all others
+            // only in the address space of the requester.
+            context.global = is_bit_set(gva, 63);
+            if (!context.global)
+                enable_split_in(context, cr3);
+
+            // Ensure that split is deactivated, increase split counter and set hook counter to 1.
+            context.active = false;
+            context.num_hooks = 1;
+            g_splits.insert(pfn_4k(d_pa), std::move(owner));
+
+            if (!context.global)
+            {
+                g_cr3_splits.insert(pfn_4k(d_pa), std::make_unique<bool>(true));
+                g_num_cr3_splits = g_cr3_splits.size();
+            }
+
+            auto &&num_splits = ++g_2m_pages[pfn_2m(aligned_2m_pa)].num_splits;
+            log_debug(log_split_created, num_splits, context.num_hooks);
+        }
+        else
+        {
             // This page already got split. Just increase the hook counter.
-            _bfdebug << "create_split_context: page already split for: " << hex_out_s(d_pa) << bfendl;
-            std::lock_guard<std::mutex> guard(g_mutex);
-            IT(split_it)->num_hooks++;
-            _bfdebug << "create_split_context: # of hooks on this page: " << IT(split_it)->num_hooks << bfendl;
+            split->num_hooks++;
+            log_debug(log_already_split, d_pa, split->num_hooks);
+
+            // Enable the split in the requester's address space too.
+            if (!split_applies_to(*split, cr3))
+                enable_split_in(*split, cr3);
         }
 
         return 1;
@@ -577,32 +1591,51 @@ private:
         const auto &&d_va = gva & mask_4k;
         const auto &&d_pa = bfn::virt_to_phys_with_cr3(d_va, cr3);
 
-        // Search for relevant entry in <map> m_splits.
-        auto &&split_it = g_splits.find(d_pa);
-        if (split_it != g_splits.end())
+        return activate_split_pa(d_pa);
+    }
+
+    /// Activates an already created split for the given physical address
+    ///
+    /// @expects d_pa != 0
+    ///
+    /// @param d_pa the physical (4k aligned) address of the data page
+    ///
+    /// @return 1 for success, 0 for failure
+    ///
+    int
+    activate_split_pa(const int_t d_pa)
+    {
+        expects(d_pa != 0);
+
+        std::lock_guard<std::mutex> guard(g_mutex);
+
+        // Search for relevant entry in g_splits.
+        const auto &&split = g_splits.find(pfn_4k(d_pa));
+        if (split != nullptr)
         {
-            if (IT(split_it)->active == true)
+            if (split->active == true)
             {
                 // This split is already active, so don't do anything.
                 //
-                _bfdebug << "activate_split: split already active for: " << hex_out_s(d_pa) << bfendl;
+                log_debug(log_already_active, d_pa);
                 return 1;
             }
 
             // We have found the relevant split context.
             //
-            _bfdebug << "activate_split: activating split for: " << hex_out_s(d_pa) << bfendl;
+            log_debug(log_activate, d_pa);
+
+            // Mark the split as active before any view maps its code page
+            // (see flip_to_code_page()).
+            split->active = true;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
 
             // We assign the code page here, since that's the most
             // likely one to get used next.
-            flip_page(IT(split_it)->c_pa, d_pa, flip_access_t::exec);
+            flip_page_all(split->c_pa, d_pa, flip_access_t::exec);
 
             // Invalidate/Flush TLB
-            vmx::invvpid_all_contexts();
-            vmx::invept_global();
-
-            // Mark the split as active.
-            IT(split_it)->active = true;
+            flush_ept();
             return 1;
         }
         else
@@ -624,138 +1657,327 @@ private:
     {
         expects(d_pa != 0);
 
-        // Search for relevant entry in <map> m_splits.
-        auto &&split_it = g_splits.find(d_pa);
-        if (split_it != g_splits.end())
+        // Physical address of an adjacent split that has to go too.
+        int_t adjacent_pa = 0;
+
+        // Mutex block. Everything from the lookup to the 2m bookkeeping
+        // happens under g_mutex, so that two VMCALLs deactivating the same
+        // split can't both get past the hook counter.
         {
-            if (IT(split_it)->num_hooks > 1)
+            std::lock_guard<std::mutex> guard(g_mutex);
+
+            // Search for relevant entry in g_splits.
+            const auto &&split = g_splits.find(pfn_4k(d_pa));
+            if (split == nullptr)
+            {
+                bfwarning << "deactivate_split_pa: no split found for: " << hex_out_s(d_pa) << bfendl;
+                return 0;
+            }
+
+            if (split->num_hooks > 1)
             {
                 // We still have other hooks on this page,
                 // so don't deactive the split yet.
                 // Just decrease the hook counter.
-                _bfdebug << "deactivate_split_pa: other hooks found on this page: " << hex_out_s(d_pa) << bfendl;
-                _bfdebug << "deactivate_split_pa: # of hooks on this page (before): " << IT(split_it)->num_hooks << bfendl;
+                log_debug(log_deactivate_other_hooks, d_pa, split->num_hooks);
 
-                std::lock_guard<std::mutex> guard(g_mutex);
-                IT(split_it)->num_hooks--;
+                split->num_hooks--;
                 return 1;
             }
 
             // We have found the relevant split context.
             //
-            _bfdebug << "deactivate_split_pa: deactivating split for: " << hex_out_s(d_pa) << bfendl;
-            _bfdebug << "deactivate_split_pa: # of hooks on this page: " << IT(split_it)->num_hooks << bfendl;
+            log_debug(log_deactivate, d_pa, split->num_hooks);
 
-            // Mutex block
-            {
-                // Flip to data page and restore to default (pass-through) flags
-                flip_page(IT(split_it)->d_pa, d_pa, flip_access_t::all);
+            // Mark the split as inactive before its code page is unmapped,
+            // so exits that are still flipping to it notice (see
+            // flip_to_code_page()).
+            split->active = false;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+
+            // Flip to data page and restore to default (pass-through) flags
+            flip_page_all(split->d_pa, d_pa, flip_access_t::all);
 
-                // Erase split context from <map> m_splits.
-                g_splits.erase(d_pa);
-                _bfdebug << "deactivate_split_pa: total num of splits: " << g_splits.size() << bfendl;
+            if (!split->global)
+            {
+                g_cr3_splits.erase(pfn_4k(d_pa));
+                g_num_cr3_splits = g_cr3_splits.size();
             }
 
+            // Erase split context from g_splits. <split> stays valid
+            // until the end of the VMCALL, but is gone for new lookups.
+            g_splits.erase(pfn_4k(d_pa));
+            log_debug(log_deactivate_total, g_splits.size());
+
             // Invalidate/Flush TLB
-            vmx::invvpid_all_contexts();
-            vmx::invept_global();
+            flush_ept();
 
             // Check if we have an adjacent split.
-            const auto &&next_split_it = g_splits.find(d_pa + ept::pt::size_bytes);
-            if (next_split_it != g_splits.end())
+            const auto &&next_split = g_splits.find(pfn_4k(d_pa + ept::pt::size_bytes));
+            if (next_split != nullptr)
             {
                 // We found an adjacent split.
                 // Check if the hook counter is 0.
-                if (IT(next_split_it)->num_hooks == 0)
+                if (next_split->num_hooks == 0)
                 {
                     // This is likely a page which got split when writing
                     // to a code page while exceeding the page bounds.
                     // Since this split isn't needed anymore, deactivate
-                    // it too.
-                    _bfdebug << "deactivate_split_pa: deactivating adjacent split for: " << hex_out_s(IT(next_split_it)->d_pa) << bfendl;
-                    deactivate_split(IT(next_split_it)->d_va);
+                    // it too (once g_mutex is released).
+                    log_debug(log_deactivate_adjacent, next_split->d_pa);
+                    adjacent_pa = next_split->d_pa;
                 }
             }
 
             // Decrease the split counter.
             const auto &&mask_2m = ~(ept::pd::size_bytes - 1);
             const auto &&aligned_2m_pa = d_pa & mask_2m;
-            g_2m_pages[aligned_2m_pa]--;
-            _bfdebug << "deactivate_split_pa: splits in this (2m) range: " << g_2m_pages[aligned_2m_pa] << bfendl;
-            /*
-            // Check whether we have to remap the 4k pages to a 2m page.
-            if (g_2m_pages[aligned_2m_pa] == 0)
+            const auto &&page = g_2m_pages.find(pfn_2m(aligned_2m_pa));
+            if (page != nullptr)
             {
-                // We need to remap the relevant 4k pages to a 2m page.
-                //
-                _bfdebug << "deactivate_split: remapping pages from 4k to 2m for: " << hex_out_s(aligned_2m_pa) << bfendl;
-
-                auto &&saddr = aligned_2m_pa;
-                auto &&eaddr = aligned_2m_pa + ept::pd::size_bytes;
-                g_root_ept->unmap_identity_map_4k(saddr, eaddr);
-                g_root_ept->map_2m(aligned_2m_pa, aligned_2m_pa, ept::memory_attr::pt_wb);
+                auto &&num_splits = --page->num_splits;
+                log_debug(log_deactivate_2m_splits, num_splits);
 
-                // Invalidate/Flush TLB
-                vmx::invvpid_all_contexts();
-                vmx::invept_global();
-
-                // Erase 2m page from map.
-                g_2m_pages.erase(aligned_2m_pa);
+                // Check whether we can remap the 4k pages to a 2m page. We don't
+                // do it right away (see coalesce_idle_pages()).
+                if (num_splits == 0)
+                    mark_2m_idle(pfn_2m(aligned_2m_pa), *page, read_tsc());
             }
-            //*/
-            _bfdebug << "deactivate_split_pa: total num of remapped (2m) pages: " << g_2m_pages.size() << bfendl;
 
-            return 1;
+            log_debug(log_deactivate_2m_total, g_2m_pages.size());
         }
-        else
-            bfwarning << "deactivate_split_pa: no split found for: " << hex_out_s(d_pa) << bfendl;
-        return 0;
+
+        if (adjacent_pa != 0)
+            deactivate_split_pa(adjacent_pa);
+
+        return 1;
     }
 
-    /// Deactivates (and frees) a split for a given guest virtual address
+    /// Re-promotes idle 2m ranges
     ///
-    /// @expects gva != 0
+    /// Remaps every 4k-mapped range that has been without splits for at
+    /// least its re-promotion delay back to a single 2m page. Ranges which
+    /// got split again in the meantime are dropped from the idle list.
     ///
-    /// @param gva the guest virtual address of the page to deactivate
+    /// @param force re-promote idle ranges regardless of their delay
     ///
-    /// @return 1 for success, 0 for failure
+    /// @return the number of re-promoted ranges
     ///
-    int
-    deactivate_split(const int_t gva)
+    size_t
+    coalesce_idle_pages(const bool force = false)
     {
-        expects(gva != 0);
+        if (!force && read_tsc() < g_2m_idle_due.load(std::memory_order_relaxed))
+            return 0;
 
-        // Get the physical aligned (4k) data page address.
-        const auto &&cr3 = vmcs::guest_cr3::get();
-        const auto &&mask_4k = ~(ept::pt::size_bytes - 1);
-        const auto &&d_va = gva & mask_4k;
-        const auto &&d_pa = bfn::virt_to_phys_with_cr3(d_va, cr3);
+        std::lock_guard<std::mutex> guard(g_mutex);
+
+        const auto &&now = read_tsc();
+        size_t coalesced = 0;
+        auto due = std::numeric_limits<uint64_t>::max();
+
+        auto &&idle = g_2m_idle_pages; // Shorter name.
+        idle.erase(std::remove_if(idle.begin(), idle.end(), [&](const uint64_t pfn)
+        {
+            const auto &&page = g_2m_pages.find(pfn);
+            if (page == nullptr || !page->remapped || page->num_splits != 0)
+                return true;
+
+            if (!force && now - page->idle_since < page->delay)
+            {
+                due = std::min(due, page->idle_since + page->delay);
+                return false;
+            }
+
+            // We need to remap the relevant 4k pages to a 2m page.
+            //
+            const auto &&aligned_2m_pa = pfn << 21;
+            log_debug(log_coalesce, aligned_2m_pa);
+
+            // Only our own view is re-promoted right away, the others do
+            // it before their next flush (see coalesce_view()).
+            for_each_ept_view([&](ept_view &view)
+            {
+                if (&view == m_view)
+                    remap_2m(*view.ept, aligned_2m_pa);
+                else
+                {
+                    view.coalesce.push_back(pfn);
+                    view.coalesce_pending = true;
+                }
+            });
+
+            // Keep the context around, so we remember the delay.
+            page->remapped = false;
+            page->coalesced_at = now;
+
+            coalesced++;
+            return true;
+        }), idle.end());
+
+        g_2m_idle_due.store(due, std::memory_order_relaxed);
+
+        if (coalesced > 0)
+        {
+            // Invalidate/Flush TLB
+            flush_ept();
+        }
+
+        return coalesced;
+    }
+
+    /// Re-promotes the 2m ranges that were queued for our view (see
+    /// ept_view). Called on our own exit, right before the view is flushed,
+    /// so we can't walk the freed 4k tables anymore.
+    ///
+    void
+    coalesce_view()
+    {
+        std::lock_guard<std::mutex> views_guard(g_views_mutex);
+
+        for (const auto &pfn : m_view->coalesce)
+            remap_2m(*m_view->ept, pfn << 21);
+
+        m_view->coalesce.clear();
+        m_view->coalesce_pending = false;
+    }
+
+    /// Deactivates (and frees) a split for a given guest virtual address
+    ///
+    /// @expects gva != 0
+    ///
+    /// @param gva the guest virtual address of the page to deactivate
+    ///
+    /// @return 1 for success, 0 for failure
+    ///
+    int
+    deactivate_split(const int_t gva)
+    {
+        expects(gva != 0);
+
+        // Get the physical aligned (4k) data page address.
+        const auto &&cr3 = vmcs::guest_cr3::get();
+        const auto &&mask_4k = ~(ept::pt::size_bytes - 1);
+        const auto &&d_va = gva & mask_4k;
+        const auto &&d_pa = bfn::virt_to_phys_with_cr3(d_va, cr3);
 
         return deactivate_split_pa(d_pa);
     }
 
+    /// Creates and activates splits for all pages of a range
+    ///
+    /// Does what create_split_context() and activate_split() do for every
+    /// page of [gva, gva + size), but walks the guest page tables only
+    /// once for the whole range (see guest_page_walker), remaps each 2m
+    /// range only once, and flushes the EPT once, at the end. Pages that
+    /// aren't mapped are skipped.
+    ///
+    /// @expects gva != 0
+    /// @expects size >= 1 && size <= max_split_range
+    ///
+    /// @param gva the guest virtual address of the range
+    /// @param size the size of the range in bytes
+    ///
+    /// @return the number of pages that were split and activated
+    ///
+    size_t
+    create_split_range(const int_t gva, const size_t size)
+    {
+        expects(gva != 0);
+        expects(size >= 1 && size <= max_split_range);
+
+        const auto &&cr3 = vmcs::guest_cr3::get();
+        const auto &&mask_4k = ~(ept::pt::size_bytes - 1);
+        const auto &&first = gva & mask_4k;
+        const auto &&last = (gva + size - 1) & mask_4k;
+
+        log_debug(log_split_range, gva, size);
+
+        guest_page_walker walker(cr3);
+        ept_flush_batch batch(this);
+
+        size_t num_split = 0;
+        for (auto va = first; va <= last; va += ept::pt::size_bytes)
+        {
+            const auto &&d_pa = walker.translate(va);
+            if (d_pa == 0)
+            {
+                log_debug(log_split_range_unmapped, va);
+                continue;
+            }
+
+            // The first page keeps the offset of <gva>, like a single
+            // create_split_context() call would.
+            const auto split_gva = va == first ? gva : va;
+            if (create_split_context_pa(split_gva, d_pa, cr3) == 1 && activate_split_pa(d_pa) == 1)
+                num_split++;
+        }
+
+        return num_split;
+    }
+
     /// Deactivates (and frees) all splits
     ///
+    /// Unlike deactivate_split(), this ignores the hook counters and tears
+    /// everything down in bulk: the EPT entries of all splits are restored
+    /// in one pass over each view, the splits (and with them their code
+    /// pages) are dropped at once, every remapped 2m range becomes idle,
+    /// and the EPT is flushed once.
+    ///
     int
     deactivate_all_splits()
     {
-        if (g_splits.size() > 0)
+        if (g_splits.empty())
         {
-            _bfdebug << "deactivate_all_splits: deactivating all splits. current num of splits: " << g_splits.size() << bfendl;
+            log_debug(log_deactivate_all_none);
+            return 1;
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(g_mutex);
+            log_debug(log_deactivate_all, g_splits.size());
 
-            // Iterating thorugh <map> g_splits until it is empty.
-            while (!g_splits.empty())
+            std::vector<int_t> d_pas;
+            d_pas.reserve(g_splits.size());
+            g_splits.for_each([&d_pas](uint64_t, split_context &split)
             {
-                // Get the first split in the map.
-                const auto &&split_it = g_splits.begin();
-                _bfdebug << "deactivate_all_splits: deactivating split for: " << hex_out_s(IT(split_it)->d_pa) << bfendl;
+                split.active = false;
+                d_pas.push_back(split.d_pa);
+            });
 
-                // Deactivating the split for a physical page address.
-                deactivate_split_pa(IT(split_it)->d_pa);
-            }
+            // See flip_to_code_page().
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+
+            // In address order, neighbouring splits share their EPT tables.
+            std::sort(d_pas.begin(), d_pas.end());
+
+            // Flip to data page and restore to default (pass-through) flags
+            for_each_ept_view([&](ept_view &view)
+            {
+                for (const auto &d_pa : d_pas)
+                    flip_epte(*view.ept, d_pa, d_pa, flip_access_t::all);
+            });
+
+            // The split contexts (and code pages) are freed after a grace
+            // period (see rcu_map::clear()).
+            g_splits.clear();
+            g_cr3_splits.clear();
+            g_num_cr3_splits = 0;
+
+            // No range has splits left. They're re-promoted after their
+            // delay (see coalesce_idle_pages()).
+            const auto &&now = read_tsc();
+            g_2m_pages.for_each([&](uint64_t pfn, page_2m_context &page)
+            {
+                if (page.num_splits == 0)
+                    return;
+
+                page.num_splits = 0;
+                mark_2m_idle(pfn, page, now);
+            });
         }
-        else
-            _bfdebug << "deactivate_all_splits: no active splits found" << bfendl;
+
+        // Invalidate/Flush TLB
+        flush_ept();
 
         return 1;
     }
@@ -781,10 +2003,10 @@ private:
             const auto &&d_va = gva & mask_4k;
             const auto &&d_pa = bfn::virt_to_phys_with_cr3(d_va, cr3);
 
-            // Check for match in <map> m_splits.
-            const auto &&split_it = g_splits.find(d_pa);
-            if (split_it != g_splits.end())
-                return IT(split_it)->active ? 1 : 0;
+            // Check for match in g_splits.
+            const auto &&split = g_splits.find(pfn_4k(d_pa));
+            if (split != nullptr)
+                return split->active ? 1 : 0;
         }
         catch (std::exception&)
         {
@@ -815,7 +2037,7 @@ private:
         expects(size >= 1);
 
         // Logging params
-        _bfdebug << "write_to_c_page: from_va: " << hex_out_s(from_va) << ", to_va: " << hex_out_s(to_va)<< ", size: " << hex_out_s(size) << bfendl;
+        log_debug(log_write_to_c_page, from_va, to_va, size);
 
         // Get the physical aligned (4k) data page address.
         const auto &&cr3 = vmcs::guest_cr3::get();
@@ -823,9 +2045,9 @@ private:
         const auto &&d_va = to_va & mask_4k;
         const auto &&d_pa = bfn::virt_to_phys_with_cr3(d_va, cr3);
 
-        // Search for relevant entry in <map> m_splits.
-        const auto &&split_it = g_splits.find(d_pa);
-        if (split_it != g_splits.end())
+        // Search for relevant entry in g_splits.
+        auto &&split = g_splits.find(pfn_4k(d_pa));
+        if (split != nullptr)
         {
             // Check if we have to write to two consecutive pages.
             const auto start_range = to_va;
@@ -833,25 +2055,26 @@ private:
             if ((end_range >> 12) > (start_range >> 12))
             {
                 // Get virt and phys address of second page.
-                auto &&end_va = end_range & mask_4k;
-                auto &&end_pa = bfn::virt_to_phys_with_cr3(d_va, cr3);
+                const auto &&end_va = end_range & mask_4k;
+                const auto &&end_pa = bfn::virt_to_phys_with_cr3(end_va, cr3);
 
-                _bfdebug << "write_to_c_page: we are writing to two pages: " << hex_out_s(d_pa) << " & " << hex_out_s(end_pa) << bfendl;
+                log_debug(log_write_two_pages, d_pa, end_pa);
 
                 // Check if the second page is already split
                 if (is_split(end_va) == 0)
                 {
                     // We have to split this page before writing to it.
                     //
-                    _bfdebug << "write_to_c_page: splitting second page: " << hex_out_s(end_pa) << bfendl;
+                    log_debug(log_write_split_second, end_pa);
 
+                    ept_flush_batch batch(this);
                     create_split_context(end_va);
                     activate_split(end_va);
                 }
 
                 // Get second split
-                const auto &&second_split_it = g_splits.find(end_pa);
-                if (second_split_it == g_splits.end())
+                const auto &&second_split = g_splits.find(pfn_4k(end_pa));
+                if (second_split == nullptr)
                 {
                     // For some reason, the second page didn't get split.
                     //
@@ -864,13 +2087,10 @@ private:
                 const auto &&write_offset = to_va - d_va;
 
                 // Get bytes for first page.
-                const auto &&bytes_1st_page = (d_va + ept::pt::size_bytes) - to_va - 1;
+                const auto &&bytes_1st_page = (d_va + ept::pt::size_bytes) - to_va;
 
                 // Get bytes for second page.
-                const auto &&bytes_2nd_page = end_range - end_va;
-
-                if (bytes_1st_page + bytes_2nd_page != size)
-                    bfwarning << "write_to_c_page: sum of bytes doesn't equal original size: " << size << ", bytes_1st_page: " << bytes_1st_page << ", bytes_2nd_page: " << bytes_2nd_page << bfendl;
+                const auto &&bytes_2nd_page = size - bytes_1st_page;
 
                 std::lock_guard<std::mutex> guard(g_mutex);
 
@@ -878,14 +2098,14 @@ private:
                 auto &&vmm_data = bfn::make_unique_map_x64<uint8_t>(from_va, cr3, size, vmcs::guest_ia32_pat::get());
 
                 // Write to first page.
-                std::memmove(reinterpret_cast<ptr_t>(IT(split_it)->c_va + write_offset), reinterpret_cast<ptr_t>(vmm_data.get()), bytes_1st_page);
+                write_code_page(*split, write_offset, vmm_data.get(), bytes_1st_page);
 
                 // Write to second page.
-                std::memmove(reinterpret_cast<ptr_t>(IT(second_split_it)->c_va), reinterpret_cast<ptr_t>(vmm_data.get() + bytes_1st_page + 1), bytes_2nd_page);
+                write_code_page(*second_split, 0, vmm_data.get() + bytes_1st_page, bytes_2nd_page);
             }
             else
             {
-                _bfdebug << "write_to_c_page: we are writing to one page: " << hex_out_s(d_pa) << bfendl;
+                log_debug(log_write_one_page, d_pa);
 
                 // Get write offset
                 auto &&write_offset = to_va - d_va;
@@ -896,7 +2116,7 @@ private:
                 auto &&vmm_data = bfn::make_unique_map_x64<uint8_t>(from_va, cr3, size, vmcs::guest_ia32_pat::get());
 
                 // Copy contents of <from_va> (VMM copy) to <to_va> memory.
-                std::memmove(reinterpret_cast<ptr_t>(IT(split_it)->c_va + write_offset), reinterpret_cast<ptr_t>(vmm_data.get()), size);
+                write_code_page(*split, write_offset, vmm_data.get(), size);
             }
 
             return 1;
@@ -907,17 +2127,456 @@ private:
         return 0;
     }
 
+    /// Writes to the code page of a split
+    ///
+    /// Code pages can be shared between splits (see code_page_cache), so
+    /// the split gets a private copy first if needed. If the split ends up
+    /// on a different page, the EPT views that map the old page are
+    /// pointed to the new one.
+    ///
+    /// Other vCPUs may read the old page on their exit path (see
+    /// read_code()), or still have it cached in their TLB, so it's always
+    /// copied, and kept until they're done with it.
+    ///
+    /// @param split the split to write to
+    /// @param offset the offset into the code page
+    /// @param data the bytes to write
+    /// @param size the number of bytes to write
+    ///
+    void
+    write_code_page(split_context &split, const size_t offset, const uint8_t *data, const size_t size)
+    {
+        const int_t old_pa = split.c_pa;
+        auto &&old_page = std::make_unique<code_page_ref>(g_code_page_cache.share(split.c_page));
+
+        split.c_page = g_code_page_cache.begin_write(std::move(split.c_page));
+        std::memmove(split.c_page.get() + offset, data, size);
+        split.c_page = g_code_page_cache.end_write(std::move(split.c_page));
+
+        // The old page is retired once the views no longer map it, but
+        // before they're flushed (see rcu_domain::retire_cached()).
+        ept_flush_batch batch(this);
+
+        retarget_code_page(split, old_pa);
+        g_rcu.retire_cached(std::move(old_page));
+    }
+
+    /// Points the EPT views of a split to its (new) code page
+    ///
+    /// Updates the addresses of the code page of <split>, and the views
+    /// that map its old code page at <old_pa>.
+    ///
+    void
+    retarget_code_page(split_context &split, const int_t old_pa)
+    {
+        split.c_va = reinterpret_cast<int_t>(split.c_page.get());
+        split.c_pa = split.c_page.phys();
+
+        if (split.c_pa == old_pa)
+            return;
+
+        // Exits that flipped to the old page after this check back in (see
+        // flip_to_code_page()).
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        log_debug(log_code_page_moved, split.d_pa, split.c_pa);
+
+        for_each_ept_view([&](ept_view &view)
+        {
+            auto *m_epte = view.ept->gpa_to_epte(split.d_pa).epte();
+            if ((*m_epte & 0xFFFFFFFFF000UL) == old_pa)
+                *m_epte = set_bits(*m_epte, 0xFFFFFFFFF000UL, split.c_pa.load());
+        });
+
+        // Invalidate/Flush TLB
+        flush_ept();
+    }
+
+    /// Applies a set of patches to code pages at once
+    ///
+    /// Reads the patch records (see patch_header) from one guest buffer,
+    /// which is mapped once, and translates their targets with one walk of
+    /// the guest page tables. Every target page has to be split already;
+    /// if a record is malformed or hits a page that isn't, nothing is
+    /// written at all.
+    ///
+    /// The patches of a page are applied to a copy of its code page, and
+    /// the finished copy replaces the code page in the EPT views, so no
+    /// vCPU ever executes a half-patched page. The pages are switched in
+    /// the order of their first record, and the EPT is flushed once.
+    ///
+    /// @expects patches_addr != 0
+    /// @expects patches_size >= sizeof(patch_header) && patches_size <= max_patch_buffer
+    ///
+    /// @param patches_addr the guest virtual address of the records
+    /// @param patches_size the size of the records in bytes
+    ///
+    /// @return the number of patches applied (all or none)
+    ///
+    size_t
+    apply_patches(const int_t patches_addr, const size_t patches_size)
+    {
+        expects(patches_addr != 0);
+        expects(patches_size >= sizeof(patch_header) && patches_size <= max_patch_buffer);
+
+        const auto &&cr3 = vmcs::guest_cr3::get();
+        auto &&buffer = bfn::make_unique_map_x64<uint8_t>(patches_addr, cr3, patches_size, vmcs::guest_ia32_pat::get());
+
+        // A page that gets patched, and its new contents
+        struct staged_page {
+            int_t d_pa;
+            std::unique_ptr<uint8_t[]> contents;
+        };
+
+        std::vector<staged_page> pages;
+        flat_map<size_t> page_index;
+        guest_page_walker walker(cr3);
+
+        std::lock_guard<std::mutex> guard(g_mutex);
+
+        size_t num_patches = 0;
+        for (size_t pos = 0; pos < patches_size; num_patches++)
+        {
+            if (patches_size - pos < sizeof(patch_header))
+            {
+                bfwarning << "apply_patches: truncated record at offset: " << pos << bfendl;
+                return 0;
+            }
+
+            patch_header header;
+            std::memcpy(&header, buffer.get() + pos, sizeof(header));
+
+            const auto &&data = pos + sizeof(header);
+            if (header.to_va == 0 || header.size == 0 || header.size > patches_size - data)
+            {
+                bfwarning << "apply_patches: invalid record at offset: " << pos << bfendl;
+                return 0;
+            }
+
+            // A patch may span several pages.
+            for (size_t done = 0; done < header.size;)
+            {
+                const auto &&va = header.to_va + done;
+                const auto &&offset = va & (ept::pt::size_bytes - 1);
+                const auto bytes = std::min<size_t>(header.size - done, ept::pt::size_bytes - offset);
+
+                const auto &&d_pa = walker.translate(va) & ~(ept::pt::size_bytes - 1);
+                const auto &&split = d_pa != 0 ? g_splits.find(pfn_4k(d_pa)) : nullptr;
+                if (split == nullptr)
+                {
+                    bfwarning << "apply_patches: no split found for: " << hex_out_s(va) << bfendl;
+                    return 0;
+                }
+
+                bool inserted;
+                auto &&index = page_index.insert(pfn_4k(d_pa), inserted);
+                if (inserted)
+                {
+                    index = pages.size();
+                    pages.push_back({d_pa, std::unique_ptr<uint8_t[]>(new uint8_t[ept::pt::size_bytes])});
+                    std::memcpy(pages.back().contents.get(), split->c_page.get(), ept::pt::size_bytes);
+                }
+
+                std::memcpy(pages[index].contents.get() + offset, buffer.get() + data + done, bytes);
+                done += bytes;
+            }
+
+            pos = data + ((header.size + 7) & ~7UL);
+        }
+
+        log_debug(log_apply_patches, num_patches, pages.size());
+
+        // The old code pages are released after a grace period, so they
+        // can't be reused while a vCPU might still read from them, or
+        // have them cached (the views are flushed after they're retired).
+        auto &&old_pages = std::make_unique<std::vector<code_page_ref>>();
+        old_pages->reserve(pages.size());
+
+        ept_flush_batch batch(this);
+        for (const auto &page : pages)
+        {
+            auto &&split = *g_splits.find(pfn_4k(page.d_pa));
+            const int_t old_pa = split.c_pa;
+
+            old_pages->push_back(std::move(split.c_page));
+            split.c_page = g_code_page_cache.acquire(page.contents.get());
+
+            retarget_code_page(split, old_pa);
+        }
+
+        g_rcu.retire_cached(std::move(old_pages));
+        return num_patches;
+    }
+
+    /// Exports the splits as a snapshot (see split_snapshot.h)
+    ///
+    /// The snapshot holds everything import_splits() needs to re-install
+    /// the splits in a later instance of the VMM, with the code pages
+    /// stored as their differences from the data pages. If it doesn't fit
+    /// into <out_size> bytes, nothing is written.
+    ///
+    /// @expects out_addr != 0
+    ///
+    /// @param out_addr the guest virtual address of the buffer
+    /// @param out_size the size of the buffer in bytes
+    ///
+    /// @return the size of the snapshot in bytes
+    ///
+    size_t
+    export_splits(const int_t out_addr, const int_t out_size)
+    {
+        expects(out_addr != 0);
+
+        std::vector<split_snapshot_entry> entries;
+        {
+            std::lock_guard<std::mutex> guard(g_mutex);
+            entries.reserve(g_splits.size());
+
+            g_splits.for_each([&](uint64_t, const split_context &split)
+            {
+                entries.emplace_back();
+                auto &&entry = entries.back();
+
+                entry.gva = split.gva;
+                entry.cr3 = split.cr3;
+                entry.d_pa = split.d_pa;
+                entry.num_hooks = split.num_hooks;
+                entry.active = split.active;
+
+                if (const auto &&cr3s = split.cr3s.get())
+                {
+                    for (const auto &cr3 : *cr3s)
+                    {
+                        if (cr3 != cr3_base(split.cr3))
+                            entry.cr3s.push_back(cr3);
+                    }
+                }
+
+                const auto &&vmm_data = bfn::make_unique_map_x64<uint8_t>(split.d_pa);
+                entry.diff(vmm_data.get(), split.c_page.get());
+            });
+        }
+
+        std::vector<uint8_t> snapshot;
+        pack_split_snapshot(entries, snapshot);
+
+        log_debug(log_export_splits, entries.size(), snapshot.size());
+
+        if (snapshot.size() > out_size)
+            return snapshot.size();
+
+        auto &&omap = bfn::make_unique_map_x64<uint8_t>(out_addr, vmcs::guest_cr3::get(), snapshot.size(), vmcs::guest_ia32_pat::get());
+        std::memcpy(omap.get(), snapshot.data(), snapshot.size());
+
+        return snapshot.size();
+    }
+
+    /// Re-installs the splits of a snapshot taken by export_splits()
+    ///
+    /// The guest keeps running while the VMM is restarted, so its page
+    /// tables usually still map every split to the data page it had. A
+    /// split is skipped if its address no longer translates to that page
+    /// (the address space is gone, or the page moved), or if the page is
+    /// split already. All others are created with their code pages,
+    /// enabled in the same address spaces and activated if they were
+    /// active, and the EPT is flushed once at the end.
+    ///
+    /// @expects in_addr != 0
+    /// @expects in_size >= 1 && in_size <= max_split_snapshot
+    ///
+    /// @param in_addr the guest virtual address of the snapshot
+    /// @param in_size the size of the snapshot in bytes
+    ///
+    /// @return the number of splits that were re-installed
+    ///
+    size_t
+    import_splits(const int_t in_addr, const size_t in_size)
+    {
+        expects(in_addr != 0);
+        expects(in_size >= 1 && in_size <= max_split_snapshot);
+
+        std::vector<split_snapshot_entry> entries;
+        {
+            auto &&buffer = bfn::make_unique_map_x64<uint8_t>(in_addr, vmcs::guest_cr3::get(), in_size, vmcs::guest_ia32_pat::get());
+            if (!unpack_split_snapshot(buffer.get(), in_size, entries))
+            {
+                bfwarning << "import_splits: unsupported or malformed snapshot" << bfendl;
+                return 0;
+            }
+        }
+
+        log_debug(log_import_splits, entries.size());
+
+        const auto &&mask_4k = ~(ept::pt::size_bytes - 1);
+        std::unique_ptr<uint8_t[]> contents(new uint8_t[ept::pt::size_bytes]);
+
+        // The entries are sorted by data page, but usually come from a
+        // handful of address spaces, so the walker is only replaced when
+        // the address space changes.
+        std::unique_ptr<guest_page_walker> walker;
+        int_t walker_cr3 = 0;
+
+        ept_flush_batch batch(this);
+
+        size_t num_imported = 0;
+        for (const auto &entry : entries)
+        {
+            if (g_splits.find(pfn_4k(entry.d_pa)) != nullptr)
+            {
+                log_debug(log_import_already_split, entry.d_pa);
+                continue;
+            }
+
+            if (!walker || walker_cr3 != entry.cr3)
+            {
+                walker = std::make_unique<guest_page_walker>(entry.cr3);
+                walker_cr3 = entry.cr3;
+            }
+
+            const auto &&d_pa = walker->translate(entry.gva & mask_4k);
+            if (d_pa == 0 || d_pa != entry.d_pa)
+            {
+                log_debug(log_import_moved, entry.gva, entry.d_pa);
+                continue;
+            }
+
+            {
+                const auto &&vmm_data = bfn::make_unique_map_x64<uint8_t>(d_pa);
+                std::memcpy(contents.get(), vmm_data.get(), ept::pt::size_bytes);
+            }
+
+            entry.patch(contents.get());
+
+            if (create_split_context_pa(entry.gva, d_pa, entry.cr3, contents.get()) != 1)
+                continue;
+
+            {
+                std::lock_guard<std::mutex> guard(g_mutex);
+
+                // Another vCPU may have deactivated the split in the
+                // meantime.
+                const auto &&split = g_splits.find(pfn_4k(d_pa));
+                if (split == nullptr)
+                {
+                    log_debug(log_import_deactivated, d_pa);
+                    continue;
+                }
+
+                split->num_hooks = std::max<size_t>(entry.num_hooks, 1);
+                for (const auto &cr3 : entry.cr3s)
+                {
+                    if (!split_applies_to(*split, cr3))
+                        enable_split_in(*split, cr3);
+                }
+            }
+
+            if (entry.active && activate_split_pa(d_pa) != 1)
+                continue;
+
+            num_imported++;
+        }
+
+        return num_imported;
+    }
+
+    /// Executes an array of split operations in one VMCALL
+    ///
+    /// Supported methods are create_split_context (1), activate_split (2),
+    /// deactivate_split (3), is_split (5) and write_to_c_page (6). Each
+    /// operation's result is written to its <status> field; unsupported
+    /// methods get -1u and operations that throw get 0. A failing
+    /// operation doesn't stop the batch. The EPT is flushed once, after
+    /// the last operation.
+    ///
+    /// @expects ops_addr != 0
+    /// @expects num_ops >= 1 && num_ops <= max_split_ops
+    ///
+    /// @param ops_addr the guest virtual address of the split_op array
+    /// @param num_ops the number of entries in the array
+    ///
+    /// @return 1 (the per-operation results are in the array)
+    ///
+    int
+    batch_split_ops(const int_t ops_addr, const size_t num_ops)
+    {
+        expects(ops_addr != 0);
+        expects(num_ops >= 1 && num_ops <= max_split_ops);
+
+        log_debug(log_batch_split_ops, num_ops);
+
+        // Map the operations (and their status fields) once.
+        auto &&ops = bfn::make_unique_map_x64<split_op>(ops_addr, vmcs::guest_cr3::get(), num_ops * sizeof(split_op), vmcs::guest_ia32_pat::get());
+
+        ept_flush_batch batch(this);
+        for (size_t i = 0; i < num_ops; i++)
+        {
+            auto &&op = ops.get()[i];
+
+            try
+            {
+                switch (op.method)
+                {
+                    case 1:
+                        op.status = static_cast<uintptr_t>(create_split_context(op.args[0]));
+                        break;
+                    case 2:
+                        op.status = static_cast<uintptr_t>(activate_split(op.args[0]));
+                        break;
+                    case 3:
+                        op.status = static_cast<uintptr_t>(deactivate_split(op.args[0]));
+                        break;
+                    case 5:
+                        op.status = static_cast<uintptr_t>(is_split(op.args[0]));
+                        break;
+                    case 6:
+                        op.status = static_cast<uintptr_t>(write_to_c_page(op.args[0], op.args[1], op.args[2]));
+                        break;
+                    default:
+                        op.status = -1u;
+                        break;
+                }
+            }
+            catch (std::exception &e)
+            {
+                bfwarning << "batch_split_ops: operation " << i << " failed: " << e.what() << bfendl;
+                op.status = 0;
+            }
+        }
+
+        return 1;
+    }
+
     /// Returns the number of elements in the flip log.
     ///
+    /// Merges the flip logs of all vCPUs into a snapshot, which the next
+    /// get_flip_data() hands out. That way the size returned here and the
+    /// data copied later always match.
+    ///
+    /// A flip is recorded in the log before it's pushed to the flip ring,
+    /// so the snapshot contains every event up to <ring_head>. A monitor
+    /// that reads both skips those events in the ring. Flips that other
+    /// vCPUs record while the logs are merged may still end up in both.
+    ///
+    /// @param ring_head set to the head of the flip ring (the <seq> of the
+    ///     latest event) before the snapshot was taken
+    ///
     size_t
-    get_flip_num()
+    get_flip_num(uintptr_t &ring_head)
     {
         std::lock_guard<std::mutex> flip_guard(g_flip_mutex);
-        return g_flip_log.size();
+
+        ring_head = g_flip_ring.head();
+        flip_log::merge(g_flip_logs, g_flip_snapshot);
+        g_flip_snapshot_valid = true;
+
+        return g_flip_snapshot.size();
     }
 
     /// Writes the flip data to the passed <out_addr>.
     ///
+    /// Uses the snapshot taken by the preceding get_flip_num(), or takes a
+    /// new one if there is none.
+    ///
     /// @expects out_addr != 0
     /// @expects out_size != 0
     ///
@@ -931,27 +2590,166 @@ private:
 
         std::lock_guard<std::mutex> flip_guard(g_flip_mutex);
 
+        if (!g_flip_snapshot_valid)
+            flip_log::merge(g_flip_logs, g_flip_snapshot);
+
         // Map the required memory.
         auto &&omap = bfn::make_unique_map_x64<char>(out_addr, vmcs::guest_cr3::get(), out_size, vmcs::guest_ia32_pat::get());
 
-        // Copy the flip data to the mapped memory region.
-        std::memmove(omap.get(), g_flip_log.data(), out_size);
+        // Copy the flip data to the mapped memory region. Never read past
+        // the end of the snapshot.
+        const auto &&log_size = g_flip_snapshot.size() * sizeof(flip_data);
+        std::memmove(omap.get(), g_flip_snapshot.data(), std::min<size_t>(out_size, log_size));
 
+        g_flip_snapshot_valid = false;
         return 1;
     }
 
+    /// Writes the flip data to the passed <out_addr>, packed (see
+    /// flip_wire.h).
+    ///
+    /// Uses the snapshot taken by the preceding get_flip_num(), or takes a
+    /// new one if there is none. If the packed records don't fit into
+    /// <out_size>, nothing is written and the snapshot is kept, so the
+    /// caller can retry with a bigger buffer.
+    ///
+    /// @expects out_addr != 0
+    ///
+    /// @return the size of the packed records in bytes
+    ///
+    size_t
+    get_flip_data_packed(const int_t out_addr, const int_t out_size)
+    {
+        expects(out_addr != 0);
+
+        std::lock_guard<std::mutex> flip_guard(g_flip_mutex);
+
+        if (!g_flip_snapshot_valid)
+            flip_log::merge(g_flip_logs, g_flip_snapshot);
+
+        // The merged counters overestimate by at most the sum of the
+        // error bounds of the logs.
+        uint64_t error_bound = 0;
+        for (const auto &log : g_flip_logs)
+            error_bound += log->error_bound();
+
+        g_flip_packed.clear();
+        pack_flips(g_flip_snapshot, error_bound, g_flip_packed);
+
+        if (g_flip_packed.size() > out_size)
+        {
+            g_flip_snapshot_valid = true;
+            return g_flip_packed.size();
+        }
+
+        auto &&omap = bfn::make_unique_map_x64<uint8_t>(out_addr, vmcs::guest_cr3::get(), g_flip_packed.size(), vmcs::guest_ia32_pat::get());
+        std::memcpy(omap.get(), g_flip_packed.data(), g_flip_packed.size());
+
+        g_flip_snapshot_valid = false;
+        return g_flip_packed.size();
+    }
+
     /// Clears the flip data log.
     ///
     int
     clear_flip_data()
     {
-        _bfdebug << "clear_flip_data: clearing flip data" << bfendl;
+        log_debug(log_clear_flip_data);
 
         std::lock_guard<std::mutex> flip_guard(g_flip_mutex);
-        g_flip_log.clear();
+
+        for (const auto &log : g_flip_logs)
+            log->request_clear();
+
+        // This VMCALL runs on our own vCPU, so our log can be cleared
+        // right away. The other vCPUs catch up on their next flip.
+        m_flip_log.apply_requests();
+
+        g_flip_snapshot_valid = false;
         return 1;
     }
 
+    /// Registers a ring that flip events are streamed into
+    ///
+    /// From now on, every flip is also appended to the ring as a
+    /// flip_event, until the ring is unregistered. The ring lives in VMM
+    /// memory, and the guest drains it with read_flip_ring(). Registering
+    /// again replaces the ring (and whatever events are still in it).
+    ///
+    /// @param capacity the number of records the ring should hold (rounded
+    ///     down to a power of two, at most flip_ring::max_capacity)
+    ///
+    /// @return the ring's capacity (in records), 0 on failure
+    ///
+    size_t
+    register_flip_ring(const size_t capacity)
+    {
+        if (flip_ring::capacity_for(capacity) == 0)
+        {
+            bfwarning << "register_flip_ring: invalid capacity: " << capacity << bfendl;
+            return 0;
+        }
+
+        std::lock_guard<std::mutex> flip_guard(g_flip_mutex);
+
+        // Replace a previously registered ring.
+        g_flip_ring.detach();
+        if (!g_flip_ring.attach(capacity))
+        {
+            bfwarning << "register_flip_ring: failed to allocate ring with " << capacity << " records" << bfendl;
+            return 0;
+        }
+
+        log_debug(log_register_flip_ring, g_flip_ring.capacity());
+        return g_flip_ring.capacity();
+    }
+
+    /// Unregisters (and frees) the flip ring (if any)
+    ///
+    /// @return 1
+    ///
+    int
+    unregister_flip_ring()
+    {
+        std::lock_guard<std::mutex> flip_guard(g_flip_mutex);
+
+        g_flip_ring.detach();
+
+        log_debug(log_unregister_flip_ring);
+        return 1;
+    }
+
+    /// Moves the published events of the flip ring, oldest first, to the
+    /// passed <out_addr>
+    ///
+    /// Events that don't fit stay in the ring for the next call.
+    ///
+    /// @expects out_addr != 0
+    ///
+    /// @param out_addr the guest virtual address of an array of flip_event
+    /// @param out_size the size of the array in bytes
+    /// @param dropped set to the number of events dropped so far because
+    ///     the ring was full
+    ///
+    /// @return the number of events written
+    ///
+    size_t
+    read_flip_ring(const int_t out_addr, const int_t out_size, uintptr_t &dropped)
+    {
+        expects(out_addr != 0);
+
+        std::lock_guard<std::mutex> flip_guard(g_flip_mutex);
+
+        dropped = g_flip_ring.dropped();
+
+        const auto max = std::min<uint64_t>(g_flip_ring.pending(), out_size / sizeof(flip_event));
+        if (max == 0)
+            return 0;
+
+        auto &&omap = bfn::make_unique_map_x64<flip_event>(out_addr, vmcs::guest_cr3::get(), max * sizeof(flip_event), vmcs::guest_ia32_pat::get());
+        return g_flip_ring.read(omap.get(), max);
+    }
+
     /// Remove an entry from the flip data log by
     /// providing a RIP address.
     ///
@@ -964,19 +2762,144 @@ private:
     {
         expects(rip != 0);
 
-        _bfdebug << "remove_flip_entry: removing flip entry for: " << hex_out_s(rip) << bfendl;
+        log_debug(log_remove_flip_entry, rip);
 
         std::lock_guard<std::mutex> flip_guard(g_flip_mutex);
 
-        // Find relevant entry/entries by provided RIP address.
-        auto &&vec = g_flip_log; // Shorter name.
-        vec.erase(std::remove_if(vec.begin(), vec.end(), [&rip](const flip_data &o)
-        {
-            return o.rip == rip;
-        }), vec.end());
+        // Remove relevant entry/entries by provided RIP address.
+        for (const auto &log : g_flip_logs)
+            log->request_remove(rip);
 
+        m_flip_log.apply_requests();
+
+        g_flip_snapshot_valid = false;
         return 1;
     }
+
+    /// Writes the exit statistics of all vCPUs to the passed <out_addr>.
+    ///
+    /// The buffer receives an exit_stats_header, followed by one
+    /// vcpu_exit_stats record per vCPU, as many as fit into <out_size>.
+    ///
+    /// @expects out_addr != 0
+    ///
+    /// @return the number of vCPUs (which may be more than the number of
+    ///         records written), 0 if the buffer can't hold the header
+    ///
+    size_t
+    get_exit_stats(const int_t out_addr, const int_t out_size)
+    {
+        expects(out_addr != 0);
+
+        if (out_size < sizeof(exit_stats_header))
+            return 0;
+
+        std::lock_guard<std::mutex> stats_guard(g_stats_mutex);
+
+        const auto &&fit = (out_size - sizeof(exit_stats_header)) / sizeof(vcpu_exit_stats);
+        const auto num_vcpus = std::min<size_t>(fit, g_exit_stats.size());
+        const auto &&size = sizeof(exit_stats_header) + num_vcpus * sizeof(vcpu_exit_stats);
+
+        auto &&omap = bfn::make_unique_map_x64<uint8_t>(out_addr, vmcs::guest_cr3::get(), size, vmcs::guest_ia32_pat::get());
+
+        exit_stats_header header;
+        header.version = exit_stats_version;
+        header.num_kinds = num_exit_kinds;
+        header.num_buckets = exit_stats_buckets;
+        header.num_vcpus = num_vcpus;
+        std::memcpy(omap.get(), &header, sizeof(header));
+
+        auto &&records = omap.get() + sizeof(header);
+        for (size_t i = 0; i < num_vcpus; i++)
+        {
+            vcpu_exit_stats record;
+            record.vcpuid = g_exit_stats[i].first;
+            g_exit_stats[i].second->snapshot(record);
+
+            std::memcpy(records + i * sizeof(record), &record, sizeof(record));
+        }
+
+        return g_exit_stats.size();
+    }
+
+    /// Formats the pending debug events of all vCPUs, oldest first, and
+    /// writes them as text to the passed <out_addr>.
+    ///
+    /// Events that don't fit stay pending for the next call. If events
+    /// were overwritten before they could be read, the text starts with a
+    /// line saying how many.
+    ///
+    /// @expects out_addr != 0
+    ///
+    /// @return the number of bytes written (the text isn't terminated),
+    ///         0 if there was nothing to read
+    ///
+    size_t
+    read_event_log(const int_t out_addr, const int_t out_size)
+    {
+        expects(out_addr != 0);
+
+        std::lock_guard<std::mutex> event_guard(g_event_mutex);
+
+        // Collect the pending events of all logs.
+        std::vector<std::pair<event_log *, log_event>> events;
+        uint64_t lost = 0;
+
+        for (const auto &log : g_event_logs)
+        {
+            const auto &&head = log->head();
+            if (head - log->tail > event_log::capacity)
+            {
+                lost += head - log->tail - event_log::capacity;
+                log->tail = head - event_log::capacity;
+            }
+
+            for (auto pos = log->tail; pos < head; pos++)
+            {
+                log_event event;
+                if (log->read(pos, event))
+                    events.emplace_back(log, event);
+                else
+                {
+                    // Overwritten while we were reading. So were the events
+                    // before it, even if we got to copy them.
+                    lost++;
+                    log->tail = pos + 1;
+                }
+            }
+        }
+
+        std::stable_sort(events.begin(), events.end(), [](const auto &lhs, const auto &rhs)
+        { return lhs.second.tsc < rhs.second.tsc; });
+
+        std::string text;
+        if (lost != 0)
+            text = std::to_string(lost) + " events lost\n";
+
+        std::string line;
+        for (const auto &entry : events)
+        {
+            if (entry.second.seq <= entry.first->tail)
+                continue;
+
+            line.clear();
+            format_log_event(entry.second, line);
+
+            if (text.size() + line.size() > out_size)
+                break;
+
+            text += line;
+            entry.first->tail = entry.second.seq;
+        }
+
+        if (text.empty() || text.size() > out_size)
+            return 0;
+
+        auto &&omap = bfn::make_unique_map_x64<char>(out_addr, vmcs::guest_cr3::get(), text.size(), vmcs::guest_ia32_pat::get());
+        std::memcpy(omap.get(), text.data(), text.size());
+
+        return text.size();
+    }
 };
 
 #endif
@@ -0,0 +1,15 @@
+#ifndef TSC_H
+#define TSC_H
+
+#include <cstdint>
+
+/// Reads the time stamp counter
+///
+/// Not serializing, which is fine for the timestamps and latencies we
+/// collect on the exit path.
+///
+inline uint64_t
+read_tsc() noexcept
+{ return __builtin_ia32_rdtsc(); }
+
+#endif
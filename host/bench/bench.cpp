@@ -0,0 +1,394 @@
+#include <host_vcpu.h>
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Microbenchmarks for the exit and VMCALL paths of tlb_handler, run on
+// the host (see host_stub.h).
+//
+// For each split count of the sweep, the splits are created, activated,
+// exercised with EPT violations and code page writes, and torn down
+// again, timing every step. The flip log is benchmarked separately for a
+// sweep of log sizes. Results are printed as CSV, one row per
+// measurement:
+//
+//   bench,mix,splits,flips,ops,ns_per_op
+//
+// <mix> is the access mix of violation rows and "-" otherwise, <flips> is
+// the number of flip log records the row ran with.
+
+namespace
+{
+    constexpr const uint64_t split_base = 0x10000000;
+    constexpr const uint64_t code_base = 0x08000000;
+    constexpr const uint64_t patch_base = 0x07000000;
+    constexpr const uint64_t out_base = 0x20000000;
+    constexpr const uint64_t snapshot_base = 0x40000000;
+    constexpr const uint64_t insn_size = 8;
+
+    constexpr const uint64_t access_read = 1;
+    constexpr const uint64_t access_write = 2;
+    constexpr const uint64_t access_exec = 4;
+
+    uint64_t gva_of(uint64_t i) { return split_base + i * 0x1000; }
+    uint64_t load_rip(uint64_t i) { return code_base + i * insn_size; }
+    uint64_t load_target(uint64_t i) { return gva_of(i) + ((i * insn_size) & 0xFF8); }
+
+    struct violation {
+        uint64_t vcpu;
+        uint64_t rip;
+        uint64_t gva;
+        uint64_t bits;
+    };
+
+    class xorshift
+    {
+    public:
+        uint64_t
+        operator()() noexcept
+        {
+            m_state ^= m_state << 13;
+            m_state ^= m_state >> 7;
+            m_state ^= m_state << 17;
+            return m_state;
+        }
+
+    private:
+        uint64_t m_state = 0x2545F4914F6CDD1DULL;
+    };
+
+    using clock = std::chrono::steady_clock;
+
+    double
+    ns_since(const clock::time_point &start)
+    { return std::chrono::duration<double, std::nano>(clock::now() - start).count(); }
+
+    void
+    report(const char *bench, const char *mix, uint64_t splits, uint64_t flips, uint64_t ops, double ns)
+    {
+        if (ops == 0)
+            return;
+
+        std::printf("%s,%s,%llu,%llu,%llu,%.1f\n", bench, mix,
+                    static_cast<unsigned long long>(splits), static_cast<unsigned long long>(flips),
+                    static_cast<unsigned long long>(ops), ns / static_cast<double>(ops));
+        std::fflush(stdout);
+    }
+
+    void
+    check(bool ok, const char *what)
+    {
+        if (!ok)
+            throw std::runtime_error(std::string("unexpected result: ") + what);
+    }
+}
+
+class bench
+{
+public:
+
+    bench(uint64_t vcpus, uint64_t violations)
+        : m_violations(violations)
+    {
+        for (uint64_t id = 0; id < vcpus; id++)
+            m_vcpus.push_back(std::make_unique<host::vcpu>(id));
+    }
+
+    /// Splits sweep: create, activate, violations, writes, teardown
+    ///
+    void
+    run_splits(const uint64_t splits)
+    {
+        auto &&vcpu = *m_vcpus[0];
+
+        // Distinct page contents (so no code pages are shared), and a
+        // mov eax, [rip + disp32] per split in the code area.
+        for (uint64_t i = 0; i < splits; i++)
+        {
+            std::memcpy(host::mem().at(host::translate(gva_of(i), vcpu.fields().guest_cr3)), &i, sizeof(i));
+
+            const auto &&disp = static_cast<uint32_t>(load_target(i) - (load_rip(i) + 6));
+            const uint8_t insn[insn_size] = {
+                0x8B, 0x05,
+                static_cast<uint8_t>(disp), static_cast<uint8_t>(disp >> 8),
+                static_cast<uint8_t>(disp >> 16), static_cast<uint8_t>(disp >> 24),
+                0x90, 0x90
+            };
+
+            std::memcpy(host::mem().at(host::translate(load_rip(i), vcpu.fields().guest_cr3)), insn, sizeof(insn));
+        }
+
+        auto &&start = clock::now();
+        for (uint64_t i = 0; i < splits; i++)
+            check(vcpu.vmcall(1, gva_of(i)) == 1, "create_split_context");
+        report("create_split_context", "-", splits, 0, splits, ns_since(start));
+
+        start = clock::now();
+        for (uint64_t i = 0; i < splits; i++)
+            check(vcpu.vmcall(2, gva_of(i)) == 1, "activate_split");
+        report("activate_split", "-", splits, 0, splits, ns_since(start));
+
+        m_on_code.assign(splits * m_vcpus.size(), true);
+
+        run_violations("read", splits, 0, 100);
+        run_violations("mixed", splits, 0, 90);
+        run_violations("write_exec", splits, 0, 0);
+
+        run_write_to_c_page(splits);
+
+        check(vcpu.vmcall(9) == 1, "clear_flip_data");
+
+        // Snapshot of the splits (with their patched code pages), for the
+        // import after the teardown.
+        start = clock::now();
+        const auto &&snapshot_size = vcpu.vmcall(19, snapshot_base, 0);
+        check(vcpu.vmcall(19, snapshot_base, snapshot_size) == snapshot_size, "export_splits");
+        report("export_splits", "-", splits, 0, splits, ns_since(start));
+
+        const auto &&half = (splits + 1) / 2;
+
+        start = clock::now();
+        for (uint64_t i = 0; i < half; i++)
+            check(vcpu.vmcall(3, gva_of(i)) == 1, "deactivate_split");
+        report("deactivate_split", "-", splits, 0, half, ns_since(start));
+
+        start = clock::now();
+        vcpu.vmcall(4);
+        report("deactivate_all_splits", "-", splits, 0, splits - half, ns_since(start));
+
+        check(g_splits.size() == 0, "splits left after teardown");
+
+        size_t num_2m_splits = 0;
+        g_2m_pages.for_each([&](uint64_t, const page_2m_context &page) { num_2m_splits += page.num_splits; });
+        check(num_2m_splits == 0, "2m ranges with splits left after teardown");
+
+        // The same splits again, re-installed from the snapshot.
+        start = clock::now();
+        check(vcpu.vmcall(20, snapshot_base, snapshot_size) == splits, "import_splits");
+        report("import_splits", "-", splits, 0, splits, ns_since(start));
+
+        vcpu.vmcall(4);
+        check(g_splits.size() == 0, "splits left after teardown");
+
+        // The same splits again, created and activated a range at a time.
+        start = clock::now();
+        for (uint64_t i = 0; i < splits; i += max_split_range / 0x1000)
+        {
+            const auto pages = std::min<uint64_t>(splits - i, max_split_range / 0x1000);
+            check(vcpu.vmcall(17, gva_of(i), pages * 0x1000) == pages, "create_split_range");
+        }
+        report("create_split_range", "-", splits, 0, splits, ns_since(start));
+
+        vcpu.vmcall(4);
+        check(g_splits.size() == 0, "splits left after teardown");
+    }
+
+    /// Flip log sweep: violations and get_flip_data with <flips> records
+    ///
+    void
+    run_flips(const uint64_t flips)
+    {
+        constexpr const uint64_t splits = 16;
+        auto &&vcpu = *m_vcpus[0];
+
+        for (uint64_t i = 0; i < splits; i++)
+        {
+            check(vcpu.vmcall(1, gva_of(i)) == 1, "create_split_context");
+            check(vcpu.vmcall(2, gva_of(i)) == 1, "activate_split");
+        }
+
+        m_on_code.assign(splits * m_vcpus.size(), true);
+
+        // The writes come from <flips> different RIPs, so the log ends up
+        // with <flips> records, plus one exec flip site per split.
+        run_violations("write_exec", splits, flips, 0);
+
+        const auto &&records = vcpu.vmcall(7);
+        const auto iterations = std::max<uint64_t>(10, 1000000 / std::max<uint64_t>(records, 1));
+
+        auto &&start = clock::now();
+        for (uint64_t i = 0; i < iterations; i++)
+        {
+            const auto &&num = vcpu.vmcall(7);
+            check(vcpu.vmcall(8, out_base, std::max<uint64_t>(num, 1) * sizeof(flip_data)) == 1, "get_flip_data");
+        }
+        report("get_flip_data", "-", splits, records, iterations, ns_since(start));
+
+        start = clock::now();
+        for (uint64_t i = 0; i < iterations; i++)
+        {
+            const auto &&num = vcpu.vmcall(7);
+            check(vcpu.vmcall(16, out_base, std::max<uint64_t>(num, 1) * sizeof(flip_data)) != 0, "get_flip_data_packed");
+        }
+        report("get_flip_data_packed", "-", splits, records, iterations, ns_since(start));
+
+        check(vcpu.vmcall(9) == 1, "clear_flip_data");
+        vcpu.vmcall(4);
+    }
+
+private:
+
+    /// Runs EPT violations against random splits on random vCPUs
+    ///
+    /// Only accesses that fault in the current state of the vCPU's view
+    /// are generated: on the code page, <read_pct> percent are (emulated)
+    /// reads and the rest writes; on the data page, the access is an
+    /// instruction fetch.
+    ///
+    /// @param rips if not 0, the number of different RIPs the writes
+    ///     cycle through
+    ///
+    void
+    run_violations(const char *mix, const uint64_t splits, const uint64_t rips, const uint64_t read_pct)
+    {
+        std::vector<violation> events;
+        events.reserve(m_violations);
+
+        xorshift rand;
+        const auto &&vcpus = m_vcpus.size();
+        uint64_t writes = 0;
+
+        for (uint64_t n = 0; n < m_violations; n++)
+        {
+            const auto &&r = rand();
+            const auto &&v = (r >> 48) % vcpus;
+            const auto &&i = (r >> 8) % splits;
+
+            auto &&on_code = m_on_code[v * splits + i];
+            if (!on_code)
+            {
+                events.push_back({v, gva_of(i) + 0x10, gva_of(i) + 0x10, access_exec});
+                on_code = true;
+            }
+            else if (r % 100 < read_pct)
+                events.push_back({v, load_rip(i), load_target(i), access_read});
+            else
+            {
+                const auto &&rip = rips != 0 ? load_rip(writes++ % rips) : load_rip(i);
+                events.push_back({v, rip, load_target(i), access_write});
+                on_code = false;
+            }
+        }
+
+        auto &&start = clock::now();
+        for (const auto &e : events)
+            m_vcpus[e.vcpu]->ept_violation(e.rip, e.gva, e.bits);
+        report("ept_violation", mix, splits, m_vcpus[0]->vmcall(7), events.size(), ns_since(start));
+    }
+
+    /// Patches 16 bytes at random offsets of random splits
+    ///
+    void
+    run_write_to_c_page(const uint64_t splits)
+    {
+        auto &&vcpu = *m_vcpus[0];
+        const auto ops = std::min<uint64_t>(m_violations / 10, 100000);
+
+        std::vector<std::pair<uint64_t, uint64_t>> writes;
+        writes.reserve(ops);
+
+        xorshift rand;
+        for (uint64_t n = 0; n < ops; n++)
+        {
+            const auto &&r = rand();
+            writes.emplace_back(patch_base + (r & 0xFF0), gva_of((r >> 16) % splits) + ((r >> 8) & 0xFE0));
+        }
+
+        auto &&start = clock::now();
+        for (const auto &w : writes)
+            check(vcpu.vmcall(6, w.first, w.second, 16) == 1, "write_to_c_page");
+        report("write_to_c_page", "-", splits, 0, writes.size(), ns_since(start));
+
+        // The same patches, 16 per transaction.
+        constexpr const uint64_t per_transaction = 16;
+        constexpr const uint64_t record_size = sizeof(patch_header) + 16;
+
+        std::vector<uint8_t> records(per_transaction * record_size);
+        uint64_t transactions = 0;
+
+        start = clock::now();
+        for (uint64_t n = 0; n + per_transaction <= writes.size(); n += per_transaction)
+        {
+            for (uint64_t i = 0; i < per_transaction; i++)
+            {
+                patch_header header;
+                header.to_va = writes[n + i].second;
+                header.size = 16;
+                std::memcpy(records.data() + i * record_size, &header, sizeof(header));
+            }
+
+            host::copy_guest(out_base, vcpu.fields().guest_cr3, records.data(), records.size(), true);
+            check(vcpu.vmcall(18, out_base, records.size()) == per_transaction, "apply_patches");
+            transactions++;
+        }
+        report("apply_patches", "-", splits, 0, transactions * per_transaction, ns_since(start));
+    }
+
+    uint64_t m_violations;
+    std::vector<std::unique_ptr<host::vcpu>> m_vcpus;
+
+    // Per vCPU and split: true while the split is on the code page.
+    std::vector<bool> m_on_code;
+};
+
+static void
+print_usage()
+{
+    std::cout << "Usage: bench [--quick] [--vcpus <n>] [--violations <n>]" << std::endl
+              << std::endl
+              << "  --quick: sweep up to 1000 splits and 1000 flip records only" << std::endl
+              << "  --vcpus: number of vCPUs the violations are spread over (default 1)" << std::endl
+              << "  --violations: number of EPT violations per measurement (default 1000000)" << std::endl;
+}
+
+int
+main(int argc, const char *argv[])
+{
+    auto quick = false;
+    uint64_t vcpus = 1;
+    uint64_t violations = 1000000;
+
+    try
+    {
+        for (auto i = 1; i < argc; i++)
+        {
+            const std::string arg = argv[i];
+
+            if (arg == "--quick")
+                quick = true;
+            else if (arg == "--vcpus" && i + 1 < argc)
+                vcpus = std::stoull(argv[++i], nullptr, 0);
+            else if (arg == "--violations" && i + 1 < argc)
+                violations = std::stoull(argv[++i], nullptr, 0);
+            else
+            {
+                print_usage();
+                return arg == "--help" || arg == "-h" ? 0 : 1;
+            }
+        }
+
+        if (vcpus == 0 || violations == 0)
+            throw std::runtime_error("need at least one vCPU and one violation");
+
+        const auto &&max = quick ? 1000ULL : 100000ULL;
+
+        bench b(vcpus, violations);
+        std::printf("bench,mix,splits,flips,ops,ns_per_op\n");
+
+        for (uint64_t splits = 1; splits <= max; splits *= 10)
+            b.run_splits(splits);
+
+        for (uint64_t flips = 1; flips <= max; flips *= 10)
+            b.run_flips(flips);
+    }
+    catch (std::exception &e)
+    {
+        std::cerr << "error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,797 @@
+#ifndef HOST_STUB_H
+#define HOST_STUB_H
+
+// Host stand-ins for the parts of the Bareflank hypervisor and the
+// Extended APIs that the tlb_split module uses.
+//
+// Everything the module touches is modelled just closely enough to run
+// tlb_handler unmodified in a normal process: guest memory is a sparse
+// set of 2m chunks, EPT is a map of page entries, the VMCS is a plain
+// struct per vCPU, and the VMX instructions only count how often they
+// were issued. The forwarding headers next to this file mirror the
+// include paths of the real interfaces, so the module's headers compile
+// without changes.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <array>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// -----------------------------------------------------------------------------
+// Debugging
+// -----------------------------------------------------------------------------
+
+namespace host
+{
+    class null_buffer : public std::streambuf
+    {
+    public:
+        int overflow(int c) override
+        { return c; }
+    };
+
+    /// Set to true to see the module's debug output on stderr.
+    ///
+    inline bool &
+    verbose() noexcept
+    {
+        static bool s_verbose = false;
+        return s_verbose;
+    }
+
+    inline std::ostream &
+    log_stream()
+    {
+        static null_buffer s_null_buffer;
+        static std::ostream s_null(&s_null_buffer);
+
+        return verbose() ? std::clog : s_null;
+    }
+}
+
+#define bfcolor_func ""
+#define bfcolor_end ""
+#define bfcolor_error ""
+#define bfendl std::endl
+#define bfdebug host::log_stream() << "DEBUG: "
+#define bfinfo host::log_stream() << "INFO: "
+#define bfwarning host::log_stream() << "WARNING: "
+#define bferror host::log_stream() << "ERROR: "
+
+// -----------------------------------------------------------------------------
+// Contracts / Bit Manipulation
+// -----------------------------------------------------------------------------
+
+#define expects(cond) \
+    if (!(cond)) throw std::logic_error("expects failed: " #cond)
+#define ensures(cond) \
+    if (!(cond)) throw std::logic_error("ensures failed: " #cond)
+
+template<class T, class M>
+auto
+set_bits(T t, M m, T v) noexcept
+{ return (t & ~static_cast<T>(m)) | (v & static_cast<T>(m)); }
+
+template<class T, class M>
+auto
+get_bits(T t, M m) noexcept
+{ return t & static_cast<T>(m); }
+
+template<class T, class B>
+auto
+is_bit_set(T t, B b) noexcept
+{ return (t & (static_cast<T>(1) << b)) != 0; }
+
+namespace gsl
+{
+    template<class T> using not_null = T;
+}
+
+// -----------------------------------------------------------------------------
+// vCPU / VMCall Interface
+// -----------------------------------------------------------------------------
+
+#define VMCALL_REGISTERS 2
+#define VMCALL_MAGIC_NUMBER 0xB045EACDACD52E22
+
+struct vmcall_registers_t
+{
+    uintptr_t r00, r01, r02, r03, r04, r05, r06, r07;
+    uintptr_t r08, r09, r10, r11, r12, r13, r14, r15;
+};
+
+namespace vcpuid
+{
+    using type = uint64_t;
+}
+
+struct state_save_intel_x64
+{
+    uint64_t rax, rbx, rcx, rdx, rbp, rsi, rdi;
+    uint64_t r08, r09, r10, r11, r12, r13, r14, r15;
+    uint64_t rip, rsp;
+    uint64_t vcpuid;
+};
+
+// -----------------------------------------------------------------------------
+// Guest Memory
+// -----------------------------------------------------------------------------
+
+namespace host
+{
+    /// Guest Memory
+    ///
+    /// Sparse guest physical memory, allocated (zeroed) in 2m chunks on
+    /// first touch. Ranges inside a chunk are contiguous on the host too,
+    /// so most mappings can alias guest memory directly.
+    ///
+    class guest_memory
+    {
+    public:
+
+        static constexpr const uint64_t chunk_size = 0x200000;
+
+        uint8_t *
+        at(const uint64_t pa)
+        {
+            auto &&chunk = m_chunks[pa & ~(chunk_size - 1)];
+            if (!chunk)
+                chunk.reset(static_cast<uint8_t *>(std::calloc(chunk_size, 1)));
+
+            if (!chunk)
+                throw std::bad_alloc();
+
+            return chunk.get() + (pa & (chunk_size - 1));
+        }
+
+        /// Returns true if [pa, pa + size) is contiguous on the host
+        ///
+        static bool
+        contiguous(const uint64_t pa, const uint64_t size) noexcept
+        { return (pa & (chunk_size - 1)) + size <= chunk_size; }
+
+    private:
+
+        struct chunk_deleter
+        {
+            void operator()(uint8_t *p) const noexcept
+            { std::free(p); }
+        };
+
+        std::unordered_map<uint64_t, std::unique_ptr<uint8_t, chunk_deleter>> m_chunks;
+    };
+
+    inline guest_memory &
+    mem()
+    {
+        static guest_memory s_mem;
+        return s_mem;
+    }
+
+    /// Guest paging
+    ///
+    /// By default, guest virtual addresses are identity mapped in every
+    /// address space. With separate address spaces, a virtual address
+    /// translates to (virt + cr3), so two address spaces only share pages
+    /// if the caller lines them up.
+    ///
+    inline bool &
+    separate_address_spaces() noexcept
+    {
+        static bool s_separate = false;
+        return s_separate;
+    }
+
+    inline uint64_t
+    translate(const uint64_t virt, const uint64_t cr3) noexcept
+    { return (virt + (separate_address_spaces() ? (cr3 & ~0xFFFULL) : 0)) & 0xFFFFFFFFFFULL; }
+
+    /// Copies between the guest virtual range at <virt> and <buf>
+    ///
+    inline void
+    copy_guest(const uint64_t virt, const uint64_t cr3, uint8_t *buf, const uint64_t size, const bool to_guest)
+    {
+        for (uint64_t done = 0; done < size;)
+        {
+            const auto &&pa = translate(virt + done, cr3);
+            const auto len = std::min(size - done, 0x1000 - (pa & 0xFFF));
+
+            if (to_guest)
+                std::memcpy(mem().at(pa), buf + done, len);
+            else
+                std::memcpy(buf + done, mem().at(pa), len);
+
+            done += len;
+        }
+    }
+
+    inline uint64_t current_guest_cr3() noexcept;
+
+    /// Guest page tables
+    ///
+    /// Page tables that describe translate(), for code that walks them
+    /// (see guest_page_walker). They're made up whenever they are mapped:
+    /// the PML4 at the current guest CR3, and the tables below it in a
+    /// window of physical memory that guest memory doesn't reach. Identity
+    /// mapped address spaces use 1g pages, separate ones 4k pages.
+    ///
+    class guest_page_tables
+    {
+    public:
+
+        static constexpr const uint64_t window = 0x000F000000000000ULL;
+
+        /// Returns the table at <pa>, or nullptr if there is none
+        ///
+        uint64_t *
+        table(const uint64_t pa)
+        {
+            const auto &&cr3 = current_guest_cr3() & ~0xFFFULL;
+
+            table_id id;
+            if (cr3 != 0 && pa == cr3)
+                id = table_id{cr3, 0, 0};
+            else if (pa >= window && (pa - window) / 0x1000 < m_ids.size())
+                id = m_ids[(pa - window) / 0x1000];
+            else
+                return nullptr;
+
+            // Tables only change with the kind of address space.
+            auto &&table = m_tables[pa];
+            if (table.filled && table.separate == separate_address_spaces())
+                return table.entries.data();
+
+            table.filled = true;
+            table.separate = separate_address_spaces();
+
+            auto &&entries = table.entries;
+            const auto level = std::get<1>(id);
+            const auto &&shift = 39 - level * 9;
+
+            for (uint64_t i = 0; i < entries.size(); i++)
+            {
+                auto &&virt = std::get<2>(id) | (i << shift);
+                if (level == 0 && i >= 256)
+                    virt |= 0xFFFF000000000000ULL;
+
+                if (level == 3 || (level == 1 && !separate_address_spaces()))
+                    entries[i] = translate(virt, std::get<0>(id)) | (level == 1 ? 0x87 : 0x7);
+                else
+                    entries[i] = (window + child(table_id{std::get<0>(id), level + 1, virt}) * 0x1000) | 0x7;
+            }
+
+            return entries.data();
+        }
+
+    private:
+
+        // (cr3, level, first virtual address)
+        using table_id = std::tuple<uint64_t, uint64_t, uint64_t>;
+
+        uint64_t
+        child(const table_id &id)
+        {
+            auto &&index = m_index.emplace(id, m_ids.size());
+            if (index.second)
+                m_ids.push_back(id);
+
+            return index.first->second;
+        }
+
+        std::vector<table_id> m_ids;
+        std::map<table_id, uint64_t> m_index;
+        struct filled_table {
+            bool filled = false;
+            bool separate = false;
+            std::array<uint64_t, 512> entries;
+        };
+
+        std::unordered_map<uint64_t, filled_table> m_tables;
+    };
+
+    inline guest_page_tables &
+    page_tables()
+    {
+        static guest_page_tables s_tables;
+        return s_tables;
+    }
+}
+
+class memory_manager_x64
+{
+public:
+    uintptr_t
+    virtint_to_physint(uintptr_t virt) const noexcept
+    { return virt; }
+};
+
+inline memory_manager_x64 *
+g_mm_instance()
+{
+    static memory_manager_x64 s_mm;
+    return &s_mm;
+}
+
+#define g_mm g_mm_instance()
+
+namespace bfn
+{
+    /// Mapping of guest memory
+    ///
+    /// Aliases guest memory when the range is contiguous on the host.
+    /// Otherwise the range is copied into a bounce buffer, which is
+    /// written back when the mapping goes away.
+    ///
+    template<class T>
+    class unique_map_ptr_x64
+    {
+    public:
+
+        unique_map_ptr_x64() = default;
+
+        explicit unique_map_ptr_x64(T *ptr) noexcept
+            : m_ptr(ptr)
+        { }
+
+        unique_map_ptr_x64(uintptr_t virt, uintptr_t cr3, size_t size)
+            : m_virt(virt)
+            , m_cr3(cr3)
+            , m_bounce(size)
+        {
+            host::copy_guest(virt, cr3, m_bounce.data(), size, false);
+            m_ptr = reinterpret_cast<T *>(m_bounce.data());
+        }
+
+        ~unique_map_ptr_x64()
+        { reset(); }
+
+        unique_map_ptr_x64(unique_map_ptr_x64 &&other) noexcept
+        { *this = std::move(other); }
+
+        unique_map_ptr_x64 &
+        operator=(unique_map_ptr_x64 &&other) noexcept
+        {
+            if (this != &other)
+            {
+                reset();
+                std::swap(m_ptr, other.m_ptr);
+                std::swap(m_virt, other.m_virt);
+                std::swap(m_cr3, other.m_cr3);
+                std::swap(m_bounce, other.m_bounce);
+            }
+
+            return *this;
+        }
+
+        unique_map_ptr_x64(const unique_map_ptr_x64 &) = delete;
+        unique_map_ptr_x64 &operator=(const unique_map_ptr_x64 &) = delete;
+
+        T *get() const noexcept { return m_ptr; }
+        T *operator->() const noexcept { return m_ptr; }
+        T &operator[](size_t i) const noexcept { return m_ptr[i]; }
+        explicit operator bool() const noexcept { return m_ptr != nullptr; }
+
+        void
+        reset() noexcept
+        {
+            if (!m_bounce.empty())
+                host::copy_guest(m_virt, m_cr3, m_bounce.data(), m_bounce.size(), true);
+
+            m_ptr = nullptr;
+            m_bounce.clear();
+        }
+
+    private:
+
+        T *m_ptr = nullptr;
+        uintptr_t m_virt = 0;
+        uintptr_t m_cr3 = 0;
+        std::vector<uint8_t> m_bounce;
+    };
+
+    inline uintptr_t
+    virt_to_phys_with_cr3(uintptr_t virt, uintptr_t cr3)
+    { return host::translate(virt, cr3); }
+
+    template<class T>
+    unique_map_ptr_x64<T>
+    make_unique_map_x64(uintptr_t virt, uintptr_t cr3, size_t size, uint64_t pat = 0)
+    {
+        (void) pat;
+
+        const auto &&pa = host::translate(virt, cr3);
+        const auto &&last = host::translate(virt + size - 1, cr3);
+
+        if (host::guest_memory::contiguous(pa, size) && last == pa + size - 1)
+            return unique_map_ptr_x64<T>(reinterpret_cast<T *>(host::mem().at(pa)));
+
+        return unique_map_ptr_x64<T>(virt, cr3, size);
+    }
+
+    template<class T>
+    unique_map_ptr_x64<T>
+    make_unique_map_x64(uintptr_t phys)
+    {
+        if (auto &&table = host::page_tables().table(phys))
+            return unique_map_ptr_x64<T>(reinterpret_cast<T *>(table));
+
+        return unique_map_ptr_x64<T>(reinterpret_cast<T *>(host::mem().at(phys)));
+    }
+}
+
+// -----------------------------------------------------------------------------
+// EPT
+// -----------------------------------------------------------------------------
+
+namespace intel_x64
+{
+    namespace ept
+    {
+        namespace pt
+        {
+            constexpr const uintptr_t size_bytes = 0x1000;
+        }
+
+        namespace pd
+        {
+            constexpr const uintptr_t size_bytes = 0x200000;
+        }
+
+        namespace memory_attr
+        {
+            constexpr const uint64_t pt_wb = 0x37;
+        }
+    }
+}
+
+class ept_entry_intel_x64
+{
+public:
+
+    explicit ept_entry_intel_x64(uintptr_t *epte) noexcept
+        : m_epte(epte)
+    { }
+
+    uintptr_t *
+    epte() const noexcept
+    { return m_epte; }
+
+    uintptr_t
+    phys_addr() const noexcept
+    { return *m_epte & 0x000FFFFFFFFFF000ULL; }
+
+private:
+
+    uintptr_t *m_epte;
+};
+
+/// Root EPT
+///
+/// Keeps the leaf entries only: 2m entries by 2m frame and 4k entries by
+/// 4k frame. A 4k entry takes precedence over the 2m entry it lies in,
+/// like a page table below a (no longer large) PD entry would.
+///
+class root_ept_intel_x64
+{
+public:
+
+    root_ept_intel_x64()
+        : m_id(next_id()++)
+    { }
+
+    uint64_t
+    eptp() const noexcept
+    { return (m_id << 12) | 0x1E; }
+
+    void
+    setup_identity_map_2m(uintptr_t saddr, uintptr_t eaddr)
+    {
+        for (auto addr = saddr; addr < eaddr; addr += intel_x64::ept::pd::size_bytes)
+            m_2m[addr] = addr | 0x87;
+    }
+
+    void
+    setup_identity_map_4k(uintptr_t saddr, uintptr_t eaddr)
+    {
+        for (auto addr = saddr; addr < eaddr; addr += intel_x64::ept::pt::size_bytes)
+            m_4k[addr] = addr | 0x7;
+    }
+
+    void
+    unmap_identity_map_4k(uintptr_t saddr, uintptr_t eaddr)
+    {
+        for (auto addr = saddr; addr < eaddr; addr += intel_x64::ept::pt::size_bytes)
+            m_4k.erase(addr);
+    }
+
+    void
+    map_2m(uintptr_t virt, uintptr_t phys, uint64_t attr)
+    {
+        (void) attr;
+        m_2m[virt] = phys | 0x87;
+    }
+
+    void
+    unmap(uintptr_t virt)
+    { m_2m.erase(virt); }
+
+    ept_entry_intel_x64
+    gpa_to_epte(uintptr_t gpa)
+    {
+        auto &&entry_4k = m_4k.find(gpa & ~(intel_x64::ept::pt::size_bytes - 1));
+        if (entry_4k != m_4k.end())
+            return ept_entry_intel_x64(&entry_4k->second);
+
+        auto &&entry_2m = m_2m.find(gpa & ~(intel_x64::ept::pd::size_bytes - 1));
+        if (entry_2m != m_2m.end())
+            return ept_entry_intel_x64(&entry_2m->second);
+
+        throw std::runtime_error("gpa_to_epte: gpa is not mapped");
+    }
+
+private:
+
+    static uint64_t &
+    next_id() noexcept
+    {
+        static uint64_t s_id = 1;
+        return s_id;
+    }
+
+    uint64_t m_id;
+    std::unordered_map<uintptr_t, uintptr_t> m_2m;
+    std::unordered_map<uintptr_t, uintptr_t> m_4k;
+};
+
+// -----------------------------------------------------------------------------
+// VMCS / VMX
+// -----------------------------------------------------------------------------
+
+namespace host
+{
+    /// The VMCS fields the module reads or writes
+    ///
+    struct vmcs_state
+    {
+        uint64_t guest_cr3 = 0;
+        uint64_t guest_cr4 = 0;
+        uint64_t guest_rflags = 0x2;
+        uint64_t guest_cs_access_rights = 1 << 13;  // 64-bit code segment
+        uint64_t guest_linear_address = 0;
+        uint64_t guest_physical_address = 0;
+        uint64_t exit_qualification = 0;
+        uint64_t vm_exit_instruction_length = 0;
+        uint64_t vpid = 1;
+        uint64_t eptp = 0;
+        bool cr3_load_exiting = false;
+    };
+
+    /// Returns the current VMCS (what VMPTRLD would have loaded)
+    ///
+    inline vmcs_state *&
+    current_vmcs() noexcept
+    {
+        static vmcs_state s_default;
+        static vmcs_state *s_current = &s_default;
+        return s_current;
+    }
+
+    inline vmcs_state &
+    vmcs() noexcept
+    { return *current_vmcs(); }
+
+    inline uint64_t
+    current_guest_cr3() noexcept
+    { return current_vmcs()->guest_cr3; }
+
+    /// Number of TLB invalidations issued
+    ///
+    struct vmx_counters
+    {
+        uint64_t invept_global = 0;
+        uint64_t invept_single_context = 0;
+        uint64_t invvpid = 0;
+    };
+
+    inline vmx_counters &
+    vmx() noexcept
+    {
+        static vmx_counters s_counters;
+        return s_counters;
+    }
+}
+
+namespace intel_x64
+{
+    namespace vmcs
+    {
+        using value_type = uint64_t;
+
+#define HOST_VMCS_FIELD(name, field) \
+        namespace name \
+        { \
+            inline value_type get() noexcept { return host::vmcs().field; } \
+            inline void set(value_type v) noexcept { host::vmcs().field = v; } \
+        }
+
+        HOST_VMCS_FIELD(guest_cr3, guest_cr3)
+        HOST_VMCS_FIELD(guest_cr4, guest_cr4)
+        HOST_VMCS_FIELD(guest_rflags, guest_rflags)
+        HOST_VMCS_FIELD(guest_cs_access_rights, guest_cs_access_rights)
+        HOST_VMCS_FIELD(guest_linear_address, guest_linear_address)
+        HOST_VMCS_FIELD(guest_physical_address, guest_physical_address)
+        HOST_VMCS_FIELD(vm_exit_instruction_length, vm_exit_instruction_length)
+        HOST_VMCS_FIELD(virtual_processor_identifier, vpid)
+
+#undef HOST_VMCS_FIELD
+
+        namespace guest_ia32_pat
+        {
+            inline value_type get() noexcept { return 0x0007040600070406ULL; }
+        }
+
+        namespace exit_qualification
+        {
+            inline value_type get() noexcept { return host::vmcs().exit_qualification; }
+
+            namespace ept_violation
+            {
+                inline value_type get() noexcept { return host::vmcs().exit_qualification; }
+            }
+
+            namespace control_register_access
+            {
+                inline value_type get() noexcept { return host::vmcs().exit_qualification; }
+            }
+        }
+
+        namespace exit_reason
+        {
+            namespace basic_exit_reason
+            {
+                constexpr const value_type vmcall = 18;
+                constexpr const value_type control_register_accesses = 28;
+                constexpr const value_type monitor_trap_flag = 37;
+                constexpr const value_type ept_violation = 48;
+            }
+        }
+
+        namespace primary_processor_based_vm_execution_controls
+        {
+            namespace cr3_load_exiting
+            {
+                inline void enable() noexcept { host::vmcs().cr3_load_exiting = true; }
+                inline void disable() noexcept { host::vmcs().cr3_load_exiting = false; }
+                inline bool is_enabled() noexcept { return host::vmcs().cr3_load_exiting; }
+            }
+        }
+    }
+
+    namespace vmx
+    {
+        inline void
+        invept_global() noexcept
+        { host::vmx().invept_global++; }
+
+        inline void
+        invept_single_context(uint64_t eptp) noexcept
+        { (void) eptp; host::vmx().invept_single_context++; }
+
+        inline void
+        invvpid_all_contexts() noexcept
+        { host::vmx().invvpid++; }
+
+        inline void
+        invvpid_single_context(uint64_t vpid) noexcept
+        { (void) vpid; host::vmx().invvpid++; }
+
+        inline void
+        invvpid_single_context_global(uint64_t vpid) noexcept
+        { (void) vpid; host::vmx().invvpid++; }
+
+        inline void
+        invvpid_individual_address(uint64_t vpid, uintptr_t addr) noexcept
+        { (void) vpid; (void) addr; host::vmx().invvpid++; }
+    }
+}
+
+struct vmcs_intel_x64_state
+{ };
+
+class vmcs_intel_x64_eapis
+{
+public:
+
+    virtual ~vmcs_intel_x64_eapis() = default;
+
+    virtual void
+    write_fields(gsl::not_null<vmcs_intel_x64_state *> host_state,
+                 gsl::not_null<vmcs_intel_x64_state *> guest_state)
+    { (void) host_state; (void) guest_state; }
+
+    void enable_vpid() noexcept { }
+    void enable_ept() noexcept { }
+
+    void
+    set_eptp(uint64_t eptp) noexcept
+    { host::vmcs().eptp = eptp; }
+};
+
+// -----------------------------------------------------------------------------
+// Exit Handler
+// -----------------------------------------------------------------------------
+
+class exit_handler_intel_x64_eapis
+{
+public:
+
+    exit_handler_intel_x64_eapis() = default;
+    virtual ~exit_handler_intel_x64_eapis() = default;
+
+    /// Dispatches a monitor trap exit to the registered callback
+    ///
+    virtual void
+    handle_exit(intel_x64::vmcs::value_type reason)
+    {
+        if (reason == intel_x64::vmcs::exit_reason::basic_exit_reason::monitor_trap_flag && m_monitor_trap != nullptr)
+        {
+            const auto callback = m_monitor_trap;
+            m_monitor_trap = nullptr;
+
+            (this->*callback)();
+        }
+    }
+
+    virtual void
+    handle_vmcall_registers(vmcall_registers_t &regs)
+    { (void) regs; }
+
+    /// On hardware resume() doesn't return. Here it does, and the caller
+    /// falls through to the base class, which has nothing left to do.
+    ///
+    void
+    resume() noexcept
+    { }
+
+    void
+    advance_rip() noexcept
+    { m_state_save->rip += intel_x64::vmcs::vm_exit_instruction_length::get(); }
+
+    template<class T>
+    void
+    register_monitor_trap(void (T::*callback)()) noexcept
+    { m_monitor_trap = static_cast<void (exit_handler_intel_x64_eapis::*)()>(callback); }
+
+    /// Returns true if the guest is being single-stepped
+    ///
+    bool
+    monitor_trap_pending() const noexcept
+    { return m_monitor_trap != nullptr; }
+
+    void
+    set_state(vmcs_intel_x64_eapis *vmcs, state_save_intel_x64 *state_save) noexcept
+    {
+        m_vmcs_eapis = vmcs;
+        m_state_save = state_save;
+    }
+
+protected:
+
+    vmcs_intel_x64_eapis *m_vmcs_eapis = nullptr;
+    state_save_intel_x64 *m_state_save = nullptr;
+
+private:
+
+    void (exit_handler_intel_x64_eapis::*m_monitor_trap)() = nullptr;
+};
+
+#endif
@@ -0,0 +1,148 @@
+#ifndef HOST_VCPU_H
+#define HOST_VCPU_H
+
+#include <host_stub.h>
+
+#include <vmcs/vmcs_hook.h>
+#include <exit_handler/tlb_handler.h>
+
+namespace host
+{
+    /// Host vCPU
+    ///
+    /// Owns a vmcs_hook and a tlb_handler for one vCPU, together with the
+    /// VMCS and the register state they work on, and turns guest events
+    /// into the VM exits the hardware would deliver.
+    ///
+    /// Like the real VMM, this includes the module's headers, which define
+    /// its globals, so only one translation unit of a program may use it.
+    ///
+    class vcpu
+    {
+    public:
+
+        /// Constructor
+        ///
+        /// @param id the id of the vCPU
+        /// @param cr3 the initial guest CR3
+        ///
+        explicit vcpu(vcpuid::type id, uint64_t cr3 = 0x1000)
+            : m_vmcs_hook(id)
+        {
+            m_vmcs.guest_cr3 = cr3;
+            m_vmcs.vpid = id + 1;
+            m_state.vcpuid = id;
+
+            load();
+
+            vmcs_intel_x64_state host_state;
+            vmcs_intel_x64_state guest_state;
+            m_vmcs_hook.write_fields(&host_state, &guest_state);
+
+            m_tlb_handler = std::make_unique<tlb_handler>(id);
+            m_tlb_handler->set_state(&m_vmcs_hook, &m_state);
+        }
+
+        vcpu(const vcpu &) = delete;
+        vcpu &operator=(const vcpu &) = delete;
+
+        /// VMCALL (VMCALL_REGISTERS)
+        ///
+        /// @return what the VMCALL returned in r02
+        ///
+        uintptr_t
+        vmcall(uintptr_t method, uintptr_t r03 = 0, uintptr_t r04 = 0, uintptr_t r05 = 0)
+        {
+            load();
+
+            vmcall_registers_t regs = {};
+            regs.r02 = method;
+            regs.r03 = r03;
+            regs.r04 = r04;
+            regs.r05 = r05;
+
+            m_tlb_handler->handle_vmcall_registers(regs);
+            return regs.r02;
+        }
+
+        /// EPT violation
+        ///
+        /// If the handler starts single-stepping the guest, the monitor trap
+        /// exits of the stepped instructions are delivered as well.
+        ///
+        /// @param rip the address of the faulting instruction
+        /// @param gva the guest virtual address that was accessed
+        /// @param access_bits bit 0 = read, bit 1 = write, bit 2 = exec
+        ///
+        void
+        ept_violation(uint64_t rip, uint64_t gva, uint64_t access_bits)
+        {
+            load();
+
+            m_vmcs.guest_linear_address = gva;
+            m_vmcs.guest_physical_address = translate(gva, m_vmcs.guest_cr3);
+            // The guest linear address is valid (bit 7), and the access
+            // was to the page itself, not to a paging structure (bit 8).
+            m_vmcs.exit_qualification = access_bits | (1ULL << 7) | (1ULL << 8);
+            m_vmcs.vm_exit_instruction_length = 0;
+            m_state.rip = rip;
+
+            m_tlb_handler->handle_exit(intel_x64::vmcs::exit_reason::basic_exit_reason::ept_violation);
+
+            while (m_tlb_handler->monitor_trap_pending())
+                exit(intel_x64::vmcs::exit_reason::basic_exit_reason::monitor_trap_flag);
+        }
+
+        /// MOV to CR3
+        ///
+        /// Delivers a control register access exit if CR3-load exiting is
+        /// enabled, and just loads CR3 otherwise.
+        ///
+        void
+        mov_to_cr3(uint64_t cr3)
+        {
+            load();
+
+            if (!m_vmcs.cr3_load_exiting)
+            {
+                m_vmcs.guest_cr3 = cr3 & ~(1ULL << 63);
+                return;
+            }
+
+            // MOV CR3, RAX (0F 22 D8)
+            m_state.rax = cr3;
+            m_vmcs.exit_qualification = 3;
+            m_vmcs.vm_exit_instruction_length = 3;
+
+            m_tlb_handler->handle_exit(intel_x64::vmcs::exit_reason::basic_exit_reason::control_register_accesses);
+        }
+
+        /// Any other VM exit
+        ///
+        void
+        exit(uint64_t reason)
+        {
+            load();
+            m_tlb_handler->handle_exit(reason);
+        }
+
+        tlb_handler &handler() noexcept { return *m_tlb_handler; }
+        vmcs_state &fields() noexcept { return m_vmcs; }
+        state_save_intel_x64 &state() noexcept { return m_state; }
+
+    private:
+
+        // VMPTRLD
+        void
+        load() noexcept
+        { current_vmcs() = &m_vmcs; }
+
+        vmcs_state m_vmcs;
+        state_save_intel_x64 m_state = {};
+
+        vmcs_hook m_vmcs_hook;
+        std::unique_ptr<tlb_handler> m_tlb_handler;
+    };
+}
+
+#endif
@@ -0,0 +1,2 @@
+// Host build: see host_stub.h
+#include <host_stub.h>
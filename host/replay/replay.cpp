@@ -0,0 +1,511 @@
+#include <host_vcpu.h>
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Replays a stream of guest events through the real tlb_handler on the
+// host (see host_stub.h), and reports how fast the exit path handles them.
+//
+// Trace format (one event per line, numbers in C notation, '#' comments):
+//
+//   vcpu <id>                              switch to (or create) a vCPU
+//   cr3 <value>                            MOV to CR3
+//   vmcall <method> [<r03> [<r04> [<r05>]]] [= <r02>]
+//                                          VMCALL, optionally checking r02
+//   read|write|exec <rip> <gva>            EPT violation
+//   exit <reason>                          any other VM exit
+//   poke <gva> <byte>...                   guest writes memory (no exit)
+//   measure                                start measuring here
+//
+// Events before "measure" (typically creating and activating the splits)
+// are replayed, but not timed.
+
+struct event {
+
+    enum kind_t {
+        vcpu,
+        cr3,
+        vmcall,
+        violation,
+        exit,
+        poke,
+        measure
+    };
+
+    kind_t kind = exit;
+    uint64_t args[4] = {0, 0, 0, 0};
+    bool check = false;
+    uint64_t expected = 0;
+    std::vector<uint8_t> bytes;
+};
+
+constexpr const uint64_t access_read = 1;
+constexpr const uint64_t access_write = 2;
+constexpr const uint64_t access_exec = 4;
+
+static const char *
+access_name(const uint64_t bits)
+{
+    switch (bits)
+    {
+        case access_read: return "read";
+        case access_write: return "write";
+        default: return "exec";
+    }
+}
+
+static bool
+parse_event(const std::string &line, event &e)
+{
+    std::istringstream in(line.substr(0, line.find('#')));
+    std::string cmd;
+
+    if (!(in >> cmd))
+        return false;
+
+    std::vector<uint64_t> nums;
+    std::string tok;
+    while (in >> tok)
+    {
+        if (tok == "=")
+        {
+            if (!(in >> tok))
+                throw std::runtime_error("missing value after '='");
+
+            e.check = true;
+            e.expected = std::stoull(tok, nullptr, 0);
+            break;
+        }
+
+        nums.push_back(std::stoull(tok, nullptr, 0));
+    }
+
+    auto &&args = [&](size_t min, size_t max)
+    {
+        if (nums.size() < min || nums.size() > max)
+            throw std::runtime_error("wrong number of arguments for '" + cmd + "'");
+
+        for (size_t i = 0; i < nums.size() && i < 4; i++)
+            e.args[i] = nums[i];
+    };
+
+    if (cmd == "vcpu") { e.kind = event::vcpu; args(1, 1); }
+    else if (cmd == "cr3") { e.kind = event::cr3; args(1, 1); }
+    else if (cmd == "vmcall") { e.kind = event::vmcall; args(1, 4); }
+    else if (cmd == "read") { e.kind = event::violation; args(2, 2); e.args[2] = access_read; }
+    else if (cmd == "write") { e.kind = event::violation; args(2, 2); e.args[2] = access_write; }
+    else if (cmd == "exec") { e.kind = event::violation; args(2, 2); e.args[2] = access_exec; }
+    else if (cmd == "exit") { e.kind = event::exit; args(1, 1); }
+    else if (cmd == "measure") { e.kind = event::measure; args(0, 0); }
+    else if (cmd == "poke")
+    {
+        if (nums.size() < 2)
+            throw std::runtime_error("wrong number of arguments for 'poke'");
+
+        e.kind = event::poke;
+        e.args[0] = nums[0];
+        for (size_t i = 1; i < nums.size(); i++)
+            e.bytes.push_back(static_cast<uint8_t>(nums[i]));
+    }
+    else
+        throw std::runtime_error("unknown event '" + cmd + "'");
+
+    if (e.check && e.kind != event::vmcall)
+        throw std::runtime_error("'=' only applies to vmcall");
+
+    return true;
+}
+
+static std::vector<event>
+load_trace(std::istream &in)
+{
+    std::vector<event> events;
+    std::string line;
+    size_t line_num = 0;
+
+    while (std::getline(in, line))
+    {
+        line_num++;
+
+        try
+        {
+            event e;
+            if (parse_event(line, e))
+                events.push_back(std::move(e));
+        }
+        catch (std::exception &ex)
+        {
+            throw std::runtime_error("line " + std::to_string(line_num) + ": " + ex.what());
+        }
+    }
+
+    return events;
+}
+
+/// Synthetic workload
+///
+/// Creates and activates <splits> splits on consecutive pages, then
+/// touches random splits from <vcpus> vCPUs the way a guest that runs
+/// hooked code and reads its own constants would. Only accesses that
+/// fault in the current state of the vCPU's EPT view are generated:
+///
+/// - on the code page: reads (emulated, RIP-relative loads from a
+///   separate code area) and writes (flip to the data page)
+/// - on the data page: instruction fetches (flip back to the code page)
+///
+static std::vector<event>
+synthetic_trace(const uint64_t splits, const uint64_t num_events, const uint64_t vcpus)
+{
+    constexpr const uint64_t split_base = 0x10000000;
+    constexpr const uint64_t code_base = 0x08000000;
+    constexpr const uint64_t insn_size = 8;
+
+    std::vector<event> events;
+    events.reserve(splits * 3 + num_events + num_events / 4 + 8);
+
+    auto &&add = [&](event::kind_t kind, uint64_t a0 = 0, uint64_t a1 = 0, uint64_t a2 = 0)
+    {
+        event e;
+        e.kind = kind;
+        e.args[0] = a0;
+        e.args[1] = a1;
+        e.args[2] = a2;
+        events.push_back(std::move(e));
+        return &events.back();
+    };
+
+    auto &&gva_of = [&](uint64_t i) { return split_base + i * 0x1000; };
+    auto &&load_rip = [&](uint64_t i) { return code_base + i * insn_size; };
+    auto &&load_target = [&](uint64_t i) { return gva_of(i) + ((i * insn_size) & 0xFF8); };
+
+    // mov eax, [rip + disp32] in the code area, one per split
+    for (uint64_t i = 0; i < splits; i++)
+    {
+        const auto &&disp = static_cast<uint32_t>(load_target(i) - (load_rip(i) + 6));
+
+        auto &&e = add(event::poke, load_rip(i));
+        e->bytes = { 0x8B, 0x05,
+                     static_cast<uint8_t>(disp), static_cast<uint8_t>(disp >> 8),
+                     static_cast<uint8_t>(disp >> 16), static_cast<uint8_t>(disp >> 24),
+                     0x90, 0x90 };
+    }
+
+    add(event::vcpu, 0);
+    for (uint64_t i = 0; i < splits; i++)
+    {
+        for (const uint64_t method : {1, 2}) // create_split_context, activate_split
+        {
+            auto &&e = add(event::vmcall, method, gva_of(i));
+            e->check = true;
+            e->expected = 1;
+        }
+    }
+
+    for (uint64_t v = 1; v < vcpus; v++)
+        add(event::vcpu, v);
+
+    add(event::measure);
+
+    // Per vCPU and split: true while the split is on the code page.
+    std::vector<bool> on_code(splits * vcpus, true);
+
+    uint64_t seed = 0x2545F4914F6CDD1DULL;
+    auto &&next = [&]()
+    {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        return seed;
+    };
+
+    uint64_t current_vcpu = vcpus - 1;
+    for (uint64_t n = 0; n < num_events; n++)
+    {
+        const auto &&r = next();
+        const auto &&v = (r >> 48) % vcpus;
+        const auto &&i = (r >> 8) % splits;
+
+        if (v != current_vcpu)
+        {
+            add(event::vcpu, v);
+            current_vcpu = v;
+        }
+
+        const auto &&state = on_code.begin() + static_cast<ptrdiff_t>(v * splits + i);
+        if (!*state)
+        {
+            add(event::violation, gva_of(i) + 0x10, gva_of(i) + 0x10, access_exec);
+            *state = true;
+        }
+        else if ((r & 0xF) != 0)
+            add(event::violation, load_rip(i), load_target(i), access_read);
+        else
+        {
+            add(event::violation, load_rip(i), load_target(i), access_write);
+            *state = false;
+        }
+    }
+
+    return events;
+}
+
+static void
+dump_trace(const std::vector<event> &events, std::ostream &out)
+{
+    out << std::hex << std::showbase;
+
+    for (const auto &e : events)
+    {
+        switch (e.kind)
+        {
+            case event::vcpu: out << "vcpu " << std::dec << e.args[0] << std::hex; break;
+            case event::cr3: out << "cr3 " << e.args[0]; break;
+            case event::vmcall:
+                out << "vmcall " << std::dec << e.args[0] << std::hex << ' ' << e.args[1] << ' ' << e.args[2] << ' ' << e.args[3];
+                if (e.check)
+                    out << " = " << e.expected;
+                break;
+            case event::violation: out << access_name(e.args[2]) << ' ' << e.args[0] << ' ' << e.args[1]; break;
+            case event::exit: out << "exit " << std::dec << e.args[0] << std::hex; break;
+            case event::poke:
+                out << "poke " << e.args[0];
+                for (const auto &b : e.bytes)
+                    out << ' ' << static_cast<unsigned>(b);
+                break;
+            case event::measure: out << "measure"; break;
+        }
+
+        out << '\n';
+    }
+}
+
+struct replay_stats {
+    uint64_t exits = 0;
+    uint64_t violations[3] = {0, 0, 0};   // read, write, exec
+    uint64_t vmcalls = 0;
+    uint64_t cr3_loads = 0;
+    uint64_t failed_checks = 0;
+    uint64_t invept = 0;
+    uint64_t invvpid = 0;
+    double seconds = 0;
+};
+
+/// Prints the debug events the module recorded (see read_event_log())
+///
+static void
+drain_event_log(host::vcpu &vcpu)
+{
+    constexpr const uint64_t log_addr = 0x30000000;
+    std::vector<uint8_t> text(64 * 1024);
+
+    while (const auto size = vcpu.vmcall(15, log_addr, text.size()))
+    {
+        host::copy_guest(log_addr, vcpu.fields().guest_cr3, text.data(), size, false);
+        std::cerr.write(reinterpret_cast<const char *>(text.data()), static_cast<std::streamsize>(size));
+    }
+}
+
+static replay_stats
+replay(const std::vector<event> &events)
+{
+    std::vector<std::unique_ptr<host::vcpu>> vcpus;
+    host::vcpu *current = nullptr;
+
+    auto &&select = [&](uint64_t id)
+    {
+        if (id >= vcpus.size())
+            vcpus.resize(id + 1);
+
+        if (!vcpus[id])
+            vcpus[id] = std::make_unique<host::vcpu>(id);
+
+        current = vcpus[id].get();
+    };
+
+    replay_stats stats;
+    auto &&start = std::chrono::steady_clock::now();
+    auto &&invept = host::vmx().invept_single_context + host::vmx().invept_global;
+    auto &&invvpid = host::vmx().invvpid;
+
+    for (const auto &e : events)
+    {
+        if (current == nullptr && e.kind != event::vcpu && e.kind != event::poke && e.kind != event::measure)
+            select(0);
+
+        switch (e.kind)
+        {
+            case event::vcpu:
+                select(e.args[0]);
+                break;
+
+            case event::cr3:
+                current->mov_to_cr3(e.args[0]);
+                stats.cr3_loads++;
+                stats.exits++;
+                break;
+
+            case event::vmcall:
+            {
+                const auto &&ret = current->vmcall(e.args[0], e.args[1], e.args[2], e.args[3]);
+                if (e.check && ret != e.expected)
+                {
+                    std::cerr << "vmcall " << e.args[0] << " returned " << ret << ", expected " << e.expected << std::endl;
+                    stats.failed_checks++;
+                }
+
+                stats.vmcalls++;
+                stats.exits++;
+                break;
+            }
+
+            case event::violation:
+                current->ept_violation(e.args[0], e.args[1], e.args[2]);
+                stats.violations[e.args[2] == access_read ? 0 : (e.args[2] == access_write ? 1 : 2)]++;
+                stats.exits++;
+                break;
+
+            case event::exit:
+                current->exit(e.args[0]);
+                stats.exits++;
+                break;
+
+            case event::poke:
+            {
+                auto &&cr3 = current != nullptr ? current->fields().guest_cr3 : 0;
+                auto &&bytes = const_cast<uint8_t *>(e.bytes.data());
+                host::copy_guest(e.args[0], cr3, bytes, e.bytes.size(), true);
+                break;
+            }
+
+            case event::measure:
+            {
+                const auto failed_checks = stats.failed_checks;
+                stats = replay_stats();
+                stats.failed_checks = failed_checks;
+
+                invept = host::vmx().invept_single_context + host::vmx().invept_global;
+                invvpid = host::vmx().invvpid;
+                start = std::chrono::steady_clock::now();
+                break;
+            }
+        }
+
+        if (host::verbose() && current != nullptr)
+            drain_event_log(*current);
+    }
+
+    auto &&end = std::chrono::steady_clock::now();
+
+    stats.seconds = std::chrono::duration<double>(end - start).count();
+    stats.invept = host::vmx().invept_single_context + host::vmx().invept_global - invept;
+    stats.invvpid = host::vmx().invvpid - invvpid;
+
+    return stats;
+}
+
+static void
+print_usage()
+{
+    std::cout << "Usage: replay [--verbose] <trace>" << std::endl
+              << "       replay [--verbose] [--dump] --synthetic <splits> <events> [<vcpus>]" << std::endl
+              << std::endl
+              << "  <trace>: trace file, or - for stdin (see the top of replay.cpp for the format)" << std::endl
+              << "  --synthetic: generate a random workload over <splits> active splits" << std::endl
+              << "  --dump: print the generated trace instead of replaying it" << std::endl
+              << "  --verbose: show the module's debug output" << std::endl;
+}
+
+int
+main(int argc, const char *argv[])
+{
+    std::vector<std::string> args(argv + 1, argv + argc);
+
+    auto &&take_flag = [&](const std::string &flag)
+    {
+        auto &&it = std::find(args.begin(), args.end(), flag);
+        if (it == args.end())
+            return false;
+
+        args.erase(it);
+        return true;
+    };
+
+    host::verbose() = take_flag("--verbose");
+    const auto dump = take_flag("--dump");
+
+    try
+    {
+        std::vector<event> events;
+
+        if (!args.empty() && args[0] == "--synthetic" && (args.size() == 3 || args.size() == 4))
+        {
+            const auto &&splits = std::stoull(args[1], nullptr, 0);
+            const auto &&num_events = std::stoull(args[2], nullptr, 0);
+            const auto &&vcpus = args.size() == 4 ? std::stoull(args[3], nullptr, 0) : 1;
+
+            if (splits == 0 || vcpus == 0)
+                throw std::runtime_error("need at least one split and one vCPU");
+
+            events = synthetic_trace(splits, num_events, vcpus);
+        }
+        else if (args.size() == 1 && args[0] == "-")
+            events = load_trace(std::cin);
+        else if (args.size() == 1 && args[0][0] != '-')
+        {
+            std::ifstream file(args[0]);
+            if (!file)
+                throw std::runtime_error("can't open " + args[0]);
+
+            events = load_trace(file);
+        }
+        else
+        {
+            print_usage();
+            return 1;
+        }
+
+        if (dump)
+        {
+            dump_trace(events, std::cout);
+            return 0;
+        }
+
+        const auto &&stats = replay(events);
+
+        std::cout << "exits:      " << stats.exits << std::endl
+                  << "  read:     " << stats.violations[0] << std::endl
+                  << "  write:    " << stats.violations[1] << std::endl
+                  << "  exec:     " << stats.violations[2] << std::endl
+                  << "  vmcall:   " << stats.vmcalls << std::endl
+                  << "  cr3:      " << stats.cr3_loads << std::endl
+                  << "invept:     " << stats.invept << std::endl
+                  << "invvpid:    " << stats.invvpid << std::endl
+                  << "splits:     " << g_splits.size() << std::endl
+                  << "code pages: " << g_code_page_cache.size() << std::endl;
+
+        if (stats.seconds > 0 && stats.exits > 0)
+        {
+            std::cout << "time:       " << stats.seconds << " s" << std::endl
+                      << "rate:       " << static_cast<uint64_t>(stats.exits / stats.seconds) << " exits/s ("
+                      << stats.seconds * 1e9 / stats.exits << " ns/exit)" << std::endl;
+        }
+
+        if (stats.failed_checks != 0)
+        {
+            std::cerr << stats.failed_checks << " vmcall check(s) failed" << std::endl;
+            return 2;
+        }
+    }
+    catch (std::exception &e)
+    {
+        std::cerr << "error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -7,8 +7,8 @@
 std::unique_ptr<vcpu>
 vcpu_factory::make_vcpu(vcpuid::type vcpuid, user_data *data)
 {
-    auto &&my_vmcs = std::make_unique<vmcs_hook>();
-    auto &&my_tlb_handler = std::make_unique<tlb_handler>();
+    auto &&my_vmcs = std::make_unique<vmcs_hook>(vcpuid);
+    auto &&my_tlb_handler = std::make_unique<tlb_handler>(vcpuid);
 
     (void) data;
     return std::make_unique<vcpu_intel_x64>(
@@ -1,6 +1,7 @@
 #ifndef VMCS_HOOK_H
 #define VMCS_HOOK_H
 
+#include <vcpuid.h>
 #include <vmcs/root_ept_intel_x64.h>
 #include <vmcs/vmcs_intel_x64_eapis.h>
 
@@ -11,18 +12,23 @@ using namespace vmcs;
 #define MAX_PHYS_ADDR 0x2000000000
 #endif
 
-// g_root_ept: main global EPT
 // g_clean_ept: globsl EPT which is kept clean
-std::unique_ptr<root_ept_intel_x64> g_root_ept;
 std::unique_ptr<root_ept_intel_x64> g_clean_ept;
 
+// Returns the EPT view of a vCPU, creating it if needed (see tlb_handler.h)
+root_ept_intel_x64 &get_ept_view(vcpuid::type vcpuid);
+
 class vmcs_hook : public vmcs_intel_x64_eapis
 {
 public:
 
-    /// Default Constructor
+    /// Constructor
+    ///
+    /// @param vcpuid the id of the vCPU this VMCS belongs to
     ///
-    vmcs_hook() = default;
+    explicit vmcs_hook(vcpuid::type vcpuid)
+        : m_vcpuid(vcpuid)
+    { }
 
     /// Destructor
     ///
@@ -46,14 +52,12 @@ public:
         if (!initialized)
         {
             // Create EPT instance
-            g_root_ept = std::make_unique<root_ept_intel_x64>();
             g_clean_ept = std::make_unique<root_ept_intel_x64>();
 
             // Setup identity map (2m)
-            g_root_ept->setup_identity_map_2m(0, MAX_PHYS_ADDR);
             g_clean_ept->setup_identity_map_2m(0, MAX_PHYS_ADDR);
 
-            // Since EPT in the Extended APIs is global, we should only set it
+            // The clean EPT is shared by all vCPUs, so we should only set it
             // up once.
             initialized = true;
 
@@ -64,11 +68,16 @@ public:
         // using VPID as well, and Intel comes with TLB invalidation
         // instructions that leverage VPID, which provide per-line invalidation
         // which you don't get without VPID. We also need to set the eptp that
-        // we plan to use.
+        // we plan to use. Every vCPU gets its own EPT view, so flipping a
+        // split page on one vCPU doesn't affect the others.
         this->enable_vpid();
         this->enable_ept();
-        this->set_eptp(g_root_ept->eptp());
+        this->set_eptp(get_ept_view(m_vcpuid).eptp());
     }
+
+private:
+
+    vcpuid::type m_vcpuid;
 };
 
 #endif